@@ -30,12 +30,67 @@
 
 #include "crypto_helper.h"
 
-#define AMZ_DATE_MAX_LEN 20
-#define STRING_TO_SIGN_LENGTH 3000
+#if (__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define AMZ_DATE_LENGTH 16 /* YYYYMMDDTHHMMSSZ */
 #define AMZ_DATE_WIDTH 8
 
+/* values of aws_payload_signing */
+#define NGX_AWS_AUTH_PAYLOAD_NONE   0 /* only body-less requests are signed */
+#define NGX_AWS_AUTH_PAYLOAD_SHA256 1 /* body is hashed while it is read */
+#define NGX_AWS_AUTH_PAYLOAD_STREAMING 2 /* body is re-framed as signed aws-chunked */
+#define NGX_AWS_AUTH_PAYLOAD_UNSIGNED 3 /* body is sent unsigned with a crc32c trailer */
+
+#define AWS_CHUNK_SIZE_MIN 8192
+#define AWS_CHUNK_SIZE_DEFAULT 65536
+
+#define AWS_KEY_EPOCH_SECONDS 86400 /* a signing key is good for one UTC day */
+#define AWS_PRESIGN_EXPIRES_MAX 604800 /* the longest a presigned URL may last, seven days */
+#define AWS_VERIFY_MAX_SKEW 900 /* how far a client's x-amz-date may be from ours, as S3 allows */
+#define AWS_TIME_BUCKET_MAX 300 /* longest x-amz-date may lag behind, leaving S3's skew for the clocks */
+#define AWS_MULTIPART_PARTS_MAX 10000 /* S3's limits on multipart uploads */
+#define AWS_MULTIPART_PART_SIZE_MIN (5 * 1024 * 1024)
+#define AWS_MULTIPART_PART_SIZE_MAX ((off_t) 5 * 1024 * 1024 * 1024)
+
 typedef ngx_keyval_t header_pair_t;
 
+// A signing key with the scope and the UTC day it is valid for. An epoch is
+// never written to once built; the next day gets a new one, so whoever
+// still holds the old epoch keeps a consistent key and scope
+typedef struct {
+    ngx_str_t key_scope;
+    ngx_str_t signing_key;
+    ngx_aws_auth__hmac_key_t *hmac_key; // signing_key with its pads hashed
+    time_t valid_from;  // midnight UTC starting the day of the scope
+    time_t valid_until; // the midnight after
+    ngx_pool_t *pool;   // the epoch's own pool, NULL when owned by the configuration
+    ngx_uint_t refs;    // requests still using an epoch with its own pool
+    unsigned retired:1; // rotated out, its pool goes with the last request
+} ngx_aws_auth_key_epoch_t;
+
+// The parts of a signature that are the same for every request of a
+// location, compiled once at configuration time by
+// ngx_aws_auth__compile_template
+typedef struct {
+    ngx_str_t host_line;           // "host:<bucket>.<endpoint>\n", only ever hashed
+    ngx_str_t host;                // "<bucket>.<endpoint>", within host_line
+    ngx_str_t signed_header_names; // of the headers every request carries
+    ngx_str_t credential;          // "AWS4-HMAC-SHA256 Credential=<access key>/"
+    ngx_str_t signature_prefix;    // ",SignedHeaders=<names>,Signature="
+    ngx_str_t presign_credential;  // "<access key>%2F" escaped, the X-Amz-Credential before the scope
+    time_t time_bucket;            // seconds x-amz-date is rounded down to, 1 by default
+} ngx_aws_auth_template_t;
+
+// A prepared signature still to be computed: the MAC of string_to_sign goes
+// into the NGX_AWS_AUTH__SHA256_HEX_LENGTH bytes at signature, the end of the
+// authorization header
+typedef struct {
+    ngx_str_t string_to_sign;
+    u_char *signature;
+} ngx_aws_auth_pending_signature_t;
+
 typedef struct {
     ngx_str_t access_key;
     ngx_str_t key_scope;
@@ -45,10 +100,72 @@ typedef struct {
     ngx_str_t service;
     ngx_str_t endpoint;
     ngx_str_t bucket_name;
+    ngx_http_complex_value_t *bucket_value; // aws_s3_bucket with variables, NULL when bucket_name is all there is
+    ngx_int_t bucket_cache;        // templates of bucket_value's buckets kept per worker
+    void *bucket_memo;             // of the worker, created on first use
     ngx_uint_t enabled;
+    ngx_uint_t lazy;               // body-less requests are signed by $s3_auth_token
+    ngx_uint_t payload_signing;
+    ngx_flag_t content_md5;
+    size_t chunk_size;
+    ngx_shm_zone_t *key_zone; // signing keys shared between workers, may be NULL
+    ngx_aws_auth_key_epoch_t *epoch;      // signs requests up to epoch->valid_until
+    ngx_aws_auth_key_epoch_t *next_epoch; // built ahead of midnight by the rotation timer
+    ngx_aws_auth_key_epoch_t *prev_epoch; // retired, released on the next rotation
+    ngx_aws_auth_template_t sign_template;
+    ngx_uint_t sign_batch;         // requests signed together, 0 to sign each one at once
+    ngx_msec_t sign_batch_timeout; // longest a request waits for the batch to fill
+    ngx_flag_t presign_redirect;   // GET and HEAD are redirected to a presigned URL
+    time_t presign_expires;        // X-Amz-Expires of presigned URLs
+    ngx_flag_t verify;             // requests must carry a signature of an aws_verify_key
+    time_t time_bucket;            // copied into sign_template
+    ngx_int_t sign_cache;          // requests whose signed headers are kept per worker, 0 for none
+    void *sign_memo;               // of the worker, created on first use
+    ngx_str_t fanout_uri;          // where the ranges of aws_fanout are requested
+    ngx_uint_t fanout_parallel;    // ranges requested at once, 0 not to split GETs
+    size_t fanout_part_size;
+    ngx_str_t multipart_uri;       // where the requests of aws_multipart go
+    ngx_uint_t multipart_parallel; // parts uploaded at once, 0 not to split PUTs
+    size_t multipart_part_size;
+#if (NGX_THREADS)
+    ngx_thread_pool_t *hash_thread_pool;
+#endif
+    size_t hash_thread_min_size;   // bodies hashed in hash_thread_pool, with threads
 } ngx_http_aws_auth_conf_t;
 
 
+typedef struct {
+    ngx_aws_auth__sha256_ctx_t *sha256;
+    ngx_aws_auth__md5_ctx_t *md5; // NULL unless Content-MD5 was asked for
+    ngx_str_t payload_hash;       // hex, valid once finalized
+    ngx_str_t content_md5;        // base64, valid once finalized
+} ngx_aws_auth_payload_digest_t;
+
+// state for signing the chunks of an aws-chunked body, every chunk
+// signature is chained from the previous one starting at the seed signature
+// of the request headers. The key, scope and date are copies so that a key
+// rotation during a long upload does not change them under our feet
+typedef struct {
+    ngx_aws_auth__hmac_key_t *hmac_key;
+    ngx_str_t key_scope;
+    ngx_str_t date;
+    u_char signature[NGX_AWS_AUTH__SHA256_HEX_LENGTH];
+    ngx_str_t string_to_sign; // scratch space, sized once for the scope
+} ngx_aws_auth_chunk_signer_t;
+
+// The fields of a client's "AWS4-HMAC-SHA256 Credential=..., SignedHeaders=...,
+// Signature=..." authorization header, see ngx_aws_auth__parse_authorization.
+// All of them point into the header value
+typedef struct {
+    ngx_str_t access_key;
+    ngx_str_t key_scope;           // "<date>/<region>/<service>/aws4_request"
+    ngx_str_t date;                // YYYYMMDD, within key_scope
+    ngx_str_t region;              // within key_scope
+    ngx_str_t service;             // within key_scope
+    ngx_str_t signed_header_names;
+    ngx_str_t signature;           // hex
+} ngx_aws_auth_credential_t;
+
 struct AwsCanonicalRequestDetails {
     ngx_str_t *canon_request;
     ngx_str_t *signed_header_names;
@@ -67,12 +184,15 @@ struct AwsSignedRequestDetails {
     ngx_array_t *header_list; // list of header_pair_t
 };
 
-// mainly useful to avoid having to full instantiate request structures for
-// tests...
-#define safe_ngx_log_error(req, ...)                                  \
-  if (req->connection) {                                              \
-    ngx_log_error(NGX_LOG_ERR, req->connection->log, 0, __VA_ARGS__); \
-  }
+// whether strings that only exist for the debug log are worth building,
+// false for the requests of the tests that have no connection
+#if (NGX_DEBUG)
+#define ngx_aws_auth__debug_enabled(req)                                \
+  ((req)->connection != NULL                                            \
+   && ((req)->connection->log->log_level & NGX_LOG_DEBUG_HTTP))
+#else
+#define ngx_aws_auth__debug_enabled(req) 0
+#endif
 
 static const ngx_str_t EMPTY_STRING_SHA256 = ngx_string(
         "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
@@ -81,17 +201,104 @@ static const ngx_str_t AMZ_HASH_HEADER = ngx_string("x-amz-content-sha256");
 static const ngx_str_t AMZ_DATE_HEADER = ngx_string("x-amz-date");
 static const ngx_str_t HOST_HEADER = ngx_string("host");
 static const ngx_str_t AUTHZ_HEADER = ngx_string("authorization");
+static const ngx_str_t CONTENT_MD5_HEADER = ngx_string("content-md5");
+static const ngx_str_t CONTENT_ENCODING_HEADER = ngx_string("content-encoding");
+static const ngx_str_t AMZ_DECODED_LENGTH_HEADER = ngx_string("x-amz-decoded-content-length");
+static const ngx_str_t AWS_CHUNKED_ENCODING = ngx_string("aws-chunked");
+static const ngx_str_t STREAMING_PAYLOAD_HASH = ngx_string("STREAMING-AWS4-HMAC-SHA256-PAYLOAD");
+static const ngx_str_t CHUNK_SIGNATURE_PREFIX = ngx_string(";chunk-signature=");
+static const ngx_str_t CHUNK_STRING_TO_SIGN_PREFIX = ngx_string("AWS4-HMAC-SHA256-PAYLOAD\n");
+static const ngx_str_t UNSIGNED_PAYLOAD_HASH = ngx_string("UNSIGNED-PAYLOAD");
+static const ngx_str_t UNSIGNED_TRAILER_PAYLOAD_HASH = ngx_string("STREAMING-UNSIGNED-PAYLOAD-TRAILER");
+static const ngx_str_t AMZ_TRAILER_HEADER = ngx_string("x-amz-trailer");
+static const ngx_str_t AMZ_CHECKSUM_CRC32C_HEADER = ngx_string("x-amz-checksum-crc32c");
+static const ngx_str_t STRING_TO_SIGN_PREFIX = ngx_string("AWS4-HMAC-SHA256\n");
+static const ngx_str_t AUTH_CREDENTIAL_PREFIX = ngx_string("AWS4-HMAC-SHA256 Credential=");
+static const ngx_str_t AUTH_SIGNED_HEADERS_PREFIX = ngx_string(",SignedHeaders=");
+static const ngx_str_t AUTH_SIGNATURE_PREFIX = ngx_string(",Signature=");
+static const ngx_str_t AUTH_KEY_SCOPE_TERMINATOR = ngx_string("aws4_request");
+// the headers every signed request carries, in canonical order
+static const ngx_str_t FIXED_SIGNED_HEADERS = ngx_string("host;x-amz-content-sha256;x-amz-date");
+// the arguments of a presigned URL, in canonical order but for the signature
+static const ngx_str_t PRESIGN_ALGORITHM_ARG = ngx_string("X-Amz-Algorithm");
+static const ngx_str_t PRESIGN_ALGORITHM = ngx_string("AWS4-HMAC-SHA256");
+static const ngx_str_t PRESIGN_CREDENTIAL_ARG = ngx_string("X-Amz-Credential");
+static const ngx_str_t PRESIGN_DATE_ARG = ngx_string("X-Amz-Date");
+static const ngx_str_t PRESIGN_EXPIRES_ARG = ngx_string("X-Amz-Expires");
+static const ngx_str_t PRESIGN_SIGNED_HEADERS_ARG = ngx_string("X-Amz-SignedHeaders");
+static const ngx_str_t PRESIGN_SIGNATURE_ARG = ngx_string("&X-Amz-Signature=");
+// the canonical request of a presigned URL ends in the signed headers and an unsigned payload
+static const ngx_str_t PRESIGN_CANON_TAIL = ngx_string("\nhost\nUNSIGNED-PAYLOAD");
 
 static inline char *__CHAR_PTR_U(u_char *ptr) { return (char *) ptr; }
 
 static inline const char *__CONST_CHAR_PTR_U(const u_char *ptr) { return (const char *) ptr; }
 
+static inline u_char *ngx_aws_auth__write_digits(u_char *p, ngx_uint_t value, size_t width) {
+    u_char *last = p + width;
+
+    while (width--) {
+        p[width] = (u_char) ('0' + value % 10);
+        value /= 10;
+    }
+
+    return last;
+}
+
+// writes the AMZ_DATE_LENGTH bytes of YYYYMMDD'T'HHMMSS'Z'
+static inline u_char *ngx_aws_auth__write_amz_date(u_char *p, time_t t) {
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    p = ngx_aws_auth__write_digits(p, tm.tm_year + 1900, 4);
+    p = ngx_aws_auth__write_digits(p, tm.tm_mon + 1, 2);
+    p = ngx_aws_auth__write_digits(p, tm.tm_mday, 2);
+    *p++ = 'T';
+    p = ngx_aws_auth__write_digits(p, tm.tm_hour, 2);
+    p = ngx_aws_auth__write_digits(p, tm.tm_min, 2);
+    p = ngx_aws_auth__write_digits(p, tm.tm_sec, 2);
+    *p++ = 'Z';
+
+    return p;
+}
+
+// The x-amz-date of the last second a request was signed in, refreshed
+// when that second changes; most requests of a busy worker share it, much
+// like ngx_cached_http_time. Only ever used from the event loop
+typedef struct {
+    time_t sec;
+    u_char date[AMZ_DATE_LENGTH];
+} ngx_aws_auth_date_cache_t;
+
+static ngx_aws_auth_date_cache_t ngx_aws_auth__date_cache = { (time_t) -1, { 0 } };
+
+// AMZ_DATE_LENGTH bytes, valid until a date of another second is asked for
+static inline const u_char *ngx_aws_auth__cached_amz_date(time_t t) {
+    if (ngx_aws_auth__date_cache.sec != t) {
+        ngx_aws_auth__write_amz_date(ngx_aws_auth__date_cache.date, t);
+        ngx_aws_auth__date_cache.sec = t;
+    }
+
+    return ngx_aws_auth__date_cache.date;
+}
+
+static inline u_char *ngx_aws_auth__write_header_line(u_char *p, const ngx_str_t *key, const ngx_str_t *value) {
+    p = ngx_cpymem(p, key->data, key->len);
+    *p++ = ':';
+    p = ngx_cpymem(p, value->data, value->len);
+    *p++ = '\n';
+    return p;
+}
+
 static inline const ngx_str_t *ngx_aws_auth__compute_request_time(ngx_pool_t *pool, const time_t *timep) {
-    ngx_str_t *const retval = ngx_palloc(pool, sizeof(ngx_str_t));
-    retval->data = ngx_palloc(pool, AMZ_DATE_MAX_LEN);
-    struct tm *tm_p = ngx_palloc(pool, sizeof(struct tm));
-    gmtime_r(timep, tm_p);
-    retval->len = strftime(__CHAR_PTR_U(retval->data), AMZ_DATE_MAX_LEN - 1, "%Y%m%dT%H%M%SZ", tm_p);
+    ngx_str_t *const retval = ngx_palloc(pool, sizeof(ngx_str_t) + AMZ_DATE_LENGTH + 1);
+    if (retval == NULL) {
+        return NULL;
+    }
+
+    retval->data = (u_char *) (retval + 1);
+    retval->len = AMZ_DATE_LENGTH;
+    *ngx_cpymem(retval->data, ngx_aws_auth__cached_amz_date(*timep), AMZ_DATE_LENGTH) = '\0';
     return retval;
 }
 
@@ -108,76 +315,273 @@ static inline int ngx_aws_auth__cmp_hnames(const void *one, const void *two) {
     }
 }
 
-static inline const ngx_str_t *ngx_aws_auth__canonize_query_string(ngx_pool_t *pool,
-                                                                   const ngx_http_request_t *req) {
-    u_char *p, *ampersand, *equal, *last;
-    size_t i, len;
-    ngx_str_t *retval = ngx_palloc(pool, sizeof(ngx_str_t));
+// AWS wants a peculiar kind of URI-encoding: they want RFC 3986, except that
+// slashes shouldn't be encoded...
+// see http://docs.aws.amazon.com/general/latest/gr/sigv4-create-canonical-request.html
+// 1 for the bytes copied as they are: the unreserved characters and '/'
+static const u_char ngx_aws_auth__uri_plain[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x00 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x10 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, /* 0x20  - . / */
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, /* 0x30  0-9 */
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* 0x40  A-O */
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, /* 0x50  P-Z _ */
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* 0x60  a-o */
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0, /* 0x70  p-z ~ */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x80 and up, */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* UTF-8 included */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
 
-    header_pair_t *qs_arg;
-    ngx_array_t *query_string_args = ngx_array_create(pool, 0, sizeof(header_pair_t));
+static inline u_char *ngx_aws_auth__escape_uri_byte(u_char *p, u_char c) {
+    static const u_char hex[] = "0123456789ABCDEF";
 
-    if (req->args.len == 0) {
-        return &EMPTY_STRING;
+    *p++ = '%';
+    *p++ = hex[c >> 4];
+    *p++ = hex[c & 0xf];
+    return p;
+}
+
+// the value of a hex digit, 16 for anything else
+static inline u_char ngx_aws_auth__hex_value(u_char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
     }
 
-    p = req->args.data;
-    last = p + req->args.len;
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
 
-    for ( /* void */ ; p < last; p++) {
-        qs_arg = ngx_array_push(query_string_args);
+    return 16;
+}
+
+// The byte of a query string argument at *s as S3 decodes it, "%XX" standing
+// for the byte XX and anything else for itself; *s is moved past it
+static inline u_char ngx_aws_auth__decode_arg_byte(u_char **s, u_char *last) {
+    u_char *p = *s, hi, lo;
+
+    if (*p == '%' && last - p > 2
+        && (hi = ngx_aws_auth__hex_value(p[1])) < 16 && (lo = ngx_aws_auth__hex_value(p[2])) < 16) {
+        *s = p + 3;
+        return (u_char) (hi << 4 | lo);
+    }
+
+    *s = p + 1;
+    return *p;
+}
+
+// A query string argument is canonized decoded and escaped again, so that
+// "a%2fb", "a%2Fb" and "a/b" all sign as "a%2Fb": RFC 3986, with '/' escaped
+// unlike in paths
+static inline size_t ngx_aws_auth__canon_arg_length(const ngx_str_t *src) {
+    u_char *s, *last, c;
+    size_t len = 0;
+
+    for (s = src->data, last = s + src->len; s < last; /* void */) {
+        c = ngx_aws_auth__decode_arg_byte(&s, last);
+        len += (ngx_aws_auth__uri_plain[c] && c != '/') ? 1 : 3;
+    }
+
+    return len;
+}
+
+static inline u_char *ngx_aws_auth__write_canon_arg(u_char *p, const ngx_str_t *src) {
+    u_char *s, *last, c;
+
+    for (s = src->data, last = s + src->len; s < last; /* void */) {
+        c = ngx_aws_auth__decode_arg_byte(&s, last);
+        if (ngx_aws_auth__uri_plain[c] && c != '/') {
+            *p++ = c;
+        } else {
+            p = ngx_aws_auth__escape_uri_byte(p, c);
+        }
+    }
+
+    return p;
+}
 
-        ampersand = ngx_strlchr(p, last, '&');
-        if (ampersand == NULL) {
-            ampersand = last;
+// the first '&', or '=' as well when key is set, at p or after; last if none
+static inline u_char *ngx_aws_auth__find_qs_delimiter(u_char *p, u_char *last, ngx_uint_t key) {
+#if (__SSE2__)
+    const __m128i ampersand = _mm_set1_epi8('&');
+    const __m128i equal = _mm_set1_epi8(key ? '=' : '&');
+    __m128i chunk;
+    int mask;
+
+    for ( /* void */ ; last - p >= 16; p += 16) {
+        chunk = _mm_loadu_si128((const __m128i *) p);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, ampersand), _mm_cmpeq_epi8(chunk, equal)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
         }
+    }
+#endif
 
-        equal = ngx_strlchr(p, last, '=');
-        if ((equal == NULL) || (equal > ampersand)) {
-            equal = ampersand;
+    for ( /* void */ ; p < last; p++) {
+        if (*p == '&' || (key && *p == '=')) {
+            return p;
         }
+    }
 
-        len = equal - p;
-        qs_arg->key.data = ngx_palloc(pool, len * 3);
-        qs_arg->key.len = (u_char *) ngx_escape_uri(qs_arg->key.data, p, len, NGX_ESCAPE_ARGS) - qs_arg->key.data;
+    return last;
+}
 
+// splits off the query string argument starting at p, returns where it ends
+static inline u_char *ngx_aws_auth__next_query_arg(u_char *p, u_char *last, ngx_str_t *key, ngx_str_t *value) {
+    u_char *end;
 
-        len = ampersand - equal;
-        if (len > 0) {
-            qs_arg->value.data = ngx_palloc(pool, len * 3);
-            qs_arg->value.len = (u_char *) ngx_escape_uri(qs_arg->value.data, equal + 1, len - 1, NGX_ESCAPE_ARGS) -
-                                qs_arg->value.data;
-        } else {
-            qs_arg->value = EMPTY_STRING;
+    end = ngx_aws_auth__find_qs_delimiter(p, last, 1);
+
+    key->data = p;
+    key->len = end - p;
+
+    if (end < last && *end == '=') {
+        // the value runs up to the next '&', it may hold more '='
+        value->data = end + 1;
+        end = ngx_aws_auth__find_qs_delimiter(value->data, last, 0);
+        value->len = end - value->data;
+    } else {
+        value->data = end;
+        value->len = 0;
+    }
+
+    return end;
+}
+
+// Returns the number of query string arguments; *escaped_len is set to the
+// length of all their keys and values once canonized. The canonical query
+// string is that plus one '=' per argument and the '&' between them.
+static inline ngx_uint_t ngx_aws_auth__query_args_count(const ngx_str_t *args, size_t *escaped_len) {
+    ngx_str_t key, value;
+    ngx_uint_t n = 0;
+    u_char *p, *last;
+
+    *escaped_len = 0;
+
+    for (p = args->data, last = p + args->len; p < last; p++, n++) {
+        p = ngx_aws_auth__next_query_arg(p, last, &key, &value);
+        *escaped_len += ngx_aws_auth__canon_arg_length(&key) + ngx_aws_auth__canon_arg_length(&value);
+    }
+
+    return n;
+}
+
+static inline size_t ngx_aws_auth__canon_qs_length(ngx_uint_t n_args, size_t escaped_len) {
+    return n_args ? escaped_len + 2 * n_args - 1 : 0;
+}
+
+// query string arguments sort by key, then by value
+static inline ngx_int_t ngx_aws_auth__cmp_qs_args(const header_pair_t *one, const header_pair_t *two) {
+    ngx_int_t rc;
+
+    rc = ngx_memn2cmp(one->key.data, two->key.data, one->key.len, two->key.len);
+    if (rc != 0) {
+        return rc;
+    }
+
+    return ngx_memn2cmp(one->value.data, two->value.data, one->value.len, two->value.len);
+}
+
+static inline int ngx_aws_auth__qsort_qs_args(const void *one, const void *two) {
+    return (int) ngx_aws_auth__cmp_qs_args(one, two);
+}
+
+// an insertion sort beats qsort on the handful of arguments S3 requests have
+#define NGX_AWS_AUTH_QS_INSERTION_SORT_MAX 16
+
+static inline void ngx_aws_auth__sort_qs_args(header_pair_t *qs_args, ngx_uint_t n) {
+    header_pair_t arg;
+    ngx_uint_t i, j;
+
+    if (n > NGX_AWS_AUTH_QS_INSERTION_SORT_MAX) {
+        ngx_qsort(qs_args, (size_t) n, sizeof(header_pair_t), ngx_aws_auth__qsort_qs_args);
+        return;
+    }
+
+    for (i = 1; i < n; i++) {
+        arg = qs_args[i];
+        for (j = i; j > 0 && ngx_aws_auth__cmp_qs_args(&arg, &qs_args[j - 1]) < 0; j--) {
+            qs_args[j] = qs_args[j - 1];
         }
+        qs_args[j] = arg;
+    }
+}
 
-        p = ampersand;
+// Canonizes the query string arguments into scratch and sorts them, returns
+// their number. qs_args has room for every argument and scratch for
+// escaped_len bytes, as counted by ngx_aws_auth__query_args_count
+static inline ngx_uint_t ngx_aws_auth__sort_query_args(header_pair_t *qs_args, u_char *scratch,
+                                                       const ngx_str_t *args) {
+    ngx_str_t key, value;
+    ngx_uint_t n = 0;
+    u_char *a, *last;
+
+    for (a = args->data, last = a + args->len; a < last; a++, n++) {
+        a = ngx_aws_auth__next_query_arg(a, last, &key, &value);
+
+        qs_args[n].key.data = scratch;
+        scratch = ngx_aws_auth__write_canon_arg(scratch, &key);
+        qs_args[n].key.len = scratch - qs_args[n].key.data;
+
+        qs_args[n].value.data = scratch;
+        scratch = ngx_aws_auth__write_canon_arg(scratch, &value);
+        qs_args[n].value.len = scratch - qs_args[n].value.data;
     }
 
-    ngx_qsort(query_string_args->elts, (size_t) query_string_args->nelts,
-              sizeof(header_pair_t), ngx_aws_auth__cmp_hnames);
+    ngx_aws_auth__sort_qs_args(qs_args, n);
 
-    retval->data = ngx_palloc(pool, req->args.len * 3 + query_string_args->nelts * 2);
-    retval->len = 0;
+    return n;
+}
 
-    for (i = 0; i < query_string_args->nelts; i++) {
-        qs_arg = &((header_pair_t *) query_string_args->elts)[i];
+// writes the canonical query string of the n sorted arguments at p
+static inline u_char *ngx_aws_auth__write_canon_qs(u_char *p, const header_pair_t *qs_args, ngx_uint_t n) {
+    ngx_uint_t i;
 
-        ngx_memcpy(retval->data + retval->len, qs_arg->key.data, qs_arg->key.len);
-        retval->len += qs_arg->key.len;
+    for (i = 0; i < n; i++) {
+        if (i) {
+            *p++ = '&';
+        }
+        p = ngx_cpymem(p, qs_args[i].key.data, qs_args[i].key.len);
+        *p++ = '=';
+        p = ngx_cpymem(p, qs_args[i].value.data, qs_args[i].value.len);
+    }
 
-        *(retval->data + retval->len) = '=';
-        retval->len++;
+    return p;
+}
 
-        ngx_memcpy(retval->data + retval->len, qs_arg->value.data, qs_arg->value.len);
-        retval->len += qs_arg->value.len;
+static inline const ngx_str_t *ngx_aws_auth__canonize_query_string(ngx_pool_t *pool,
+                                                                   const ngx_http_request_t *req) {
+    ngx_str_t *retval;
+    header_pair_t *qs_args;
+    ngx_uint_t n;
+    size_t escaped_len, len;
 
-        *(retval->data + retval->len) = '&';
-        retval->len++;
+    if (req->args.len == 0) {
+        return &EMPTY_STRING;
+    }
+
+    n = ngx_aws_auth__query_args_count(&req->args, &escaped_len);
+    len = ngx_aws_auth__canon_qs_length(n, escaped_len);
+
+    retval = ngx_palloc(pool, sizeof(ngx_str_t) + n * sizeof(header_pair_t) + escaped_len + len);
+    if (retval == NULL) {
+        return NULL;
     }
-    retval->len--;
 
-    safe_ngx_log_error(req, "canonical qs constructed is %V", retval);
+    qs_args = (header_pair_t *) (retval + 1);
+    retval->data = (u_char *) (qs_args + n);
+    n = ngx_aws_auth__sort_query_args(qs_args, retval->data + len, &req->args);
+    retval->len = ngx_aws_auth__write_canon_qs(retval->data, qs_args, n) - retval->data;
+
+    if (ngx_aws_auth__debug_enabled(req)) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, "canonical qs constructed is %V", retval);
+    }
 
     return retval;
 }
@@ -185,13 +589,18 @@ static inline const ngx_str_t *ngx_aws_auth__canonize_query_string(ngx_pool_t *p
 
 static inline const ngx_str_t *ngx_aws_auth__host_from_bucket(ngx_pool_t *pool,
                                                               const ngx_str_t *s3_bucket) {
-    static const char HOST_PATTERN[] = ".s3.amazonaws.com";
+    static const ngx_str_t HOST_PATTERN = ngx_string(".s3.amazonaws.com");
     ngx_str_t *host;
 
-    host = ngx_palloc(pool, sizeof(ngx_str_t));
-    host->len = s3_bucket->len + sizeof(HOST_PATTERN) + 1;
-    host->data = ngx_palloc(pool, host->len);
-    host->len = ngx_snprintf(host->data, host->len, "%V%s", s3_bucket, HOST_PATTERN) - host->data;
+    host = ngx_palloc(pool, sizeof(ngx_str_t) + s3_bucket->len + HOST_PATTERN.len + 1);
+    if (host == NULL) {
+        return NULL;
+    }
+
+    host->data = (u_char *) (host + 1);
+    host->len = s3_bucket->len + HOST_PATTERN.len;
+    *ngx_cpymem(ngx_cpymem(host->data, s3_bucket->data, s3_bucket->len),
+                HOST_PATTERN.data, HOST_PATTERN.len) = '\0';
 
     return host;
 }
@@ -201,15 +610,26 @@ static inline struct AwsCanonicalHeaderDetails ngx_aws_auth__canonize_headers(ng
                                                                               const ngx_str_t *s3_bucket,
                                                                               const ngx_str_t *amz_date,
                                                                               const ngx_str_t *content_hash,
-                                                                              const ngx_str_t *s3_endpoint) {
+                                                                              const ngx_str_t *s3_endpoint,
+                                                                              const ngx_array_t *extra_headers) {
     size_t header_names_size = 1, header_nameval_size = 1;
-    size_t i, used;
-    u_char *buf_progress;
+    size_t i;
+    u_char *p;
+    header_pair_t *headers;
     struct AwsCanonicalHeaderDetails retval;
 
-    ngx_array_t *settable_header_array = ngx_array_create(pool, 3, sizeof(header_pair_t));
+    ngx_uint_t n = 3 + (extra_headers ? extra_headers->nelts : 0);
+    ngx_array_t *settable_header_array = ngx_array_create(pool, n, sizeof(header_pair_t));
     header_pair_t *header_ptr;
 
+    // additional headers the request carries, they must be lowercased
+    if (extra_headers != NULL) {
+        for (i = 0; i < extra_headers->nelts; i++) {
+            header_ptr = ngx_array_push(settable_header_array);
+            *header_ptr = ((header_pair_t *) extra_headers->elts)[i];
+        }
+    }
+
     header_ptr = ngx_array_push(settable_header_array);
     header_ptr->key = AMZ_HASH_HEADER;
     header_ptr->value = *content_hash;
@@ -220,135 +640,269 @@ static inline struct AwsCanonicalHeaderDetails ngx_aws_auth__canonize_headers(ng
 
     header_ptr = ngx_array_push(settable_header_array);
     header_ptr->key = HOST_HEADER;
-    header_ptr->value.len = s3_bucket->len + 60;
-    header_ptr->value.data = ngx_palloc(pool, header_ptr->value.len);
-    header_ptr->value.len =
-            ngx_snprintf(header_ptr->value.data, header_ptr->value.len, "%V.%V", s3_bucket, s3_endpoint) -
-            header_ptr->value.data;
+    header_ptr->value.len = s3_bucket->len + 1 + s3_endpoint->len;
+    header_ptr->value.data = ngx_pnalloc(pool, header_ptr->value.len);
+    p = ngx_cpymem(header_ptr->value.data, s3_bucket->data, s3_bucket->len);
+    *p++ = '.';
+    ngx_memcpy(p, s3_endpoint->data, s3_endpoint->len);
 
     ngx_qsort(settable_header_array->elts, (size_t) settable_header_array->nelts,
               sizeof(header_pair_t), ngx_aws_auth__cmp_hnames);
     retval.header_list = settable_header_array;
+    headers = settable_header_array->elts;
 
     for (i = 0; i < settable_header_array->nelts; i++) {
-        header_names_size += ((header_pair_t *) settable_header_array->elts)[i].key.len + 1;
-        header_nameval_size += ((header_pair_t *) settable_header_array->elts)[i].key.len + 1;
-        header_nameval_size += ((header_pair_t *) settable_header_array->elts)[i].value.len + 2;
+        header_names_size += headers[i].key.len + 1;
+        header_nameval_size += headers[i].key.len + headers[i].value.len + 2;
     }
 
-    /* make canonical headers string */
-    retval.canon_header_str = ngx_palloc(pool, sizeof(ngx_str_t));
-    retval.canon_header_str->data = ngx_palloc(pool, header_nameval_size);
+    /* make canonical headers string, both strings are null terminated */
+    retval.canon_header_str = ngx_palloc(pool, sizeof(ngx_str_t) + header_nameval_size);
+    retval.canon_header_str->data = (u_char *) (retval.canon_header_str + 1);
 
-    for (i = 0, used = 0, buf_progress = retval.canon_header_str->data;
-         i < settable_header_array->nelts;
-         i++, used = buf_progress - retval.canon_header_str->data) {
-        buf_progress = ngx_snprintf(buf_progress, header_nameval_size - used, "%V:%V\n",
-                                    &((header_pair_t *) settable_header_array->elts)[i].key,
-                                    &((header_pair_t *) settable_header_array->elts)[i].value);
+    for (i = 0, p = retval.canon_header_str->data; i < settable_header_array->nelts; i++) {
+        p = ngx_aws_auth__write_header_line(p, &headers[i].key, &headers[i].value);
     }
-    retval.canon_header_str->len = used;
+    *p = '\0';
+    retval.canon_header_str->len = p - retval.canon_header_str->data;
 
     /* make signed headers */
-    retval.signed_header_names = ngx_palloc(pool, sizeof(ngx_str_t));
-    retval.signed_header_names->data = ngx_palloc(pool, header_names_size);
+    retval.signed_header_names = ngx_palloc(pool, sizeof(ngx_str_t) + header_names_size);
+    retval.signed_header_names->data = (u_char *) (retval.signed_header_names + 1);
 
-    for (i = 0, used = 0, buf_progress = retval.signed_header_names->data;
-         i < settable_header_array->nelts;
-         i++, used = buf_progress - retval.signed_header_names->data) {
-        buf_progress = ngx_snprintf(buf_progress, header_names_size - used, "%V;",
-                                    &((header_pair_t *) settable_header_array->elts)[i].key);
+    for (i = 0, p = retval.signed_header_names->data; i < settable_header_array->nelts; i++) {
+        if (i) {
+            *p++ = ';';
+        }
+        p = ngx_cpymem(p, headers[i].key.data, headers[i].key.len);
     }
-    used--;
-    retval.signed_header_names->len = used;
-    retval.signed_header_names->data[used] = 0;
+    *p = '\0';
+    retval.signed_header_names->len = p - retval.signed_header_names->data;
 
     return retval;
 }
 
+// payload_hash is whatever the caller wants in x-amz-content-sha256: the hex
+// digest of the body, or NULL for requests that carry no body at all
 static inline const ngx_str_t *ngx_aws_auth__request_body_hash(ngx_pool_t *pool,
-                                                               const ngx_http_request_t *req) {
-    /* TODO: support cases involving non-empty body */
-    return &EMPTY_STRING_SHA256;
+                                                               const ngx_http_request_t *req,
+                                                               const ngx_str_t *payload_hash) {
+    if (payload_hash == NULL || payload_hash->len == 0) {
+        return &EMPTY_STRING_SHA256;
+    }
+
+    return payload_hash;
+}
+
+// The payload digest is fed buffer by buffer while nginx reads the client
+// body, so the body never has to be read back from the temp file.
+// Content-MD5 is optional and computed in the same pass.
+static inline ngx_int_t ngx_aws_auth__payload_digest_init(ngx_pool_t *pool,
+                                                          ngx_aws_auth_payload_digest_t *digest,
+                                                          ngx_uint_t with_md5) {
+    ngx_memzero(digest, sizeof(ngx_aws_auth_payload_digest_t));
+
+    digest->sha256 = ngx_aws_auth__sha256_init(pool);
+    if (digest->sha256 == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (with_md5) {
+        digest->md5 = ngx_aws_auth__md5_init(pool);
+        if (digest->md5 == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static inline void ngx_aws_auth__payload_digest_update(ngx_aws_auth_payload_digest_t *digest,
+                                                       const u_char *data, size_t len) {
+    ngx_aws_auth__sha256_update(digest->sha256, data, len);
+
+    if (digest->md5 != NULL) {
+        ngx_aws_auth__md5_update(digest->md5, data, len);
+    }
+}
+
+static inline ngx_int_t ngx_aws_auth__payload_digest_final(ngx_pool_t *pool,
+                                                           ngx_aws_auth_payload_digest_t *digest) {
+    u_char md5[NGX_AWS_AUTH__MD5_LENGTH];
+    ngx_str_t md5_raw;
+
+    digest->payload_hash.data = ngx_palloc(pool, NGX_AWS_AUTH__SHA256_HEX_LENGTH);
+    if (digest->payload_hash.data == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_aws_auth__sha256_final_hex(digest->sha256, digest->payload_hash.data);
+    digest->payload_hash.len = NGX_AWS_AUTH__SHA256_HEX_LENGTH;
+
+    if (digest->md5 != NULL) {
+        ngx_aws_auth__md5_final(digest->md5, md5);
+        md5_raw.data = md5;
+        md5_raw.len = sizeof(md5);
+
+        digest->content_md5.data = ngx_palloc(pool, ngx_base64_encoded_length(sizeof(md5)));
+        if (digest->content_md5.data == NULL) {
+            return NGX_ERROR;
+        }
+        ngx_encode_base64(&digest->content_md5, &md5_raw);
+    }
+
+    return NGX_OK;
+}
+
+// the first byte at p or after that has to be escaped, last if none; most
+// paths are plain ASCII, so they are checked 16 bytes at a time
+static inline u_char *ngx_aws_auth__uri_plain_end(u_char *p, u_char *last) {
+#if (__SSE2__)
+    __m128i chunk, plain;
+    int mask;
+
+    for ( /* void */ ; last - p >= 16; p += 16) {
+        chunk = _mm_loadu_si128((const __m128i *) p);
+
+        // signed compares, bytes of 0x80 and up are in none of the ranges
+        plain = _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('a' - 1)),
+                              _mm_cmplt_epi8(chunk, _mm_set1_epi8('z' + 1)));
+        plain = _mm_or_si128(plain, _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('A' - 1)),
+                                                  _mm_cmplt_epi8(chunk, _mm_set1_epi8('Z' + 1))));
+        // '-', '.', '/' and the digits are contiguous
+        plain = _mm_or_si128(plain, _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('-' - 1)),
+                                                  _mm_cmplt_epi8(chunk, _mm_set1_epi8('9' + 1))));
+        plain = _mm_or_si128(plain, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('_')));
+        plain = _mm_or_si128(plain, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('~')));
+
+        mask = _mm_movemask_epi8(plain) ^ 0xffff;
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    while (p < last && ngx_aws_auth__uri_plain[*p]) {
+        p++;
+    }
+
+    return p;
+}
+
+static inline size_t ngx_aws_auth__escaped_uri_length(const ngx_str_t *src) {
+    u_char *p, *last;
+    size_t len;
+
+    len = src->len;
+
+    for (p = src->data, last = p + src->len; p < last; p++) {
+        p = ngx_aws_auth__uri_plain_end(p, last);
+        if (p < last) {
+            len += 2;
+        }
+    }
+
+    return len;
+}
+
+// writes the ngx_aws_auth__escaped_uri_length bytes of src escaped
+static inline u_char *ngx_aws_auth__write_escaped_uri(u_char *p, const ngx_str_t *src) {
+    u_char *s, *last, *plain;
+
+    for (s = src->data, last = s + src->len; s < last; s++) {
+        plain = ngx_aws_auth__uri_plain_end(s, last);
+        p = ngx_cpymem(p, s, plain - s);
+        s = plain;
+
+        if (s < last) {
+            p = ngx_aws_auth__escape_uri_byte(p, *s);
+        }
+    }
+
+    return p;
+}
+
+// query string arguments are escaped like URIs but for '/', which is escaped too
+static inline size_t ngx_aws_auth__escaped_arg_length(const ngx_str_t *src) {
+    size_t i, len;
+
+    for (i = 0, len = src->len; i < src->len; i++) {
+        if (!ngx_aws_auth__uri_plain[src->data[i]] || src->data[i] == '/') {
+            len += 2;
+        }
+    }
+
+    return len;
+}
+
+static inline u_char *ngx_aws_auth__write_escaped_arg(u_char *p, const ngx_str_t *src) {
+    size_t i;
+
+    for (i = 0; i < src->len; i++) {
+        if (ngx_aws_auth__uri_plain[src->data[i]] && src->data[i] != '/') {
+            *p++ = src->data[i];
+        } else {
+            p = ngx_aws_auth__escape_uri_byte(p, src->data[i]);
+        }
+    }
+
+    return p;
 }
 
-// AWS wants a peculiar kind of URI-encoding: they want RFC 3986, except that
-// slashes shouldn't be encoded...
-// this function is a light wrapper around ngx_escape_uri that does exactly that
 // modifies the source in place if it needs to be escaped
-// see http://docs.aws.amazon.com/general/latest/gr/sigv4-create-canonical-request.html
 static inline void ngx_aws_auth__escape_uri(ngx_pool_t *pool, ngx_str_t *src) {
     u_char *escaped_data;
-    u_int escaped_data_len, escaped_data_with_slashes_len, i, j;
-    uintptr_t escaped_count, slashes_count = 0;
-
-    // first, we need to know how many characters need to be escaped
-    escaped_count = ngx_escape_uri(NULL, src->data, src->len, NGX_ESCAPE_URI_COMPONENT);
-    // except slashes should not be escaped...
-    if (escaped_count > 0) {
-        for (i = 0; i < src->len; i++) {
-            if (src->data[i] == '/') {
-                slashes_count++;
-            }
-        }
-    }
+    size_t escaped_data_len;
 
-    if (escaped_count == slashes_count) {
+    if (ngx_aws_auth__uri_plain_end(src->data, src->data + src->len) == src->data + src->len) {
         // nothing to do! nothing but slashes escaped (if even that)
         return;
     }
 
-    // each escaped character is replaced by 3 characters
-    escaped_data_len = src->len + escaped_count * 2;
-    escaped_data = ngx_palloc(pool, escaped_data_len);
-    ngx_escape_uri(escaped_data, src->data, src->len, NGX_ESCAPE_URI_COMPONENT);
-
-    // now we need to go back and re-replace each occurrence of %2F with a slash
-    escaped_data_with_slashes_len = src->len + (escaped_count - slashes_count) * 2;
-    if (slashes_count > 0) {
-        for (i = 0, j = 0; i < escaped_data_with_slashes_len; i++) {
-            if (j < escaped_data_len - 2 && strncmp((char *) (escaped_data + j), "%2F", 3) == 0) {
-                escaped_data[i] = '/';
-                j += 3;
-            } else {
-                escaped_data[i] = escaped_data[j];
-                j++;
-            }
-        }
-
-        src->len = escaped_data_with_slashes_len;
-    } else {
-        // no slashes
-        src->len = escaped_data_len;
+    escaped_data_len = ngx_aws_auth__escaped_uri_length(src);
+    escaped_data = ngx_pnalloc(pool, escaped_data_len);
+    if (escaped_data == NULL) {
+        return;
     }
 
+    ngx_aws_auth__write_escaped_uri(escaped_data, src);
     src->data = escaped_data;
+    src->len = escaped_data_len;
 }
 
-static inline const ngx_str_t *ngx_aws_auth__canon_url(ngx_pool_t *pool, const ngx_http_request_t *req) {
-    ngx_str_t *retval;
-    const u_char *req_uri_data;
-    u_int req_uri_len;
-
+// the request URI before escaping, without the query string
+static inline void ngx_aws_auth__raw_url(const ngx_http_request_t *req, ngx_str_t *url) {
     if (req->args.len == 0) {
-        req_uri_data = req->uri.data;
-        req_uri_len = req->uri.len;
+        url->data = req->uri.data;
+        url->len = req->uri.len;
     } else {
-        req_uri_data = req->uri_start;
-        req_uri_len = req->args_start - req->uri_start - 1;
+        url->data = req->uri_start;
+        url->len = req->args_start - req->uri_start - 1;
+    }
+}
+
+static inline const ngx_str_t *ngx_aws_auth__canon_url(ngx_pool_t *pool, const ngx_http_request_t *req) {
+    ngx_str_t *retval, url;
+    size_t len;
+
+    ngx_aws_auth__raw_url(req, &url);
+    if (ngx_aws_auth__debug_enabled(req)) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, "canonical url extracted before URI encoding is %V", &url);
     }
 
-    // we need to copy that data to not modify the request for other modules
-    retval = ngx_palloc(pool, sizeof(ngx_str_t));
-    retval->data = ngx_palloc(pool, req_uri_len);
-    ngx_memcpy(retval->data, req_uri_data, req_uri_len);
-    retval->len = req_uri_len;
+    // we need to copy that data to not modify the request for other modules,
+    // URI-encoding it per RFC 3986 on the way
+    len = ngx_aws_auth__escaped_uri_length(&url);
+    retval = ngx_palloc(pool, sizeof(ngx_str_t) + len);
+    if (retval == NULL) {
+        return NULL;
+    }
 
-    safe_ngx_log_error(req, "canonical url extracted before URI encoding is %V", retval);
+    retval->data = (u_char *) (retval + 1);
+    retval->len = ngx_aws_auth__write_escaped_uri(retval->data, &url) - retval->data;
 
-    // then URI-encode it per RFC 3986
-    ngx_aws_auth__escape_uri(pool, retval);
-    safe_ngx_log_error(req, "canonical url extracted after URI encoding is %V", retval);
+    if (ngx_aws_auth__debug_enabled(req)) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, "canonical url extracted after URI encoding is %V", retval);
+    }
 
     return retval;
 }
@@ -357,33 +911,47 @@ static inline struct AwsCanonicalRequestDetails ngx_aws_auth__make_canonical_req
                                                                                      const ngx_http_request_t *req,
                                                                                      const ngx_str_t *s3_bucket_name,
                                                                                      const ngx_str_t *amz_date,
-                                                                                     const ngx_str_t *s3_endpoint) {
+                                                                                     const ngx_str_t *payload_hash,
+                                                                                     const ngx_str_t *s3_endpoint,
+                                                                                     const ngx_array_t *extra_headers) {
     struct AwsCanonicalRequestDetails retval;
+    u_char *p;
 
     // canonize query string
     const ngx_str_t *canon_qs = ngx_aws_auth__canonize_query_string(pool, req);
 
     // compute request body hash
-    const ngx_str_t *request_body_hash = ngx_aws_auth__request_body_hash(pool, req);
+    const ngx_str_t *request_body_hash = ngx_aws_auth__request_body_hash(pool, req, payload_hash);
 
     const struct AwsCanonicalHeaderDetails canon_headers =
-            ngx_aws_auth__canonize_headers(pool, req, s3_bucket_name, amz_date, request_body_hash, s3_endpoint);
+            ngx_aws_auth__canonize_headers(pool, req, s3_bucket_name, amz_date, request_body_hash, s3_endpoint,
+                                           extra_headers);
     retval.signed_header_names = canon_headers.signed_header_names;
 
     const ngx_str_t *http_method = &(req->method_name);
     const ngx_str_t *url = ngx_aws_auth__canon_url(pool, req);
 
     retval.canon_request = ngx_palloc(pool, sizeof(ngx_str_t));
-    retval.canon_request->len = 10000;
-    retval.canon_request->data = ngx_palloc(pool, retval.canon_request->len);
-
-    retval.canon_request->len =
-            ngx_snprintf(retval.canon_request->data, retval.canon_request->len, "%V\n%V\n%V\n%V\n%V\n%V",
-                         http_method, url, canon_qs, canon_headers.canon_header_str,
-                         canon_headers.signed_header_names, request_body_hash) - retval.canon_request->data;
+    retval.canon_request->len = http_method->len + url->len + canon_qs->len + canon_headers.canon_header_str->len
+                                + canon_headers.signed_header_names->len + request_body_hash->len + 5;
+    retval.canon_request->data = ngx_pnalloc(pool, retval.canon_request->len + 1);
+
+    p = ngx_cpymem(retval.canon_request->data, http_method->data, http_method->len);
+    *p++ = '\n';
+    p = ngx_cpymem(p, url->data, url->len);
+    *p++ = '\n';
+    p = ngx_cpymem(p, canon_qs->data, canon_qs->len);
+    *p++ = '\n';
+    p = ngx_cpymem(p, canon_headers.canon_header_str->data, canon_headers.canon_header_str->len);
+    *p++ = '\n';
+    p = ngx_cpymem(p, canon_headers.signed_header_names->data, canon_headers.signed_header_names->len);
+    *p++ = '\n';
+    *ngx_cpymem(p, request_body_hash->data, request_body_hash->len) = '\0';
     retval.header_list = canon_headers.header_list;
 
-    safe_ngx_log_error(req, "canonical req is %V", retval.canon_request);
+    if (ngx_aws_auth__debug_enabled(req)) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, "canonical req is %V", retval.canon_request);
+    }
 
     return retval;
 }
@@ -391,12 +959,23 @@ static inline struct AwsCanonicalRequestDetails ngx_aws_auth__make_canonical_req
 static inline const ngx_str_t *ngx_aws_auth__string_to_sign(ngx_pool_t *pool,
                                                             const ngx_str_t *key_scope, const ngx_str_t *date,
                                                             const ngx_str_t *canon_request_hash) {
-    ngx_str_t *retval = ngx_palloc(pool, sizeof(ngx_str_t));
+    ngx_str_t *retval;
+    u_char *p;
 
-    retval->len = STRING_TO_SIGN_LENGTH;
-    retval->data = ngx_palloc(pool, retval->len);
-    retval->len = ngx_snprintf(retval->data, retval->len, "AWS4-HMAC-SHA256\n%V\n%V\n%V",
-                               date, key_scope, canon_request_hash) - retval->data;
+    retval = ngx_palloc(pool, sizeof(ngx_str_t) + STRING_TO_SIGN_PREFIX.len + date->len + key_scope->len
+                              + canon_request_hash->len + 2);
+    if (retval == NULL) {
+        return NULL;
+    }
+
+    retval->data = (u_char *) (retval + 1);
+    p = ngx_cpymem(retval->data, STRING_TO_SIGN_PREFIX.data, STRING_TO_SIGN_PREFIX.len);
+    p = ngx_cpymem(p, date->data, date->len);
+    *p++ = '\n';
+    p = ngx_cpymem(p, key_scope->data, key_scope->len);
+    *p++ = '\n';
+    p = ngx_cpymem(p, canon_request_hash->data, canon_request_hash->len);
+    retval->len = p - retval->data;
 
     return retval;
 }
@@ -406,16 +985,27 @@ static inline const ngx_str_t *ngx_aws_auth__make_auth_token(ngx_pool_t *pool,
                                                              const ngx_str_t *signed_header_names,
                                                              const ngx_str_t *access_key_id,
                                                              const ngx_str_t *key_scope) {
-
-    const char FMT_STRING[] = "AWS4-HMAC-SHA256 Credential=%V/%V,SignedHeaders=%V,Signature=%V";
     ngx_str_t *authz;
+    u_char *p;
+
+    authz = ngx_palloc(pool, sizeof(ngx_str_t) + AUTH_CREDENTIAL_PREFIX.len + access_key_id->len + 1
+                             + key_scope->len + AUTH_SIGNED_HEADERS_PREFIX.len + signed_header_names->len
+                             + AUTH_SIGNATURE_PREFIX.len + signature->len);
+    if (authz == NULL) {
+        return NULL;
+    }
+
+    authz->data = (u_char *) (authz + 1);
+    p = ngx_cpymem(authz->data, AUTH_CREDENTIAL_PREFIX.data, AUTH_CREDENTIAL_PREFIX.len);
+    p = ngx_cpymem(p, access_key_id->data, access_key_id->len);
+    *p++ = '/';
+    p = ngx_cpymem(p, key_scope->data, key_scope->len);
+    p = ngx_cpymem(p, AUTH_SIGNED_HEADERS_PREFIX.data, AUTH_SIGNED_HEADERS_PREFIX.len);
+    p = ngx_cpymem(p, signed_header_names->data, signed_header_names->len);
+    p = ngx_cpymem(p, AUTH_SIGNATURE_PREFIX.data, AUTH_SIGNATURE_PREFIX.len);
+    p = ngx_cpymem(p, signature->data, signature->len);
+    authz->len = p - authz->data;
 
-    authz = ngx_palloc(pool, sizeof(ngx_str_t));
-    authz->len = access_key_id->len + key_scope->len + signed_header_names->len
-                 + signature->len + sizeof(FMT_STRING);
-    authz->data = ngx_palloc(pool, authz->len);
-    authz->len = ngx_snprintf(authz->data, authz->len, FMT_STRING,
-                              access_key_id, key_scope, signed_header_names, signature) - authz->data;
     return authz;
 }
 
@@ -423,12 +1013,15 @@ static inline struct AwsSignedRequestDetails ngx_aws_auth__compute_signature(ngx
                                                                              const ngx_str_t *signing_key,
                                                                              const ngx_str_t *key_scope,
                                                                              const ngx_str_t *s3_bucket_name,
-                                                                             const ngx_str_t *s3_endpoint) {
+                                                                             const ngx_str_t *payload_hash,
+                                                                             const ngx_str_t *s3_endpoint,
+                                                                             const ngx_array_t *extra_headers) {
     struct AwsSignedRequestDetails retval;
 
     const ngx_str_t *date = ngx_aws_auth__compute_request_time(pool, &req->start_sec);
     const struct AwsCanonicalRequestDetails canon_request =
-            ngx_aws_auth__make_canonical_request(pool, req, s3_bucket_name, date, s3_endpoint);
+            ngx_aws_auth__make_canonical_request(pool, req, s3_bucket_name, date, payload_hash, s3_endpoint,
+                                                 extra_headers);
     const ngx_str_t *canon_request_hash = ngx_aws_auth__hash_sha256(pool, canon_request.canon_request);
 
     // get string to sign
@@ -444,28 +1037,1108 @@ static inline struct AwsSignedRequestDetails ngx_aws_auth__compute_signature(ngx
 }
 
 
+// Canonical requests are hashed while they are written rather than built
+// first: the writer stages the small pieces in a buffer and feeds SHA-256
+// each time it fills up. Given a buffer that fits the whole canonical
+// request nothing is fed before ngx_aws_auth__canon_flush, and the request
+// can still be logged.
+#define NGX_AWS_AUTH_CANON_BUFFER_SIZE 1024
+
+typedef struct {
+    ngx_aws_auth__sha256_ctx_t *sha256;
+    u_char *start;
+    u_char *pos;
+    u_char *end;
+} ngx_aws_auth_canon_writer_t;
+
+static inline void ngx_aws_auth__canon_flush(ngx_aws_auth_canon_writer_t *w) {
+    ngx_aws_auth__sha256_update(w->sha256, w->start, w->pos - w->start);
+    w->pos = w->start;
+}
+
+static inline void ngx_aws_auth__canon_write(ngx_aws_auth_canon_writer_t *w, const u_char *data, size_t len) {
+    if (len > (size_t) (w->end - w->pos)) {
+        ngx_aws_auth__canon_flush(w);
+
+        if (len > (size_t) (w->end - w->pos)) {
+            ngx_aws_auth__sha256_update(w->sha256, data, len);
+            return;
+        }
+    }
+
+    w->pos = ngx_cpymem(w->pos, data, len);
+}
+
+static inline void ngx_aws_auth__canon_write_char(ngx_aws_auth_canon_writer_t *w, u_char c) {
+    if (w->pos == w->end) {
+        ngx_aws_auth__canon_flush(w);
+    }
+
+    *w->pos++ = c;
+}
+
+static inline void ngx_aws_auth__canon_write_header_line(ngx_aws_auth_canon_writer_t *w,
+                                                         const ngx_str_t *key, const ngx_str_t *value) {
+    if (key->len + value->len + 2 <= (size_t) (w->end - w->pos)) {
+        w->pos = ngx_aws_auth__write_header_line(w->pos, key, value);
+        return;
+    }
+
+    ngx_aws_auth__canon_write(w, key->data, key->len);
+    ngx_aws_auth__canon_write_char(w, ':');
+    ngx_aws_auth__canon_write(w, value->data, value->len);
+    ngx_aws_auth__canon_write_char(w, '\n');
+}
+
+// the ngx_aws_auth__write_escaped_uri counterpart, plain runs are copied
+// and escapes written straight into the buffer
+static inline void ngx_aws_auth__canon_write_uri(ngx_aws_auth_canon_writer_t *w, const ngx_str_t *src) {
+    u_char *s, *last, *plain;
+
+    for (s = src->data, last = s + src->len; s < last; s++) {
+        plain = ngx_aws_auth__uri_plain_end(s, last);
+        ngx_aws_auth__canon_write(w, s, plain - s);
+        s = plain;
+
+        if (s < last) {
+            if (w->end - w->pos < 3) {
+                ngx_aws_auth__canon_flush(w);
+            }
+            w->pos = ngx_aws_auth__escape_uri_byte(w->pos, *s);
+        }
+    }
+}
+
+
+static inline ngx_int_t ngx_aws_auth__compile_template(ngx_pool_t *pool, ngx_aws_auth_template_t *tpl,
+                                                      const ngx_str_t *access_key_id,
+                                                      const ngx_str_t *s3_bucket_name,
+                                                      const ngx_str_t *s3_endpoint) {
+    u_char *p;
+
+    p = ngx_pnalloc(pool, HOST_HEADER.len + s3_bucket_name->len + s3_endpoint->len + 3
+                          + AUTH_CREDENTIAL_PREFIX.len + access_key_id->len + 1
+                          + AUTH_SIGNED_HEADERS_PREFIX.len + FIXED_SIGNED_HEADERS.len + AUTH_SIGNATURE_PREFIX.len
+                          + ngx_aws_auth__escaped_arg_length(access_key_id) + 3);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    tpl->host_line.data = p;
+    p = ngx_cpymem(p, HOST_HEADER.data, HOST_HEADER.len);
+    *p++ = ':';
+    tpl->host.data = p;
+    p = ngx_cpymem(p, s3_bucket_name->data, s3_bucket_name->len);
+    *p++ = '.';
+    p = ngx_cpymem(p, s3_endpoint->data, s3_endpoint->len);
+    tpl->host.len = p - tpl->host.data;
+    *p++ = '\n';
+    tpl->host_line.len = p - tpl->host_line.data;
+
+    tpl->signed_header_names = FIXED_SIGNED_HEADERS;
+
+    tpl->credential.data = p;
+    p = ngx_cpymem(p, AUTH_CREDENTIAL_PREFIX.data, AUTH_CREDENTIAL_PREFIX.len);
+    p = ngx_cpymem(p, access_key_id->data, access_key_id->len);
+    *p++ = '/';
+    tpl->credential.len = p - tpl->credential.data;
+
+    tpl->signature_prefix.data = p;
+    p = ngx_cpymem(p, AUTH_SIGNED_HEADERS_PREFIX.data, AUTH_SIGNED_HEADERS_PREFIX.len);
+    p = ngx_cpymem(p, FIXED_SIGNED_HEADERS.data, FIXED_SIGNED_HEADERS.len);
+    p = ngx_cpymem(p, AUTH_SIGNATURE_PREFIX.data, AUTH_SIGNATURE_PREFIX.len);
+    tpl->signature_prefix.len = p - tpl->signature_prefix.data;
+
+    tpl->presign_credential.data = p;
+    p = ngx_aws_auth__write_escaped_arg(p, access_key_id);
+    p = ngx_cpymem(p, "%2F", 3);
+    tpl->presign_credential.len = p - tpl->presign_credential.data;
+
+    tpl->time_bucket = 1;
+
+    return NGX_OK;
+}
+
+// The bytes a compiled template's strings take; apart from the fixed
+// signed header names they are in one piece, starting at host_line
+static inline size_t ngx_aws_auth__template_size(const ngx_aws_auth_template_t *tpl) {
+    return tpl->presign_credential.data + tpl->presign_credential.len - tpl->host_line.data;
+}
+
+// Copies a compiled template, its strings going to the
+// ngx_aws_auth__template_size bytes at buf
+static inline void ngx_aws_auth__copy_template(ngx_aws_auth_template_t *dst, const ngx_aws_auth_template_t *src,
+                                               u_char *buf) {
+    const u_char *base = src->host_line.data;
+
+    *dst = *src;
+    ngx_memcpy(buf, base, ngx_aws_auth__template_size(src));
+
+    dst->host_line.data = buf + (src->host_line.data - base);
+    dst->host.data = buf + (src->host.data - base);
+    dst->credential.data = buf + (src->credential.data - base);
+    dst->signature_prefix.data = buf + (src->signature_prefix.data - base);
+    dst->presign_credential.data = buf + (src->presign_credential.data - base);
+}
+
+// The time a request is signed for: its start rounded down to the template's
+// time bucket, counted from midnight UTC so that it stays on the day of the
+// key scope. Requests within one bucket then get the same x-amz-date, and
+// their signatures can be reused
+static inline time_t ngx_aws_auth__signing_time(const ngx_aws_auth_template_t *tpl, time_t t) {
+    return t - t % AWS_KEY_EPOCH_SECONDS % tpl->time_bucket;
+}
+
+// Prepares the signature of a request using a compiled template; only the
+// date, payload hash, URI, query string and the extra headers are looked at
+// per request. extra_headers, if any, must be lowercased and sorted by name.
+// Returns the headers to add to the request (list of header_pair_t), the
+// host header is left to the proxy and is not part of it. The signature at
+// the end of the authorization header is left for the caller to fill in
+// with the MAC of pending->string_to_sign, see ngx_aws_auth__sign_with_template.
+// All sizes are known before anything is written, so the returned array,
+// its headers and every intermediate string share a single pool block.
+// The canonical request is hashed as it is written and only kept whole
+// for the debug log.
+static inline const ngx_array_t *ngx_aws_auth__prepare_with_template(ngx_pool_t *pool, ngx_http_request_t *req,
+                                                                     const ngx_aws_auth_template_t *tpl,
+                                                                     const ngx_str_t *key_scope,
+                                                                     const ngx_str_t *payload_hash,
+                                                                     const ngx_array_t *extra_headers,
+                                                                     ngx_aws_auth_pending_signature_t *pending) {
+    header_pair_t host, fixed[2], *extra, *qs_args, *header_ptr;
+    const header_pair_t *base[3], **sorted;
+    ngx_uint_t i, j, n, n_extra, n_args;
+    ngx_str_t url, date, canon_request, signed_names, string_to_sign, authz;
+    ngx_array_t *headers_out;
+    ngx_aws_auth_canon_writer_t canon;
+    size_t qs_escaped_len, headers_len, size;
+    u_char *p, *scratch;
+    u_char canon_buf[NGX_AWS_AUTH_CANON_BUFFER_SIZE];
+
+    const ngx_str_t *content_hash = ngx_aws_auth__request_body_hash(pool, req, payload_hash);
+
+    n_extra = extra_headers ? extra_headers->nelts : 0;
+    extra = n_extra ? extra_headers->elts : NULL;
+    n = 3 + n_extra;
+
+    ngx_aws_auth__raw_url(req, &url);
+    n_args = ngx_aws_auth__query_args_count(&req->args, &qs_escaped_len);
+
+    signed_names = tpl->signed_header_names;
+    headers_len = tpl->host_line.len + AMZ_HASH_HEADER.len + content_hash->len
+                  + AMZ_DATE_HEADER.len + AMZ_DATE_LENGTH + 4;
+    for (i = 0; i < n_extra; i++) {
+        signed_names.len += extra[i].key.len + 1;
+        headers_len += extra[i].key.len + extra[i].value.len + 2;
+    }
+
+    string_to_sign.len = STRING_TO_SIGN_PREFIX.len + AMZ_DATE_LENGTH + key_scope->len + 2
+                         + NGX_AWS_AUTH__SHA256_HEX_LENGTH;
+    authz.len = tpl->credential.len + key_scope->len + NGX_AWS_AUTH__SHA256_HEX_LENGTH
+                + (n_extra ? AUTH_SIGNED_HEADERS_PREFIX.len + signed_names.len + AUTH_SIGNATURE_PREFIX.len
+                           : tpl->signature_prefix.len);
+
+    // the returned array and its headers, the sort space, the digest, then the strings
+    size = sizeof(ngx_array_t) + n * sizeof(header_pair_t) + n * sizeof(header_pair_t *)
+           + n_args * sizeof(header_pair_t) + ngx_aws_auth__sha256_ctx_size()
+           + AMZ_DATE_LENGTH + (n_extra ? signed_names.len : 0)
+           + string_to_sign.len + authz.len + qs_escaped_len;
+
+    headers_out = ngx_palloc(pool, size);
+    if (headers_out == NULL) {
+        return NULL;
+    }
+
+    header_ptr = (header_pair_t *) (headers_out + 1);
+    sorted = (const header_pair_t **) (header_ptr + n);
+    qs_args = (header_pair_t *) (sorted + n);
+    canon.sha256 = (ngx_aws_auth__sha256_ctx_t *) (qs_args + n_args);
+    p = (u_char *) canon.sha256 + ngx_aws_auth__sha256_ctx_size();
+
+    date.data = p;
+    date.len = AMZ_DATE_LENGTH;
+    p = ngx_cpymem(p, ngx_aws_auth__cached_amz_date(ngx_aws_auth__signing_time(tpl, req->start_sec)),
+                   AMZ_DATE_LENGTH);
+
+    // the fixed headers, in canonical order; the host line comes from the template
+    host.key = HOST_HEADER;
+    ngx_str_null(&host.value);
+    fixed[0].key = AMZ_HASH_HEADER;
+    fixed[0].value = *content_hash;
+    fixed[1].key = AMZ_DATE_HEADER;
+    fixed[1].value = date;
+    base[0] = &host;
+    base[1] = &fixed[0];
+    base[2] = &fixed[1];
+
+    // merge the sorted extra headers into the fixed ones
+    for (i = 0, j = 0; i < 3 || j < n_extra; ) {
+        if (j < n_extra && (i == 3 || ngx_aws_auth__cmp_hnames(&extra[j], base[i]) < 0)) {
+            sorted[i + j] = &extra[j];
+            j++;
+        } else {
+            sorted[i + j] = base[i];
+            i++;
+        }
+    }
+
+    if (n_extra) {
+        signed_names.data = p;
+        for (i = 0; i < n; i++) {
+            if (i) {
+                *p++ = ';';
+            }
+            p = ngx_cpymem(p, sorted[i]->key.data, sorted[i]->key.len);
+        }
+    }
+
+    string_to_sign.data = p;
+    authz.data = string_to_sign.data + string_to_sign.len;
+    scratch = authz.data + authz.len;
+
+    ngx_aws_auth__sha256_reset(canon.sha256);
+    canon.start = canon_buf;
+    canon.end = canon_buf + sizeof(canon_buf);
+
+    if (ngx_aws_auth__debug_enabled(req)) {
+        canon_request.len = req->method_name.len + ngx_aws_auth__escaped_uri_length(&url)
+                            + ngx_aws_auth__canon_qs_length(n_args, qs_escaped_len) + headers_len
+                            + signed_names.len + content_hash->len + 5;
+        canon.start = ngx_pnalloc(pool, canon_request.len);
+        if (canon.start == NULL) {
+            return NULL;
+        }
+        canon.end = canon.start + canon_request.len;
+    }
+
+    canon.pos = canon.start;
+
+    // canonical request
+    ngx_aws_auth__canon_write(&canon, req->method_name.data, req->method_name.len);
+    ngx_aws_auth__canon_write_char(&canon, '\n');
+    ngx_aws_auth__canon_write_uri(&canon, &url);
+    ngx_aws_auth__canon_write_char(&canon, '\n');
+    n_args = ngx_aws_auth__sort_query_args(qs_args, scratch, &req->args);
+    for (i = 0; i < n_args; i++) {
+        if (i) {
+            ngx_aws_auth__canon_write_char(&canon, '&');
+        }
+        ngx_aws_auth__canon_write(&canon, qs_args[i].key.data, qs_args[i].key.len);
+        ngx_aws_auth__canon_write_char(&canon, '=');
+        ngx_aws_auth__canon_write(&canon, qs_args[i].value.data, qs_args[i].value.len);
+    }
+    ngx_aws_auth__canon_write_char(&canon, '\n');
+    for (i = 0; i < n; i++) {
+        if (sorted[i] == &host) {
+            ngx_aws_auth__canon_write(&canon, tpl->host_line.data, tpl->host_line.len);
+        } else {
+            ngx_aws_auth__canon_write_header_line(&canon, &sorted[i]->key, &sorted[i]->value);
+        }
+    }
+    ngx_aws_auth__canon_write_char(&canon, '\n');
+    ngx_aws_auth__canon_write(&canon, signed_names.data, signed_names.len);
+    ngx_aws_auth__canon_write_char(&canon, '\n');
+    ngx_aws_auth__canon_write(&canon, content_hash->data, content_hash->len);
+
+    if (canon.start != canon_buf) {
+        canon_request.data = canon.start;
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, "canonical req is %V", &canon_request);
+    }
+
+    ngx_aws_auth__canon_flush(&canon);
+
+    // string to sign, ending in the hash of the canonical request
+    p = ngx_cpymem(string_to_sign.data, STRING_TO_SIGN_PREFIX.data, STRING_TO_SIGN_PREFIX.len);
+    p = ngx_cpymem(p, date.data, date.len);
+    *p++ = '\n';
+    p = ngx_cpymem(p, key_scope->data, key_scope->len);
+    *p++ = '\n';
+    ngx_aws_auth__sha256_final_hex(canon.sha256, p);
+
+    // authorization header, ending in the signature
+    p = ngx_cpymem(authz.data, tpl->credential.data, tpl->credential.len);
+    p = ngx_cpymem(p, key_scope->data, key_scope->len);
+    if (n_extra) {
+        p = ngx_cpymem(p, AUTH_SIGNED_HEADERS_PREFIX.data, AUTH_SIGNED_HEADERS_PREFIX.len);
+        p = ngx_cpymem(p, signed_names.data, signed_names.len);
+        p = ngx_cpymem(p, AUTH_SIGNATURE_PREFIX.data, AUTH_SIGNATURE_PREFIX.len);
+    } else {
+        p = ngx_cpymem(p, tpl->signature_prefix.data, tpl->signature_prefix.len);
+    }
+    pending->string_to_sign = string_to_sign;
+    pending->signature = p;
+
+    headers_out->elts = header_ptr;
+    headers_out->nelts = 0;
+    headers_out->size = sizeof(header_pair_t);
+    headers_out->nalloc = n;
+    headers_out->pool = pool;
+
+    for (i = 0; i < n; i++) {
+        if (sorted[i] != &host) {
+            header_ptr[headers_out->nelts++] = *sorted[i];
+        }
+    }
+
+    header_ptr[headers_out->nelts].key = AUTHZ_HEADER;
+    header_ptr[headers_out->nelts].value = authz;
+    headers_out->nelts++;
+
+    return headers_out;
+}
+
+// Signs a request using a compiled template, see
+// ngx_aws_auth__prepare_with_template
+static inline const ngx_array_t *ngx_aws_auth__sign_with_template(ngx_pool_t *pool, ngx_http_request_t *req,
+                                                                  const ngx_aws_auth_template_t *tpl,
+                                                                  const ngx_aws_auth__hmac_key_t *hmac_key,
+                                                                  const ngx_str_t *key_scope,
+                                                                  const ngx_str_t *payload_hash,
+                                                                  const ngx_array_t *extra_headers) {
+    ngx_aws_auth_pending_signature_t pending;
+    const ngx_array_t *headers_out;
+
+    headers_out = ngx_aws_auth__prepare_with_template(pool, req, tpl, key_scope, payload_hash, extra_headers,
+                                                      &pending);
+    if (headers_out == NULL) {
+        return NULL;
+    }
+
+    ngx_aws_auth__hmac_key_sha256_hex(hmac_key, pending.string_to_sign.data, pending.string_to_sign.len,
+                                      pending.signature);
+    return headers_out;
+}
+
+
 // list of header_pair_t
 static inline const ngx_array_t *ngx_aws_auth__sign(ngx_pool_t *pool, ngx_http_request_t *req,
                                                     const ngx_str_t *access_key_id,
                                                     const ngx_str_t *signing_key,
                                                     const ngx_str_t *key_scope,
                                                     const ngx_str_t *s3_bucket_name,
-                                                    const ngx_str_t *s3_endpoint) {
-    const struct AwsSignedRequestDetails signature_details = ngx_aws_auth__compute_signature(pool, req, signing_key,
-                                                                                             key_scope, s3_bucket_name,
-                                                                                             s3_endpoint);
+                                                    const ngx_str_t *payload_hash,
+                                                    const ngx_str_t *s3_endpoint,
+                                                    const ngx_array_t *extra_headers) {
+    ngx_aws_auth_template_t tpl;
+    ngx_aws_auth__hmac_key_t *hmac_key;
+
+    if (ngx_aws_auth__compile_template(pool, &tpl, access_key_id, s3_bucket_name, s3_endpoint) != NGX_OK) {
+        return NULL;
+    }
+
+    hmac_key = ngx_palloc(pool, ngx_aws_auth__hmac_key_size());
+    if (hmac_key == NULL || ngx_aws_auth__hmac_key_set(pool, hmac_key, signing_key) != NGX_OK) {
+        return NULL;
+    }
+
+    return ngx_aws_auth__sign_with_template(pool, req, &tpl, hmac_key, key_scope, payload_hash,
+                                            extra_headers);
+}
+
+
+// Builds the presigned URL of a request, S3's query string authentication:
+//   <scheme>://<bucket>.<endpoint><URI>?<arguments>&X-Amz-Signature=<signature>
+// where the arguments are those of the request merged with the X-Amz-* ones,
+// all in canonical order, so that both the URI and the query string of the
+// URL are those of the canonical request. Only the host is signed and the
+// payload is not: whoever has the URL can send the request's method to it
+// for `expires` seconds from req->start_sec. The URL and everything needed
+// to build it come from a single pool block.
+static inline const ngx_str_t *ngx_aws_auth__presign_with_template(ngx_pool_t *pool, const ngx_http_request_t *req,
+                                                                   const ngx_aws_auth_template_t *tpl,
+                                                                   const ngx_aws_auth__hmac_key_t *hmac_key,
+                                                                   const ngx_str_t *key_scope,
+                                                                   const ngx_str_t *scheme, time_t expires) {
+    header_pair_t fixed[5], *qs_args;
+    const header_pair_t *arg;
+    ngx_uint_t i, j, n_args;
+    ngx_str_t url, string_to_sign, *retval;
+    ngx_aws_auth__sha256_ctx_t *sha256;
+    size_t qs_escaped_len, fixed_len, canon_qs_len, len;
+    u_char *p, *canon_uri, *canon_qs, *scratch;
+    u_char expires_buf[NGX_TIME_T_LEN];
+
+    ngx_aws_auth__raw_url(req, &url);
+    n_args = ngx_aws_auth__query_args_count(&req->args, &qs_escaped_len);
+
+    fixed[0].key = PRESIGN_ALGORITHM_ARG;
+    fixed[0].value = PRESIGN_ALGORITHM;
+    fixed[1].key = PRESIGN_CREDENTIAL_ARG;
+    fixed[1].value.len = tpl->presign_credential.len + ngx_aws_auth__escaped_arg_length(key_scope);
+    fixed[2].key = PRESIGN_DATE_ARG;
+    fixed[2].value.data = (u_char *) ngx_aws_auth__cached_amz_date(req->start_sec);
+    fixed[2].value.len = AMZ_DATE_LENGTH;
+    fixed[3].key = PRESIGN_EXPIRES_ARG;
+    fixed[3].value.data = expires_buf;
+    fixed[3].value.len = ngx_sprintf(expires_buf, "%T", expires) - expires_buf;
+    fixed[4].key = PRESIGN_SIGNED_HEADERS_ARG;
+    fixed[4].value = HOST_HEADER;
+
+    for (i = 0, fixed_len = 0; i < 5; i++) {
+        fixed_len += fixed[i].key.len + fixed[i].value.len;
+    }
+    canon_qs_len = ngx_aws_auth__canon_qs_length(n_args + 5, qs_escaped_len + fixed_len);
+
+    string_to_sign.len = STRING_TO_SIGN_PREFIX.len + AMZ_DATE_LENGTH + key_scope->len + 2
+                         + NGX_AWS_AUTH__SHA256_HEX_LENGTH;
+    len = scheme->len + 3 + tpl->host.len + ngx_aws_auth__escaped_uri_length(&url) + 1 + canon_qs_len
+          + PRESIGN_SIGNATURE_ARG.len + NGX_AWS_AUTH__SHA256_HEX_LENGTH;
+
+    // the URL, the sort space, the digest, then the strings
+    retval = ngx_palloc(pool, sizeof(ngx_str_t) + n_args * sizeof(header_pair_t) + ngx_aws_auth__sha256_ctx_size()
+                              + string_to_sign.len + fixed[1].value.len + qs_escaped_len + len);
+    if (retval == NULL) {
+        return NULL;
+    }
+
+    qs_args = (header_pair_t *) (retval + 1);
+    sha256 = (ngx_aws_auth__sha256_ctx_t *) (qs_args + n_args);
+    string_to_sign.data = (u_char *) sha256 + ngx_aws_auth__sha256_ctx_size();
+
+    fixed[1].value.data = string_to_sign.data + string_to_sign.len;
+    p = ngx_cpymem(fixed[1].value.data, tpl->presign_credential.data, tpl->presign_credential.len);
+    scratch = ngx_aws_auth__write_escaped_arg(p, key_scope);
+
+    retval->data = scratch + qs_escaped_len;
+    p = ngx_cpymem(retval->data, scheme->data, scheme->len);
+    p = ngx_cpymem(p, "://", 3);
+    p = ngx_cpymem(p, tpl->host.data, tpl->host.len);
+
+    canon_uri = p;
+    p = ngx_aws_auth__write_escaped_uri(p, &url);
+    *p++ = '?';
+
+    canon_qs = p;
+    n_args = ngx_aws_auth__sort_query_args(qs_args, scratch, &req->args);
+    for (i = 0, j = 0; i < n_args || j < 5; ) {
+        if (i + j) {
+            *p++ = '&';
+        }
+
+        if (i < n_args && (j == 5 || ngx_aws_auth__cmp_qs_args(&qs_args[i], &fixed[j]) < 0)) {
+            arg = &qs_args[i++];
+        } else {
+            arg = &fixed[j++];
+        }
+
+        p = ngx_cpymem(p, arg->key.data, arg->key.len);
+        *p++ = '=';
+        p = ngx_cpymem(p, arg->value.data, arg->value.len);
+    }
+
+    // canonical request, the URI and query string are those just written
+    ngx_aws_auth__sha256_reset(sha256);
+    ngx_aws_auth__sha256_update(sha256, req->method_name.data, req->method_name.len);
+    ngx_aws_auth__sha256_update(sha256, (u_char *) "\n", 1);
+    ngx_aws_auth__sha256_update(sha256, canon_uri, canon_qs - 1 - canon_uri);
+    ngx_aws_auth__sha256_update(sha256, (u_char *) "\n", 1);
+    ngx_aws_auth__sha256_update(sha256, canon_qs, p - canon_qs);
+    ngx_aws_auth__sha256_update(sha256, (u_char *) "\n", 1);
+    ngx_aws_auth__sha256_update(sha256, tpl->host_line.data, tpl->host_line.len);
+    ngx_aws_auth__sha256_update(sha256, PRESIGN_CANON_TAIL.data, PRESIGN_CANON_TAIL.len);
+
+    p = ngx_cpymem(p, PRESIGN_SIGNATURE_ARG.data, PRESIGN_SIGNATURE_ARG.len);
+    retval->len = p + NGX_AWS_AUTH__SHA256_HEX_LENGTH - retval->data;
+
+    // string to sign, then its MAC at the end of the URL
+    p = ngx_cpymem(string_to_sign.data, STRING_TO_SIGN_PREFIX.data, STRING_TO_SIGN_PREFIX.len);
+    p = ngx_cpymem(p, fixed[2].value.data, AMZ_DATE_LENGTH);
+    *p++ = '\n';
+    p = ngx_cpymem(p, key_scope->data, key_scope->len);
+    *p++ = '\n';
+    ngx_aws_auth__sha256_final_hex(sha256, p);
+
+    ngx_aws_auth__hmac_key_sha256_hex(hmac_key, string_to_sign.data, string_to_sign.len,
+                                      retval->data + retval->len - NGX_AWS_AUTH__SHA256_HEX_LENGTH);
+
+    return retval;
+}
+
+
+// Splits a SigV4 authorization header into its fields. Fields are separated
+// by commas, optionally followed by spaces, in any order; the credential
+// must be <access key>/<YYYYMMDD>/<region>/<service>/aws4_request and the
+// signature a hex SHA-256. NGX_DECLINED for anything else
+static inline ngx_int_t ngx_aws_auth__parse_authorization(const ngx_str_t *value, ngx_aws_auth_credential_t *cred) {
+    static const ngx_str_t credential = ngx_string("Credential");
+    static const ngx_str_t signed_headers = ngx_string("SignedHeaders");
+    static const ngx_str_t signature = ngx_string("Signature");
+    u_char *p, *last, *field, *eq, *end, *slash[4];
+    ngx_str_t name, *dst;
+    ngx_uint_t i, n;
+
+    ngx_memzero(cred, sizeof(ngx_aws_auth_credential_t));
+
+    // the algorithm, then a space
+    n = STRING_TO_SIGN_PREFIX.len - 1;
+    if (value->len <= n || ngx_strncmp(value->data, STRING_TO_SIGN_PREFIX.data, n) != 0 || value->data[n] != ' ') {
+        return NGX_DECLINED;
+    }
+
+    p = value->data + n;
+    last = value->data + value->len;
 
+    while (p < last) {
+        while (p < last && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+        if (p == last) {
+            break;
+        }
+
+        field = p;
+        eq = NULL;
+        while (p < last && *p != ',') {
+            if (eq == NULL && *p == '=') {
+                eq = p;
+            }
+            p++;
+        }
+        end = p;
+        while (end > field && end[-1] == ' ') {
+            end--;
+        }
+        if (eq == NULL) {
+            return NGX_DECLINED;
+        }
+
+        name.data = field;
+        name.len = eq - field;
+        if (name.len == credential.len && ngx_strncmp(name.data, credential.data, name.len) == 0) {
+            dst = &cred->key_scope;
+        } else if (name.len == signed_headers.len && ngx_strncmp(name.data, signed_headers.data, name.len) == 0) {
+            dst = &cred->signed_header_names;
+        } else if (name.len == signature.len && ngx_strncmp(name.data, signature.data, name.len) == 0) {
+            dst = &cred->signature;
+        } else {
+            return NGX_DECLINED;
+        }
+
+        if (dst->data != NULL) {
+            // given twice
+            return NGX_DECLINED;
+        }
+        dst->data = eq + 1;
+        dst->len = end - dst->data;
+    }
+
+    if (cred->key_scope.len == 0 || cred->signed_header_names.len == 0
+        || cred->signature.len != NGX_AWS_AUTH__SHA256_HEX_LENGTH) {
+        return NGX_DECLINED;
+    }
+
+    for (i = 0; i < cred->signature.len; i++) {
+        if (!((cred->signature.data[i] >= '0' && cred->signature.data[i] <= '9')
+              || (cred->signature.data[i] >= 'a' && cred->signature.data[i] <= 'f'))) {
+            return NGX_DECLINED;
+        }
+    }
+
+    // Credential is the access key, then the key scope
+    for (p = cred->key_scope.data, last = p + cred->key_scope.len, n = 0; p < last; p++) {
+        if (*p == '/') {
+            if (n == 4) {
+                return NGX_DECLINED;
+            }
+            slash[n++] = p;
+        }
+    }
+    if (n != 4) {
+        return NGX_DECLINED;
+    }
+
+    cred->access_key.data = cred->key_scope.data;
+    cred->access_key.len = slash[0] - cred->key_scope.data;
+    cred->date.data = slash[0] + 1;
+    cred->date.len = slash[1] - cred->date.data;
+    cred->region.data = slash[1] + 1;
+    cred->region.len = slash[2] - cred->region.data;
+    cred->service.data = slash[2] + 1;
+    cred->service.len = slash[3] - cred->service.data;
+    cred->key_scope.data = cred->date.data;
+    cred->key_scope.len = last - cred->key_scope.data;
+
+    if (cred->access_key.len == 0 || cred->date.len != AMZ_DATE_WIDTH || cred->region.len == 0
+        || cred->service.len == 0 || (size_t) (last - slash[3] - 1) != AUTH_KEY_SCOPE_TERMINATOR.len
+        || ngx_strncmp(slash[3] + 1, AUTH_KEY_SCOPE_TERMINATOR.data, AUTH_KEY_SCOPE_TERMINATOR.len) != 0) {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+// the time of an x-amz-date, NGX_ERROR unless it is YYYYMMDD'T'HHMMSS'Z'
+static inline time_t ngx_aws_auth__parse_amz_date(const ngx_str_t *date) {
+    static const ngx_uint_t days_before_month[] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+    // digits of the year, month, day, hour, minute and second
+    static const ngx_uint_t widths[] = {4, 2, 2, 2, 2, 2};
+    ngx_uint_t i, j, v[6], year, month, day, days;
+    const u_char *p;
+
+    if (date->len != AMZ_DATE_LENGTH || date->data[8] != 'T' || date->data[15] != 'Z') {
+        return NGX_ERROR;
+    }
+
+    for (i = 0, p = date->data; i < 6; i++) {
+        if (i == 3) {
+            p++; // 'T'
+        }
+
+        v[i] = 0;
+        for (j = 0; j < widths[i]; j++, p++) {
+            if (*p < '0' || *p > '9') {
+                return NGX_ERROR;
+            }
+            v[i] = v[i] * 10 + (*p - '0');
+        }
+    }
+
+    year = v[0];
+    month = v[1];
+    day = v[2];
+    if (year < 1970 || month < 1 || month > 12 || day < 1 || day > 31 || v[3] > 23 || v[4] > 59 || v[5] > 60) {
+        return NGX_ERROR;
+    }
+
+    // days since the epoch, years divisible by 4 but for centuries not
+    // divisible by 400 are leap years
+    days = (year - 1970) * 365 + (year - 1969) / 4 - (year - 1901) / 100 + (year - 1601) / 400
+           + days_before_month[month - 1] + day - 1;
+    if (month > 2 && year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)) {
+        days++;
+    }
+
+    return (time_t) days * 86400 + v[3] * 3600 + v[4] * 60 + v[5];
+}
+
+// Parses the Content-Range of a 206, "bytes <first>-<last>/<length>" with
+// the length known; NGX_ERROR for anything else
+static inline ngx_int_t ngx_aws_auth__parse_content_range(const ngx_str_t *value, off_t *first, off_t *last,
+                                                          off_t *length) {
+    static const ngx_str_t unit = ngx_string("bytes ");
+    u_char *p, *end, *dash, *slash;
+
+    if (value->len <= unit.len || ngx_strncasecmp(value->data, unit.data, unit.len) != 0) {
+        return NGX_ERROR;
+    }
+
+    p = value->data + unit.len;
+    end = value->data + value->len;
+    dash = ngx_strlchr(p, end, '-');
+    slash = dash ? ngx_strlchr(dash, end, '/') : NULL;
+    if (slash == NULL) {
+        return NGX_ERROR;
+    }
+
+    *first = ngx_atoof(p, dash - p);
+    *last = ngx_atoof(dash + 1, slash - dash - 1);
+    *length = ngx_atoof(slash + 1, end - slash - 1);
+    if (*first == NGX_ERROR || *last == NGX_ERROR || *length == NGX_ERROR || *first > *last || *last >= *length) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+// The length in the Content-Range of a 416, "bytes */<length>"; NGX_ERROR
+// for anything else
+static inline off_t ngx_aws_auth__parse_unsatisfied_range(const ngx_str_t *value) {
+    static const ngx_str_t unit = ngx_string("bytes */");
+
+    if (value->len <= unit.len || ngx_strncasecmp(value->data, unit.data, unit.len) != 0) {
+        return NGX_ERROR;
+    }
+
+    return ngx_atoof(value->data + unit.len, value->len - unit.len);
+}
+
+// The part size of a multipart upload of length bytes: part_size, unless
+// that takes more than S3's 10000 parts; then the smallest whole number of
+// MiB that does not. NGX_ERROR if even the largest part size is too small
+static inline off_t ngx_aws_auth__multipart_part_size(off_t length, off_t part_size) {
+    off_t min;
+
+    min = (length + AWS_MULTIPART_PARTS_MAX - 1) / AWS_MULTIPART_PARTS_MAX;
+    if (part_size < min) {
+        part_size = (min + 1024 * 1024 - 1) / (1024 * 1024) * (1024 * 1024);
+    }
+
+    return (part_size > AWS_MULTIPART_PART_SIZE_MAX) ? NGX_ERROR : part_size;
+}
+
+// The text of the first <name> element of an S3 response, with the
+// entities S3 writes decoded; NULL if there is none
+static inline const ngx_str_t *ngx_aws_auth__xml_element(ngx_pool_t *pool, const ngx_str_t *xml,
+                                                         const ngx_str_t *name) {
+    static const ngx_str_t entities[] = {ngx_string("&quot;"), ngx_string("&amp;"), ngx_string("&lt;"),
+                                         ngx_string("&gt;"), ngx_string("&apos;")};
+    static const u_char decoded[] = {'"', '&', '<', '>', '\''};
+    u_char *p, *last, *start, *end, *q;
+    ngx_str_t *retval;
+    ngx_uint_t i;
 
-    const ngx_str_t *auth_header_value = ngx_aws_auth__make_auth_token(pool, signature_details.signature,
-                                                                       signature_details.signed_header_names,
-                                                                       access_key_id, key_scope);
+    last = xml->data + xml->len;
+    start = NULL;
+    end = NULL;
 
+    for (p = xml->data; p + name->len + 2 <= last; p++) {
+        if (p[0] == '<' && p[name->len + 1] == '>' && ngx_strncmp(p + 1, name->data, name->len) == 0) {
+            start = p + name->len + 2;
+            break;
+        }
+    }
+
+    for (p = start; start != NULL && p + name->len + 3 <= last; p++) {
+        if (p[0] == '<' && p[1] == '/' && p[name->len + 2] == '>' && ngx_strncmp(p + 2, name->data, name->len) == 0) {
+            end = p;
+            break;
+        }
+    }
+
+    if (end == NULL) {
+        return NULL;
+    }
+
+    retval = ngx_palloc(pool, sizeof(ngx_str_t) + (end - start));
+    if (retval == NULL) {
+        return NULL;
+    }
+    retval->data = (u_char *) (retval + 1);
+
+    for (p = start, q = retval->data; p < end; ) {
+        for (i = 0; *p == '&' && i < sizeof(entities) / sizeof(entities[0]); i++) {
+            if ((size_t) (end - p) >= entities[i].len && ngx_strncmp(p, entities[i].data, entities[i].len) == 0) {
+                break;
+            }
+        }
+
+        if (*p == '&' && i < sizeof(entities) / sizeof(entities[0])) {
+            *q++ = decoded[i];
+            p += entities[i].len;
+        } else {
+            *q++ = *p++;
+        }
+    }
+    retval->len = q - retval->data;
+
+    return retval;
+}
+
+// The body of a CompleteMultipartUpload, etags[i] being the ETag S3 gave
+// part i + 1
+static inline const ngx_str_t *ngx_aws_auth__complete_multipart_body(ngx_pool_t *pool, const ngx_str_t *etags,
+                                                                     ngx_uint_t n) {
+    static const ngx_str_t head = ngx_string("<CompleteMultipartUpload>");
+    static const ngx_str_t tail = ngx_string("</CompleteMultipartUpload>");
+    static const ngx_str_t part = ngx_string("<Part><PartNumber></PartNumber><ETag></ETag></Part>");
+    ngx_str_t *retval;
+    ngx_uint_t i;
+    size_t len;
+    u_char *p;
+
+    len = head.len + tail.len + n * (part.len + NGX_INT_T_LEN);
+    for (i = 0; i < n; i++) {
+        len += etags[i].len;
+    }
+
+    retval = ngx_palloc(pool, sizeof(ngx_str_t) + len);
+    if (retval == NULL) {
+        return NULL;
+    }
+    retval->data = (u_char *) (retval + 1);
+
+    p = ngx_cpymem(retval->data, head.data, head.len);
+    for (i = 0; i < n; i++) {
+        p = ngx_sprintf(p, "<Part><PartNumber>%ui</PartNumber><ETag>%V</ETag></Part>", i + 1, &etags[i]);
+    }
+    p = ngx_cpymem(p, tail.data, tail.len);
+    retval->len = p - retval->data;
+
+    return retval;
+}
+
+// compares without returning early, so the time taken does not tell how
+// much of a signature a client got right
+static inline ngx_uint_t ngx_aws_auth__constant_time_equal(const u_char *one, const u_char *two, size_t len) {
+    volatile u_char diff = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        diff |= one[i] ^ two[i];
+    }
+
+    return diff == 0;
+}
+
+// Checks the signature of a client's request the way S3 would. host is the
+// request's host header, amz_date and payload_hash its x-amz-date and
+// x-amz-content-sha256, extra_headers the other headers the client signed,
+// lowercased and in the order of the credential; signing_key the key derived
+// for the credential's scope. Together they must be exactly the headers
+// named in the credential. The canonical request is built by
+// ngx_aws_auth__prepare_with_template with a template for the client's host.
+// NGX_DECLINED when the signature does not match, NGX_ERROR if memory ran out
+static inline ngx_int_t ngx_aws_auth__verify_signature(ngx_pool_t *pool, const ngx_http_request_t *req,
+                                                       const ngx_aws_auth_credential_t *cred,
+                                                       const ngx_str_t *host, const ngx_str_t *amz_date,
+                                                       const ngx_str_t *payload_hash,
+                                                       const ngx_array_t *extra_headers,
+                                                       const ngx_str_t *signing_key) {
+    ngx_aws_auth_pending_signature_t pending;
+    ngx_aws_auth_template_t tpl;
+    ngx_aws_auth__hmac_key_t *hmac_key;
+    ngx_http_request_t signed_req;
+    const ngx_array_t *headers_out;
+    const header_pair_t *authz;
+    ngx_str_t names;
+    time_t date;
+    u_char *p;
+
+    // dated as the client signed it, which only works for a date written
+    // the way it would be written back
+    date = ngx_aws_auth__parse_amz_date(amz_date);
+    if (date == NGX_ERROR
+        || ngx_strncmp(ngx_aws_auth__cached_amz_date(date), amz_date->data, AMZ_DATE_LENGTH) != 0) {
+        return NGX_DECLINED;
+    }
+
+    signed_req = *req;
+    signed_req.start_sec = date;
+
+    // the client's host is signed whole; the authorization header is only
+    // looked at for the signed header names, it needs no access key
+    p = ngx_pnalloc(pool, HOST_HEADER.len + host->len + 2
+                          + AUTH_SIGNED_HEADERS_PREFIX.len + FIXED_SIGNED_HEADERS.len + AUTH_SIGNATURE_PREFIX.len);
+    hmac_key = ngx_palloc(pool, ngx_aws_auth__hmac_key_size());
+    if (p == NULL || hmac_key == NULL || ngx_aws_auth__hmac_key_set(pool, hmac_key, signing_key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&tpl, sizeof(ngx_aws_auth_template_t));
+    tpl.host_line.data = p;
+    p = ngx_cpymem(p, HOST_HEADER.data, HOST_HEADER.len);
+    *p++ = ':';
+    tpl.host.data = p;
+    tpl.host.len = host->len;
+    p = ngx_cpymem(p, host->data, host->len);
+    *p++ = '\n';
+    tpl.host_line.len = p - tpl.host_line.data;
+
+    tpl.signed_header_names = FIXED_SIGNED_HEADERS;
+    tpl.signature_prefix.data = p;
+    p = ngx_cpymem(p, AUTH_SIGNED_HEADERS_PREFIX.data, AUTH_SIGNED_HEADERS_PREFIX.len);
+    p = ngx_cpymem(p, FIXED_SIGNED_HEADERS.data, FIXED_SIGNED_HEADERS.len);
+    p = ngx_cpymem(p, AUTH_SIGNATURE_PREFIX.data, AUTH_SIGNATURE_PREFIX.len);
+    tpl.signature_prefix.len = p - tpl.signature_prefix.data;
+    tpl.time_bucket = 1;
+
+    headers_out = ngx_aws_auth__prepare_with_template(pool, &signed_req, &tpl, &cred->key_scope, payload_hash,
+                                                      extra_headers, &pending);
+    if (headers_out == NULL) {
+        return NGX_ERROR;
+    }
+
+    // the names are between the prefixes of the authorization header, the
+    // last one prepared
+    authz = (const header_pair_t *) headers_out->elts + headers_out->nelts - 1;
+    names.data = authz->value.data + cred->key_scope.len + AUTH_SIGNED_HEADERS_PREFIX.len;
+    names.len = pending.signature - AUTH_SIGNATURE_PREFIX.len - names.data;
+
+    if (names.len != cred->signed_header_names.len
+        || ngx_strncmp(names.data, cred->signed_header_names.data, names.len) != 0) {
+        return NGX_DECLINED;
+    }
+
+    ngx_aws_auth__hmac_key_sha256_hex(hmac_key, pending.string_to_sign.data, pending.string_to_sign.len,
+                                      pending.signature);
+
+    if (cred->signature.len != NGX_AWS_AUTH__SHA256_HEX_LENGTH
+        || !ngx_aws_auth__constant_time_equal(pending.signature, cred->signature.data,
+                                              NGX_AWS_AUTH__SHA256_HEX_LENGTH)) {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+// the signature of the request headers is what the first chunk chains from,
+// ngx_aws_auth__make_auth_token always puts it at the end of the header
+static inline const ngx_str_t *ngx_aws_auth__seed_signature(ngx_pool_t *pool, const ngx_array_t *signed_headers) {
+    ngx_uint_t i;
+    ngx_str_t *seed;
     header_pair_t *header_ptr;
-    header_ptr = ngx_array_push(signature_details.header_list);
-    header_ptr->key = AUTHZ_HEADER;
-    header_ptr->value = *auth_header_value;
 
-    return signature_details.header_list;
+    for (i = 0; i < signed_headers->nelts; i++) {
+        header_ptr = &((header_pair_t *) signed_headers->elts)[i];
+        if (header_ptr->key.len == AUTHZ_HEADER.len
+            && ngx_strncmp(header_ptr->key.data, AUTHZ_HEADER.data, AUTHZ_HEADER.len) == 0
+            && header_ptr->value.len >= NGX_AWS_AUTH__SHA256_HEX_LENGTH) {
+            seed = ngx_palloc(pool, sizeof(ngx_str_t));
+            if (seed == NULL) {
+                return NULL;
+            }
+            seed->len = NGX_AWS_AUTH__SHA256_HEX_LENGTH;
+            seed->data = header_ptr->value.data + header_ptr->value.len - NGX_AWS_AUTH__SHA256_HEX_LENGTH;
+            return seed;
+        }
+    }
+
+    return NULL;
+}
+
+static inline size_t ngx_aws_auth__hex_digits(off_t value) {
+    size_t digits = 1;
+
+    while (value >>= 4) {
+        digits++;
+    }
+
+    return digits;
+}
+
+// length of "<hex size>;chunk-signature=<signature>\r\n"
+static inline size_t ngx_aws_auth__chunk_header_length(size_t chunk_len) {
+    return ngx_aws_auth__hex_digits(chunk_len) + CHUNK_SIGNATURE_PREFIX.len + NGX_AWS_AUTH__SHA256_HEX_LENGTH + 2;
+}
+
+// size of the aws-chunked body for a payload of decoded_length bytes cut into
+// chunk_size chunks, including the trailing CRLF of every chunk and the final
+// zero length chunk
+static inline off_t ngx_aws_auth__streaming_body_length(off_t decoded_length, size_t chunk_size) {
+    off_t full = decoded_length / chunk_size;
+    size_t partial = decoded_length % chunk_size;
+    off_t length;
+
+    length = full * (ngx_aws_auth__chunk_header_length(chunk_size) + chunk_size + 2);
+    if (partial) {
+        length += ngx_aws_auth__chunk_header_length(partial) + partial + 2;
+    }
+
+    return length + ngx_aws_auth__chunk_header_length(0) + 2;
+}
+
+static inline u_char *ngx_aws_auth__write_chunk_header(u_char *p, size_t chunk_len, const u_char *signature) {
+    p = ngx_sprintf(p, "%xz", chunk_len);
+    p = ngx_cpymem(p, CHUNK_SIGNATURE_PREFIX.data, CHUNK_SIGNATURE_PREFIX.len);
+    p = ngx_cpymem(p, signature, NGX_AWS_AUTH__SHA256_HEX_LENGTH);
+    *p++ = CR;
+    *p++ = LF;
+    return p;
+}
+
+static inline ngx_int_t ngx_aws_auth__chunk_signer_init(ngx_pool_t *pool, ngx_aws_auth_chunk_signer_t *signer,
+                                                        const ngx_aws_auth__hmac_key_t *hmac_key,
+                                                        const ngx_str_t *key_scope,
+                                                        const ngx_str_t *date, const ngx_str_t *seed_signature) {
+    u_char *p;
+
+    if (seed_signature == NULL || seed_signature->len != NGX_AWS_AUTH__SHA256_HEX_LENGTH) {
+        return NGX_ERROR;
+    }
+
+    // key, scope, date and the string to sign all live in one block
+    signer->string_to_sign.len = CHUNK_STRING_TO_SIGN_PREFIX.len + date->len + 1 + key_scope->len + 1
+                                 + 3 * NGX_AWS_AUTH__SHA256_HEX_LENGTH + 2;
+    signer->hmac_key = ngx_palloc(pool, ngx_aws_auth__hmac_key_size() + key_scope->len + date->len
+                                        + signer->string_to_sign.len);
+    if (signer->hmac_key == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_aws_auth__hmac_key_copy(pool, signer->hmac_key, hmac_key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+    p = (u_char *) signer->hmac_key + ngx_aws_auth__hmac_key_size();
+
+    signer->key_scope.data = p;
+    signer->key_scope.len = key_scope->len;
+    p = ngx_cpymem(p, key_scope->data, key_scope->len);
+
+    signer->date.data = p;
+    signer->date.len = date->len;
+    p = ngx_cpymem(p, date->data, date->len);
+
+    signer->string_to_sign.data = p;
+    ngx_memcpy(signer->signature, seed_signature->data, NGX_AWS_AUTH__SHA256_HEX_LENGTH);
+
+    return NGX_OK;
+}
+
+// string to sign of a chunk is
+//   AWS4-HMAC-SHA256-PAYLOAD\n<date>\n<scope>\n<previous signature>\n
+//   <hash of the empty string>\n<hash of the chunk data>
+// the resulting signature replaces signer->signature
+static inline void ngx_aws_auth__sign_chunk(ngx_aws_auth_chunk_signer_t *signer, const u_char *data, size_t len) {
+    u_char *p = signer->string_to_sign.data;
+
+    p = ngx_cpymem(p, CHUNK_STRING_TO_SIGN_PREFIX.data, CHUNK_STRING_TO_SIGN_PREFIX.len);
+    p = ngx_cpymem(p, signer->date.data, signer->date.len);
+    *p++ = '\n';
+    p = ngx_cpymem(p, signer->key_scope.data, signer->key_scope.len);
+    *p++ = '\n';
+    p = ngx_cpymem(p, signer->signature, NGX_AWS_AUTH__SHA256_HEX_LENGTH);
+    *p++ = '\n';
+    p = ngx_cpymem(p, EMPTY_STRING_SHA256.data, EMPTY_STRING_SHA256.len);
+    *p++ = '\n';
+    ngx_aws_auth__sha256_hex(data, len, p);
+    p += NGX_AWS_AUTH__SHA256_HEX_LENGTH;
+
+    ngx_aws_auth__hmac_key_sha256_hex(signer->hmac_key, signer->string_to_sign.data,
+                                      p - signer->string_to_sign.data, signer->signature);
+}
+
+
+// the unsigned payload goes out as a single aws-chunked chunk followed by the
+// checksum trailer, so the client buffers are passed on as they are:
+//   <hex size>\r\n<payload>\r\n0\r\nx-amz-checksum-crc32c:<base64 crc>\r\n\r\n
+#define AWS_CRC32C_BASE64_LENGTH 8
+
+static inline size_t ngx_aws_auth__checksum_trailer_length(void) {
+    return 2 + 3 + AMZ_CHECKSUM_CRC32C_HEADER.len + 1 + AWS_CRC32C_BASE64_LENGTH + 4;
+}
+
+static inline off_t ngx_aws_auth__trailer_body_length(off_t decoded_length) {
+    return ngx_aws_auth__hex_digits(decoded_length) + 2 + decoded_length + ngx_aws_auth__checksum_trailer_length();
+}
+
+static inline u_char *ngx_aws_auth__write_unsigned_chunk_header(u_char *p, off_t decoded_length) {
+    p = ngx_sprintf(p, "%xO", decoded_length);
+    *p++ = CR;
+    *p++ = LF;
+    return p;
+}
+
+// writes everything after the payload, the checksum is sent big endian
+static inline u_char *ngx_aws_auth__write_checksum_trailer(u_char *p, uint32_t crc) {
+    u_char raw[4];
+    ngx_str_t src, dst;
+
+    raw[0] = (u_char) (crc >> 24);
+    raw[1] = (u_char) (crc >> 16);
+    raw[2] = (u_char) (crc >> 8);
+    raw[3] = (u_char) crc;
+
+    *p++ = CR;
+    *p++ = LF;
+    *p++ = '0';
+    *p++ = CR;
+    *p++ = LF;
+    p = ngx_cpymem(p, AMZ_CHECKSUM_CRC32C_HEADER.data, AMZ_CHECKSUM_CRC32C_HEADER.len);
+    *p++ = ':';
+
+    src.data = raw;
+    src.len = sizeof(raw);
+    dst.data = p;
+    ngx_encode_base64(&dst, &src);
+    p += dst.len;
+
+    *p++ = CR;
+    *p++ = LF;
+    *p++ = CR;
+    *p++ = LF;
+    return p;
 }
 
 
@@ -480,10 +2153,36 @@ is_signing_key_valid(ngx_http_aws_auth_conf_t *conf, const ngx_str_t *dateTimeSt
 }
 
 
+// names a derived signing key in the shared key cache without putting the
+// secret itself there: hex SHA-256 over secret, date, region and service
+static inline ngx_int_t
+ngx_aws_auth__signing_key_id(ngx_pool_t *pool, const ngx_http_aws_auth_conf_t *conf,
+                             const u_char *dateStamp, u_char *id) {
+    u_char *buf, *p;
+    size_t len = conf->secret_key.len + AMZ_DATE_WIDTH + conf->region.len + conf->service.len + 3;
+
+    buf = ngx_palloc(pool, len);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(buf, conf->secret_key.data, conf->secret_key.len);
+    *p++ = '\0';
+    p = ngx_cpymem(p, dateStamp, AMZ_DATE_WIDTH);
+    *p++ = '\0';
+    p = ngx_cpymem(p, conf->region.data, conf->region.len);
+    *p++ = '\0';
+    p = ngx_cpymem(p, conf->service.data, conf->service.len);
+
+    ngx_aws_auth__sha256_hex(buf, p - buf, id);
+    return NGX_OK;
+}
+
+
 static inline void
 update_key_scope(ngx_pool_t *pool, ngx_http_aws_auth_conf_t *conf, uint8_t *dateStamp) {
     // Update Key Scope
-    int keyScopeLength = ngx_strlen((char *) conf->region.data) + ngx_strlen((char *) conf->service.data) + 16;
+    int keyScopeLength = AMZ_DATE_WIDTH + conf->region.len + conf->service.len + sizeof("///aws4_request");
     uint8_t *keyScopeBuffer = ngx_pcalloc(pool, keyScopeLength * sizeof(uint8_t));
     ngx_memcpy(keyScopeBuffer, dateStamp, AMZ_DATE_WIDTH);
 
@@ -532,4 +2231,82 @@ update_key_signature(ngx_pool_t *pool, ngx_http_aws_auth_conf_t *conf, time_t *t
     }
 }
 
+
+static inline ngx_aws_auth_key_epoch_t *
+ngx_aws_auth__make_key_epoch(ngx_pool_t *pool, const ngx_str_t *signing_key, const ngx_str_t *key_scope,
+                             time_t when) {
+    ngx_aws_auth_key_epoch_t *epoch;
+    u_char *p;
+
+    // the epoch, its keyed HMAC state and its strings are one block
+    epoch = ngx_palloc(pool, sizeof(ngx_aws_auth_key_epoch_t) + ngx_aws_auth__hmac_key_size()
+                             + signing_key->len + key_scope->len);
+    if (epoch == NULL) {
+        return NULL;
+    }
+
+    epoch->hmac_key = (ngx_aws_auth__hmac_key_t *) (epoch + 1);
+    if (ngx_aws_auth__hmac_key_set(pool, epoch->hmac_key, signing_key) != NGX_OK) {
+        return NULL;
+    }
+
+    p = (u_char *) epoch->hmac_key + ngx_aws_auth__hmac_key_size();
+    epoch->signing_key.data = p;
+    epoch->signing_key.len = signing_key->len;
+    p = ngx_cpymem(p, signing_key->data, signing_key->len);
+
+    epoch->key_scope.data = p;
+    epoch->key_scope.len = key_scope->len;
+    ngx_memcpy(p, key_scope->data, key_scope->len);
+
+    epoch->valid_from = when - when % AWS_KEY_EPOCH_SECONDS;
+    epoch->valid_until = epoch->valid_from + AWS_KEY_EPOCH_SECONDS;
+    epoch->pool = NULL;
+    epoch->refs = 0;
+    epoch->retired = 0;
+
+    return epoch;
+}
+
+static inline ngx_flag_t
+ngx_aws_auth__epoch_covers(const ngx_aws_auth_key_epoch_t *epoch, time_t when) {
+    return epoch != NULL && when >= epoch->valid_from && when < epoch->valid_until;
+}
+
+// The epoch of the configuration covering `when`, the current one or the one
+// it replaced, NULL for any other day. Epochs only move forward: a later day
+// is for the caller to rotate to, an earlier one gets an epoch of its own
+static inline ngx_aws_auth_key_epoch_t *
+ngx_aws_auth__find_epoch(const ngx_http_aws_auth_conf_t *conf, time_t when) {
+    if (ngx_aws_auth__epoch_covers(conf->epoch, when)) {
+        return conf->epoch;
+    }
+
+    if (ngx_aws_auth__epoch_covers(conf->prev_epoch, when)) {
+        return conf->prev_epoch;
+    }
+
+    return NULL;
+}
+
+// runs the HMAC chain of update_key_signature for the UTC day of `when`
+// without touching the configuration
+static inline ngx_aws_auth_key_epoch_t *
+ngx_aws_auth__derive_key_epoch(ngx_pool_t *pool, const ngx_http_aws_auth_conf_t *conf, time_t when) {
+    ngx_http_aws_auth_conf_t scratch = *conf;
+
+    scratch.key_scope.data = ngx_pcalloc(pool, AMZ_DATE_WIDTH + conf->region.len + conf->service.len
+                                               + sizeof("///aws4_request"));
+    scratch.key_scope.len = 0;
+    scratch.signing_key_decoded.data = ngx_pcalloc(pool, EVP_MAX_MD_SIZE);
+    if (scratch.key_scope.data == NULL || scratch.signing_key_decoded.data == NULL) {
+        return NULL;
+    }
+
+    update_key_signature(pool, &scratch, &when);
+
+    return ngx_aws_auth__make_key_epoch(pool, &scratch.signing_key_decoded, &scratch.key_scope, when);
+}
+
+
 #endif
@@ -0,0 +1,288 @@
+/* Signing microbenchmark
+ *
+ * Runs the signer over synthetic requests and prints one JSON object per
+ * line for every workload and stage:
+ *
+ *   {"workload":"args_20","stage":"hash","iterations":20000,"ns_per_op":812.4,
+ *    "pool_bytes":96,"large_allocs":0}
+ *
+ * The stages are those of ngx_aws_auth__compute_signature (canonicalize,
+ * hash, hmac, token), then the whole of ngx_aws_auth__sign and the
+ * template path the module takes per request. pool_bytes is what one
+ * operation takes from a fresh pool, large_allocs the allocations too big
+ * for its blocks. Between operations the pool is reset, as nginx does not
+ * free a request's memory piecemeal either. Like the unit tests it is linked against the objects of an nginx
+ * build, see the bench target of the Makefile; an iteration count may be
+ * given as the only argument.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../aws_functions.h"
+
+#define BENCH_ITERATIONS_DEFAULT 20000
+#define BENCH_POOL_SIZE 16384
+#define BENCH_URI_MAX 4096
+#define BENCH_ARGS_MAX 4096
+
+typedef struct {
+    const char *name;
+    size_t uri_segments;  /* "/segment-NNN" repeated */
+    ngx_uint_t n_args;
+    ngx_uint_t utf8;      /* UTF-8 object key and argument keys */
+} bench_workload_t;
+
+typedef struct {
+    ngx_pool_t *pool;     /* reset before every operation */
+    ngx_http_request_t request;
+    ngx_aws_auth_template_t tpl;
+    const ngx_aws_auth__hmac_key_t *hmac_key;
+
+    /* inputs of each stage, computed once from the stage before */
+    const ngx_str_t *date;
+    struct AwsCanonicalRequestDetails canon_request;
+    const ngx_str_t *canon_request_hash;
+    const ngx_str_t *signature;
+} bench_ctx_t;
+
+typedef struct {
+    const char *name;
+    void (*run)(bench_ctx_t *ctx);
+} bench_stage_t;
+
+static const ngx_str_t access_key = ngx_string("AKIDEXAMPLE");
+static const ngx_str_t key_scope = ngx_string("20150830/us-east-1/s3/aws4_request");
+static const ngx_str_t bucket = ngx_string("examplebucket");
+static const ngx_str_t endpoint = ngx_string("s3.amazonaws.com");
+static ngx_str_t signing_key = ngx_string("0123456789abcdef0123456789abcdef");
+
+static const bench_workload_t workloads[] = {
+    {"short_uri", 1, 0, 0},
+    {"long_uri", 64, 0, 0},
+    {"args_5", 2, 5, 0},
+    {"args_20", 2, 20, 0},
+    {"args_50", 2, 50, 0},
+    {"utf8", 8, 5, 1},
+};
+
+/* keeps the compiler from dropping what a stage computes */
+static volatile uintptr_t bench_sink;
+
+
+static void bench_canonicalize(bench_ctx_t *ctx) {
+    struct AwsCanonicalRequestDetails canon_request;
+
+    canon_request = ngx_aws_auth__make_canonical_request(ctx->pool, &ctx->request, &bucket, ctx->date, NULL,
+                                                         &endpoint, NULL);
+    bench_sink = (uintptr_t) canon_request.canon_request;
+}
+
+static void bench_hash(bench_ctx_t *ctx) {
+    bench_sink = (uintptr_t) ngx_aws_auth__hash_sha256(ctx->pool, ctx->canon_request.canon_request);
+}
+
+static void bench_hmac(bench_ctx_t *ctx) {
+    const ngx_str_t *string_to_sign;
+
+    string_to_sign = ngx_aws_auth__string_to_sign(ctx->pool, &key_scope, ctx->date, ctx->canon_request_hash);
+    bench_sink = (uintptr_t) ngx_aws_auth__sign_sha256_hex(ctx->pool, string_to_sign, &signing_key);
+}
+
+static void bench_token(bench_ctx_t *ctx) {
+    bench_sink = (uintptr_t) ngx_aws_auth__make_auth_token(ctx->pool, ctx->signature,
+                                                           ctx->canon_request.signed_header_names,
+                                                           &access_key, &key_scope);
+}
+
+static void bench_sign(bench_ctx_t *ctx) {
+    bench_sink = (uintptr_t) ngx_aws_auth__sign(ctx->pool, &ctx->request, &access_key, &signing_key, &key_scope,
+                                                &bucket, NULL, &endpoint, NULL);
+}
+
+static void bench_sign_template(bench_ctx_t *ctx) {
+    bench_sink = (uintptr_t) ngx_aws_auth__sign_with_template(ctx->pool, &ctx->request, &ctx->tpl, ctx->hmac_key,
+                                                              &key_scope, NULL, NULL);
+}
+
+static const bench_stage_t stages[] = {
+    {"canonicalize", bench_canonicalize},
+    {"hash", bench_hash},
+    {"hmac", bench_hmac},
+    {"token", bench_token},
+    {"sign", bench_sign},
+    {"sign_template", bench_sign_template},
+};
+
+
+static ngx_int_t bench_setup(bench_ctx_t *ctx, ngx_pool_t *pool, const bench_workload_t *workload) {
+    static const char *const utf8_words[] = {"\xc3\xa9t\xc3\xa9", "\xe5\x86\x99\xe7\x9c\x9f",
+                                             "\xd1\x84\xd0\xbe\xd1\x82\xd0\xbe", "caf\xc3\xa9"};
+    static const ngx_str_t method = ngx_string("GET");
+    ngx_aws_auth__hmac_key_t *hmac_key;
+    u_char *uri, *args, *p;
+    ngx_uint_t i;
+
+    uri = ngx_pnalloc(pool, BENCH_URI_MAX + BENCH_ARGS_MAX);
+    if (uri == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = uri;
+    for (i = 0; i < workload->uri_segments; i++) {
+        if (workload->utf8) {
+            p = ngx_sprintf(p, "/%s %ui", utf8_words[i % 4], i);
+        } else {
+            p = ngx_sprintf(p, "/segment-%03ui", i);
+        }
+    }
+    p = ngx_cpymem(p, ".jpg", 4);
+
+    ngx_memzero(&ctx->request, sizeof(ngx_http_request_t));
+    ctx->request.uri.data = uri;
+    ctx->request.uri.len = p - uri;
+    ctx->request.uri_start = uri;
+    ctx->request.method_name = method;
+    ctx->request.start_sec = 1440938160; /* 20150830T123600Z */
+
+    /* the query string follows the URI as it does in the request line */
+    *p++ = '?';
+    args = p;
+    for (i = 0; i < workload->n_args; i++) {
+        if (i) {
+            *p++ = '&';
+        }
+
+        /* arguments in reverse order, so sorting has work to do */
+        if (workload->utf8) {
+            p = ngx_sprintf(p, "%s-%ui=v %ui", utf8_words[i % 4], workload->n_args - i, i);
+        } else {
+            p = ngx_sprintf(p, "arg-%02ui=value-%ui", workload->n_args - i, i);
+        }
+    }
+    ctx->request.args_start = args;
+    ctx->request.args.data = args;
+    ctx->request.args.len = workload->n_args ? (size_t) (p - args) : 0;
+
+    if (ngx_aws_auth__compile_template(pool, &ctx->tpl, &access_key, &bucket, &endpoint) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hmac_key = ngx_palloc(pool, ngx_aws_auth__hmac_key_size());
+    if (hmac_key == NULL || ngx_aws_auth__hmac_key_set(pool, hmac_key, &signing_key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+    ctx->hmac_key = hmac_key;
+
+    ctx->date = ngx_aws_auth__compute_request_time(pool, &ctx->request.start_sec);
+    ctx->canon_request = ngx_aws_auth__make_canonical_request(pool, &ctx->request, &bucket, ctx->date, NULL,
+                                                              &endpoint, NULL);
+    ctx->canon_request_hash = ngx_aws_auth__hash_sha256(pool, ctx->canon_request.canon_request);
+    ctx->signature = ngx_aws_auth__sign_sha256_hex(pool,
+                                                   ngx_aws_auth__string_to_sign(pool, &key_scope, ctx->date,
+                                                                                ctx->canon_request_hash),
+                                                   &signing_key);
+
+    return ctx->signature != NULL ? NGX_OK : NGX_ERROR;
+}
+
+/* ngx_reset_pool keeps the cleanups, whose records the next operation
+ * would overwrite; the crypto backends register some for their contexts */
+static void bench_reset_pool(ngx_pool_t *pool) {
+    ngx_pool_cleanup_t *c;
+
+    for (c = pool->cleanup; c; c = c->next) {
+        if (c->handler) {
+            c->handler(c->data);
+        }
+    }
+    pool->cleanup = NULL;
+
+    ngx_reset_pool(pool);
+}
+
+/* the bytes taken from the blocks of a fresh pool and the allocations made
+ * outside of them */
+static void bench_pool_usage(ngx_pool_t *pool, size_t *bytes, ngx_uint_t *large) {
+    ngx_pool_t *p;
+    ngx_pool_large_t *l;
+
+    *bytes = (size_t) (pool->d.last - (u_char *) pool) - sizeof(ngx_pool_t);
+    for (p = pool->d.next; p; p = p->d.next) {
+        *bytes += (size_t) (p->d.last - (u_char *) p) - sizeof(ngx_pool_data_t);
+    }
+
+    *large = 0;
+    for (l = pool->large; l; l = l->next) {
+        if (l->alloc) {
+            (*large)++;
+        }
+    }
+}
+
+static double bench_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    ngx_uint_t w, s, i, iterations, large;
+    ngx_pool_t *setup_pool, *pool;
+    bench_ctx_t ctx;
+    double start, elapsed;
+    size_t bytes;
+
+    iterations = (argc > 1) ? (ngx_uint_t) strtoul(argv[1], NULL, 10) : BENCH_ITERATIONS_DEFAULT;
+    if (iterations == 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    ngx_pagesize = getpagesize();
+
+    if (ngx_aws_auth__crypto_init() != NGX_OK) {
+        fprintf(stderr, "crypto initialization failed\n");
+        return 1;
+    }
+
+    for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        setup_pool = ngx_create_pool(BENCH_POOL_SIZE, NULL);
+        ctx.pool = ngx_create_pool(BENCH_POOL_SIZE, NULL);
+        if (setup_pool == NULL || ctx.pool == NULL || bench_setup(&ctx, setup_pool, &workloads[w]) != NGX_OK) {
+            fprintf(stderr, "setting up workload %s failed\n", workloads[w].name);
+            return 1;
+        }
+
+        for (s = 0; s < sizeof(stages) / sizeof(stages[0]); s++) {
+            pool = ctx.pool;
+            ctx.pool = ngx_create_pool(BENCH_POOL_SIZE, NULL);
+            if (ctx.pool == NULL) {
+                return 1;
+            }
+            stages[s].run(&ctx);
+            bench_pool_usage(ctx.pool, &bytes, &large);
+            ngx_destroy_pool(ctx.pool);
+            ctx.pool = pool;
+
+            start = bench_now_ns();
+            for (i = 0; i < iterations; i++) {
+                bench_reset_pool(ctx.pool);
+                stages[s].run(&ctx);
+            }
+            elapsed = bench_now_ns() - start;
+
+            printf("{\"workload\":\"%s\",\"stage\":\"%s\",\"iterations\":%lu,\"ns_per_op\":%.1f,"
+                   "\"pool_bytes\":%lu,\"large_allocs\":%lu}\n",
+                   workloads[w].name, stages[s].name, (unsigned long) iterations, elapsed / iterations,
+                   (unsigned long) bytes, (unsigned long) large);
+        }
+
+        ngx_destroy_pool(ctx.pool);
+        ngx_destroy_pool(setup_pool);
+    }
+
+    return 0;
+}
@@ -6,8 +6,70 @@
 #include <ngx_palloc.h>
 
 
+/* per worker set up (algorithm lookups, reusable contexts), called from
+ * init_process; the helpers also set themselves up on first use */
+ngx_int_t ngx_aws_auth__crypto_init(void);
+
 ngx_str_t* ngx_aws_auth__hash_sha256(ngx_pool_t *pool, const ngx_str_t *blob);
 ngx_str_t* ngx_aws_auth__sign_sha256_hex(ngx_pool_t *pool, const ngx_str_t *blob, const ngx_str_t *signing_key);
 uint8_t* ngx_aws_auth__sign_hmac(ngx_pool_t *pool, uint8_t *key, int key_length,  uint8_t *val);
 
+/* incremental digests, used to hash a request body as nginx reads it.
+ * The contexts are allocated from the pool but update/final never allocate,
+ * so a context may be fed from a thread other than the one that created it */
+#define NGX_AWS_AUTH__SHA256_HEX_LENGTH 64
+#define NGX_AWS_AUTH__MD5_LENGTH 16
+
+typedef struct ngx_aws_auth__sha256_ctx_s ngx_aws_auth__sha256_ctx_t;
+typedef struct ngx_aws_auth__md5_ctx_s ngx_aws_auth__md5_ctx_t;
+
+ngx_aws_auth__sha256_ctx_t* ngx_aws_auth__sha256_init(ngx_pool_t *pool);
+/* for callers placing a context in memory of their own: ctx_size bytes,
+ * aligned as ngx_palloc aligns; reset (re)starts a digest without allocating.
+ * Such a context may be backed by per worker state: it has to be used on
+ * the worker's own thread and finished before another one is reset */
+size_t ngx_aws_auth__sha256_ctx_size(void);
+void ngx_aws_auth__sha256_reset(ngx_aws_auth__sha256_ctx_t *ctx);
+void ngx_aws_auth__sha256_update(ngx_aws_auth__sha256_ctx_t *ctx, const u_char *data, size_t len);
+void ngx_aws_auth__sha256_final_hex(ngx_aws_auth__sha256_ctx_t *ctx, u_char *hex);
+
+/* one-shot variants writing lowercase hex into a caller supplied buffer
+ * of NGX_AWS_AUTH__SHA256_HEX_LENGTH bytes; they never allocate */
+void ngx_aws_auth__sha256_hex(const u_char *data, size_t len, u_char *hex);
+void ngx_aws_auth__hmac_sha256_hex(const ngx_str_t *key, const u_char *data, size_t len, u_char *hex);
+
+/* an HMAC-SHA256 key whose inner and outer pad blocks are already hashed,
+ * which saves two compressions on every MAC made with it. hmac_key_size
+ * bytes, aligned as ngx_palloc aligns. Whatever the key holds on to is
+ * released with the pool passed to set/copy; a key may be shared but a
+ * copy outliving that pool has to be made with hmac_key_copy */
+typedef struct ngx_aws_auth__hmac_key_s ngx_aws_auth__hmac_key_t;
+
+size_t ngx_aws_auth__hmac_key_size(void);
+ngx_int_t ngx_aws_auth__hmac_key_set(ngx_pool_t *pool, ngx_aws_auth__hmac_key_t *hmac_key, const ngx_str_t *key);
+ngx_int_t ngx_aws_auth__hmac_key_copy(ngx_pool_t *pool, ngx_aws_auth__hmac_key_t *dst,
+                                      const ngx_aws_auth__hmac_key_t *src);
+void ngx_aws_auth__hmac_key_sha256_hex(const ngx_aws_auth__hmac_key_t *hmac_key,
+                                       const u_char *data, size_t len, u_char *hex);
+
+/* n independent MACs, each with a key of its own; the same results as
+ * hmac_key_sha256_hex on every job, which is what backends without a
+ * multi-buffer kernel do */
+typedef struct {
+    const ngx_aws_auth__hmac_key_t *hmac_key;
+    const u_char *data;
+    size_t len;
+    u_char *hex;
+} ngx_aws_auth__hmac_job_t;
+
+void ngx_aws_auth__hmac_key_sha256_hex_batch(const ngx_aws_auth__hmac_job_t *jobs, ngx_uint_t n);
+
+ngx_aws_auth__md5_ctx_t* ngx_aws_auth__md5_init(ngx_pool_t *pool);
+void ngx_aws_auth__md5_update(ngx_aws_auth__md5_ctx_t *ctx, const u_char *data, size_t len);
+void ngx_aws_auth__md5_final(ngx_aws_auth__md5_ctx_t *ctx, u_char *digest);
+
+/* CRC32C of data, continuing from crc (0 to start); implemented once for
+ * all backends in crypto_helper_crc32c.c */
+uint32_t ngx_aws_auth__crc32c(uint32_t crc, const u_char *data, size_t len);
+
 #endif
@@ -0,0 +1,712 @@
+/* native implementation of crypto functions
+ *
+ * Built instead of crypto_helper_openssl.c when the module is configured
+ * with NGX_AWS_AUTH_CRYPTO=native, see the config script. SHA-256 and
+ * HMAC-SHA256 are implemented here: everything the signer hashes is short
+ * (canonical request, string to sign, HMAC blocks) so per call overhead
+ * matters more than bulk throughput. The compression function and the hex
+ * encoder are picked once per worker from what the cpu supports:
+ *
+ *   SHA-256:  SHA-NI, else portable C
+ *   hex:      AVX2 or SSSE3, else ngx_hex_dump
+ *   batches:  eight lanes of AVX2 or SSE2, see hmac_key_sha256_hex_batch
+ *
+ * MD5 is only used for the optional Content-MD5 and comes from OpenSSL.
+ */
+
+#include "crypto_helper.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#if (defined __x86_64__ && defined __GNUC__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define NGX_AWS_AUTH_X86_SIMD 1
+#endif
+
+
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_LANES 8  /* MACs per multi-buffer batch */
+
+typedef void (*sha256_blocks_pt)(uint32_t *state, const u_char *data, size_t blocks);
+typedef u_char *(*hex_encode_pt)(u_char *dst, const u_char *src, size_t len);
+typedef void (*hmac_batch_pt)(const ngx_aws_auth__hmac_job_t *jobs, ngx_uint_t n);
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;                /* bytes hashed so far */
+    u_char block[SHA256_BLOCK_SIZE];
+    size_t used;                    /* bytes waiting in block */
+} sha256_t;
+
+struct ngx_aws_auth__sha256_ctx_s {
+    sha256_t sha256;
+};
+
+struct ngx_aws_auth__hmac_key_s {
+    uint32_t inner[8]; /* state after the key ^ ipad block */
+    uint32_t outer[8]; /* state after the key ^ opad block */
+};
+
+struct ngx_aws_auth__md5_ctx_s {
+    EVP_MD_CTX *md_ctx;
+};
+
+
+static const uint32_t sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_blocks_c(uint32_t *state, const u_char *data, size_t blocks) {
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    size_t i;
+
+    while (blocks--) {
+        for (i = 0; i < 16; i++, data += 4) {
+            w[i] = (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 | (uint32_t) data[2] << 8 | data[3];
+        }
+
+        for ( /* void */ ; i < 64; i++) {
+            w[i] = w[i - 16] + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3))
+                   + w[i - 7] + (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+        }
+
+        a = state[0]; b = state[1]; c = state[2]; d = state[3];
+        e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+        for (i = 0; i < 64; i++) {
+            t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+static u_char *
+hex_encode_c(u_char *dst, const u_char *src, size_t len) {
+    return ngx_hex_dump(dst, (u_char *) src, len);
+}
+
+
+#if (NGX_AWS_AUTH_X86_SIMD)
+
+/* four rounds at a time, the message schedule kept in a ring of four */
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_blocks_shani(uint32_t *state, const u_char *data, size_t blocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, abef, cdgh, msg, tmp, m[4];
+    size_t i;
+
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xb1);    /* CDAB */
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1b); /* EFGH */
+    state0 = _mm_alignr_epi8(tmp, state1, 8);                                       /* ABEF */
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);                                    /* CDGH */
+
+    while (blocks--) {
+        abef = state0;
+        cdgh = state1;
+
+        for (i = 0; i < 16; i++) {
+            if (i < 4) {
+                m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16 * i)), bswap);
+
+            } else {
+                m[i & 3] = _mm_sha256msg2_epu32(
+                        _mm_add_epi32(_mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]),
+                                      _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4)),
+                        m[(i + 3) & 3]);
+            }
+
+            msg = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i *) &sha256_k[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        data += SHA256_BLOCK_SIZE;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);       /* FEBA */
+    state1 = _mm_shuffle_epi32(state1, 0xb1);    /* DCHG */
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0); /* DCBA */
+    state1 = _mm_alignr_epi8(state1, tmp, 8);    /* HGFE */
+
+    _mm_storeu_si128((__m128i *) &state[0], state0);
+    _mm_storeu_si128((__m128i *) &state[4], state1);
+}
+
+/* each byte becomes its two nibbles looked up in "0123456789abcdef" */
+__attribute__((target("ssse3")))
+static u_char *
+hex_encode_ssse3(u_char *dst, const u_char *src, size_t len) {
+    const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                         '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m128i low4 = _mm_set1_epi8(0x0f);
+    __m128i in, hi, lo;
+
+    for ( /* void */ ; len >= 16; len -= 16, src += 16, dst += 32) {
+        in = _mm_loadu_si128((const __m128i *) src);
+        hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(in, 4), low4));
+        lo = _mm_shuffle_epi8(digits, _mm_and_si128(in, low4));
+        _mm_storeu_si128((__m128i *) dst, _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *) (dst + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+
+    return ngx_hex_dump(dst, (u_char *) src, len);
+}
+
+/* a whole digest per iteration; unpack works within 128 bit lanes, so the
+ * halves are put back in order with permute2x128 */
+__attribute__((target("avx2")))
+static u_char *
+hex_encode_avx2(u_char *dst, const u_char *src, size_t len) {
+    const __m256i digits = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                            '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+                                            '0', '1', '2', '3', '4', '5', '6', '7',
+                                            '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m256i low4 = _mm256_set1_epi8(0x0f);
+    __m256i in, hi, lo, first, second;
+
+    for ( /* void */ ; len >= 32; len -= 32, src += 32, dst += 64) {
+        in = _mm256_loadu_si256((const __m256i *) src);
+        hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(in, 4), low4));
+        lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(in, low4));
+        first = _mm256_unpacklo_epi8(hi, lo);
+        second = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i *) dst, _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256((__m256i *) (dst + 32), _mm256_permute2x128_si256(first, second, 0x31));
+    }
+
+    return hex_encode_ssse3(dst, src, len);
+}
+
+static ngx_uint_t
+cpu_has_sha_ni(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__builtin_cpu_supports("sse4.1")
+        || !__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+
+    return (ebx >> 29) & 1;
+}
+
+#endif
+
+
+static sha256_blocks_pt sha256_blocks = NULL;
+static hex_encode_pt hex_encode = NULL;
+static hmac_batch_pt hmac_batch = NULL; /* one MAC after the other when NULL */
+
+
+#if (NGX_AWS_AUTH_X86_SIMD)
+
+/* Multi-buffer HMAC: up to eight MACs advance through their blocks in
+ * lock step, one message per 32 bit lane. Written with vector extensions
+ * and compiled twice, for AVX2 and for plain SSE2 where every operation
+ * is done on two halves of four lanes */
+
+typedef uint32_t sha256_x8_t __attribute__((vector_size(32)));
+
+typedef struct {
+    const u_char *data;  /* the whole blocks of the message */
+    size_t blocks;       /* of data */
+    size_t total;        /* blocks, the one or two of tail included */
+    u_char tail[2 * SHA256_BLOCK_SIZE];
+} sha256_lane_t;
+
+static const u_char sha256_zero_block[SHA256_BLOCK_SIZE];
+
+#define SIGMA0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define SIGMA1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define GAMMA0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define GAMMA1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+/* lanes with active all zeros keep their state */
+static inline __attribute__((always_inline)) void
+sha256_x8_compress(sha256_x8_t *state, sha256_x8_t *w, const sha256_x8_t *active) {
+    sha256_x8_t a, b, c, d, e, f, g, h, t1, t2;
+    ngx_uint_t i;
+
+    for (i = 16; i < 64; i++) {
+        w[i] = w[i - 16] + GAMMA0(w[i - 15]) + w[i - 7] + GAMMA1(w[i - 2]);
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+    for (i = 0; i < 64; i++) {
+        t1 = h + SIGMA1(e) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        t2 = SIGMA0(a) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a & *active; state[1] += b & *active;
+    state[2] += c & *active; state[3] += d & *active;
+    state[4] += e & *active; state[5] += f & *active;
+    state[6] += g & *active; state[7] += h & *active;
+}
+
+static inline __attribute__((always_inline)) void
+hmac_batch_x8(const ngx_aws_auth__hmac_job_t *jobs, ngx_uint_t n) {
+    sha256_lane_t lanes[SHA256_LANES];
+    sha256_x8_t state[8], w[64], active;
+    uint32_t words[16][SHA256_LANES], mask[SHA256_LANES];
+    u_char digest[SHA256_DIGEST_SIZE];
+    const u_char *block;
+    u_char *end;
+    size_t rem, blocks, b;
+    uint64_t bits;
+    ngx_uint_t i, k, t;
+
+    ngx_memzero(state, sizeof(state));
+    blocks = 0;
+
+    for (i = 0; i < n; i++) {
+        lanes[i].data = jobs[i].data;
+        lanes[i].blocks = jobs[i].len / SHA256_BLOCK_SIZE;
+        rem = jobs[i].len % SHA256_BLOCK_SIZE;
+        lanes[i].total = lanes[i].blocks + (rem + 9 > SHA256_BLOCK_SIZE ? 2 : 1);
+        blocks = ngx_max(blocks, lanes[i].total);
+
+        /* the padded tail, the key block counts towards the length */
+        end = lanes[i].tail + (lanes[i].total - lanes[i].blocks) * SHA256_BLOCK_SIZE;
+        ngx_memzero(lanes[i].tail, sizeof(lanes[i].tail));
+        ngx_memcpy(lanes[i].tail, jobs[i].data + lanes[i].blocks * SHA256_BLOCK_SIZE, rem);
+        lanes[i].tail[rem] = 0x80;
+        bits = (SHA256_BLOCK_SIZE + (uint64_t) jobs[i].len) * 8;
+        for (k = 0; k < 8; k++) {
+            *--end = (u_char) (bits >> (8 * k));
+        }
+
+        for (k = 0; k < 8; k++) {
+            state[k][i] = jobs[i].hmac_key->inner[k];
+        }
+    }
+
+    /* inner hash, lanes drop out as their messages end */
+    for (b = 0; b < blocks; b++) {
+        for (i = 0; i < SHA256_LANES; i++) {
+            if (i >= n || b >= lanes[i].total) {
+                block = sha256_zero_block;
+                mask[i] = 0;
+
+            } else {
+                block = b < lanes[i].blocks ? lanes[i].data + b * SHA256_BLOCK_SIZE
+                                            : lanes[i].tail + (b - lanes[i].blocks) * SHA256_BLOCK_SIZE;
+                mask[i] = 0xffffffff;
+            }
+
+            for (t = 0; t < 16; t++, block += 4) {
+                words[t][i] = (uint32_t) block[0] << 24 | (uint32_t) block[1] << 16
+                              | (uint32_t) block[2] << 8 | block[3];
+            }
+        }
+
+        ngx_memcpy(w, words, sizeof(words));
+        ngx_memcpy(&active, mask, sizeof(mask));
+        sha256_x8_compress(state, w, &active);
+    }
+
+    /* outer hash, the inner digest padded to a single block */
+    for (k = 0; k < 8; k++) {
+        w[k] = state[k];
+    }
+    ngx_memzero(&w[8], 8 * sizeof(sha256_x8_t));
+    w[8] += 0x80000000;
+    w[15] += (SHA256_BLOCK_SIZE + SHA256_DIGEST_SIZE) * 8;
+
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < 8; k++) {
+            state[k][i] = jobs[i].hmac_key->outer[k];
+        }
+    }
+
+    ngx_memset(&active, 0xff, sizeof(active));
+    sha256_x8_compress(state, w, &active);
+
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < 8; k++) {
+            digest[4 * k] = (u_char) (state[k][i] >> 24);
+            digest[4 * k + 1] = (u_char) (state[k][i] >> 16);
+            digest[4 * k + 2] = (u_char) (state[k][i] >> 8);
+            digest[4 * k + 3] = (u_char) state[k][i];
+        }
+        hex_encode(jobs[i].hex, digest, sizeof(digest));
+    }
+}
+
+__attribute__((target("avx2")))
+static void
+hmac_batch_avx2(const ngx_aws_auth__hmac_job_t *jobs, ngx_uint_t n) {
+    hmac_batch_x8(jobs, n);
+}
+
+static void
+hmac_batch_sse2(const ngx_aws_auth__hmac_job_t *jobs, ngx_uint_t n) {
+    hmac_batch_x8(jobs, n);
+}
+
+#endif
+
+ngx_int_t ngx_aws_auth__crypto_init(void) {
+    /* racing threads all store the same values */
+    sha256_blocks = sha256_blocks_c;
+    hex_encode = hex_encode_c;
+
+#if (NGX_AWS_AUTH_X86_SIMD)
+    __builtin_cpu_init();
+
+    if (cpu_has_sha_ni()) {
+        sha256_blocks = sha256_blocks_shani;
+    }
+
+    /* eight AVX2 lanes still outrun SHA-NI one message at a time, four
+       SSE2 ones only the portable code */
+    if (__builtin_cpu_supports("avx2")) {
+        hmac_batch = hmac_batch_avx2;
+
+    } else if (sha256_blocks == sha256_blocks_c) {
+        hmac_batch = hmac_batch_sse2;
+    }
+
+    if (__builtin_cpu_supports("avx2")) {
+        hex_encode = hex_encode_avx2;
+
+    } else if (__builtin_cpu_supports("ssse3")) {
+        hex_encode = hex_encode_ssse3;
+    }
+#endif
+
+    return NGX_OK;
+}
+
+#define crypto_ready() (sha256_blocks != NULL || ngx_aws_auth__crypto_init() == NGX_OK)
+
+
+static void
+sha256_start(sha256_t *sha256, const uint32_t *state, uint64_t length) {
+    ngx_memcpy(sha256->state, state, sizeof(sha256->state));
+    sha256->length = length;
+    sha256->used = 0;
+}
+
+static void
+sha256_update(sha256_t *sha256, const u_char *data, size_t len) {
+    size_t n;
+
+    sha256->length += len;
+
+    if (sha256->used) {
+        n = ngx_min(len, SHA256_BLOCK_SIZE - sha256->used);
+        ngx_memcpy(sha256->block + sha256->used, data, n);
+        sha256->used += n;
+        data += n;
+        len -= n;
+
+        if (sha256->used < SHA256_BLOCK_SIZE) {
+            return;
+        }
+
+        sha256_blocks(sha256->state, sha256->block, 1);
+        sha256->used = 0;
+    }
+
+    if (len >= SHA256_BLOCK_SIZE) {
+        sha256_blocks(sha256->state, data, len / SHA256_BLOCK_SIZE);
+        data += len & ~(size_t) (SHA256_BLOCK_SIZE - 1);
+        len &= SHA256_BLOCK_SIZE - 1;
+    }
+
+    ngx_memcpy(sha256->block, data, len);
+    sha256->used = len;
+}
+
+static void
+sha256_final(sha256_t *sha256, u_char *digest) {
+    uint64_t bits = sha256->length * 8;
+    size_t i;
+
+    sha256->block[sha256->used++] = 0x80;
+
+    if (sha256->used > SHA256_BLOCK_SIZE - 8) {
+        ngx_memzero(sha256->block + sha256->used, SHA256_BLOCK_SIZE - sha256->used);
+        sha256_blocks(sha256->state, sha256->block, 1);
+        sha256->used = 0;
+    }
+
+    ngx_memzero(sha256->block + sha256->used, SHA256_BLOCK_SIZE - 8 - sha256->used);
+    for (i = 0; i < 8; i++) {
+        sha256->block[SHA256_BLOCK_SIZE - 1 - i] = (u_char) (bits >> (8 * i));
+    }
+    sha256_blocks(sha256->state, sha256->block, 1);
+
+    for (i = 0; i < 8; i++) {
+        digest[4 * i] = (u_char) (sha256->state[i] >> 24);
+        digest[4 * i + 1] = (u_char) (sha256->state[i] >> 16);
+        digest[4 * i + 2] = (u_char) (sha256->state[i] >> 8);
+        digest[4 * i + 3] = (u_char) sha256->state[i];
+    }
+}
+
+static void
+sha256_digest(const u_char *data, size_t len, u_char *digest) {
+    sha256_t sha256;
+
+    sha256_start(&sha256, sha256_iv, 0);
+    sha256_update(&sha256, data, len);
+    sha256_final(&sha256, digest);
+}
+
+static void
+hmac_key_pads(ngx_aws_auth__hmac_key_t *hmac_key, const u_char *key, size_t key_len) {
+    u_char block[SHA256_BLOCK_SIZE], pad[SHA256_BLOCK_SIZE];
+    size_t i;
+
+    ngx_memzero(block, sizeof(block));
+    if (key_len > SHA256_BLOCK_SIZE) {
+        sha256_digest(key, key_len, block);
+    } else {
+        ngx_memcpy(block, key, key_len);
+    }
+
+    for (i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        pad[i] = block[i] ^ 0x36;
+    }
+    ngx_memcpy(hmac_key->inner, sha256_iv, sizeof(sha256_iv));
+    sha256_blocks(hmac_key->inner, pad, 1);
+
+    for (i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    ngx_memcpy(hmac_key->outer, sha256_iv, sizeof(sha256_iv));
+    sha256_blocks(hmac_key->outer, pad, 1);
+
+    OPENSSL_cleanse(block, sizeof(block));
+    OPENSSL_cleanse(pad, sizeof(pad));
+}
+
+static void
+hmac_digest(const ngx_aws_auth__hmac_key_t *hmac_key, const u_char *data, size_t len, u_char *digest) {
+    sha256_t sha256;
+
+    sha256_start(&sha256, hmac_key->inner, SHA256_BLOCK_SIZE);
+    sha256_update(&sha256, data, len);
+    sha256_final(&sha256, digest);
+
+    sha256_start(&sha256, hmac_key->outer, SHA256_BLOCK_SIZE);
+    sha256_update(&sha256, digest, SHA256_DIGEST_SIZE);
+    sha256_final(&sha256, digest);
+}
+
+
+ngx_str_t* ngx_aws_auth__sign_sha256_hex(ngx_pool_t *pool, const ngx_str_t *blob,
+    const ngx_str_t *signing_key) {
+    ngx_str_t *const retval = ngx_palloc(pool, sizeof(ngx_str_t) + NGX_AWS_AUTH__SHA256_HEX_LENGTH + 1);
+
+    if (retval == NULL) {
+        return NULL;
+    }
+
+    retval->data = (u_char *) (retval + 1);
+    retval->len = NGX_AWS_AUTH__SHA256_HEX_LENGTH;
+    ngx_aws_auth__hmac_sha256_hex(signing_key, blob->data, blob->len, retval->data);
+    retval->data[retval->len] = '\0';
+    return retval;
+}
+
+ngx_str_t* ngx_aws_auth__hash_sha256(ngx_pool_t *pool, const ngx_str_t *blob) {
+    ngx_str_t *const retval = ngx_palloc(pool, sizeof(ngx_str_t) + NGX_AWS_AUTH__SHA256_HEX_LENGTH + 1);
+
+    if (retval == NULL) {
+        return NULL;
+    }
+
+    retval->data = (u_char *) (retval + 1);
+    retval->len = NGX_AWS_AUTH__SHA256_HEX_LENGTH;
+    ngx_aws_auth__sha256_hex(blob->data, blob->len, retval->data);
+    retval->data[retval->len] = '\0';
+    return retval;
+}
+
+uint8_t *ngx_aws_auth__sign_hmac(ngx_pool_t *pool, uint8_t *key, int key_length, uint8_t *val) {
+    ngx_aws_auth__hmac_key_t hmac_key;
+    uint8_t *hash = ngx_pcalloc(pool, EVP_MAX_MD_SIZE * sizeof(uint8_t));
+
+    if (hash == NULL || !crypto_ready()) {
+        return NULL;
+    }
+
+    hmac_key_pads(&hmac_key, key, key_length);
+    hmac_digest(&hmac_key, val, ngx_strlen((char *) val), hash);
+    OPENSSL_cleanse(&hmac_key, sizeof(hmac_key));
+
+    return hash;
+}
+
+ngx_aws_auth__sha256_ctx_t* ngx_aws_auth__sha256_init(ngx_pool_t *pool) {
+    ngx_aws_auth__sha256_ctx_t *ctx = ngx_palloc(pool, sizeof(ngx_aws_auth__sha256_ctx_t));
+
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    ngx_aws_auth__sha256_reset(ctx);
+    return ctx;
+}
+
+size_t ngx_aws_auth__sha256_ctx_size(void) {
+    return sizeof(ngx_aws_auth__sha256_ctx_t);
+}
+
+void ngx_aws_auth__sha256_reset(ngx_aws_auth__sha256_ctx_t *ctx) {
+    if (!crypto_ready()) {
+        return;
+    }
+
+    sha256_start(&ctx->sha256, sha256_iv, 0);
+}
+
+void ngx_aws_auth__sha256_update(ngx_aws_auth__sha256_ctx_t *ctx, const u_char *data, size_t len) {
+    sha256_update(&ctx->sha256, data, len);
+}
+
+void ngx_aws_auth__sha256_final_hex(ngx_aws_auth__sha256_ctx_t *ctx, u_char *hex) {
+    u_char digest[SHA256_DIGEST_SIZE];
+
+    sha256_final(&ctx->sha256, digest);
+    hex_encode(hex, digest, sizeof(digest));
+}
+
+void ngx_aws_auth__sha256_hex(const u_char *data, size_t len, u_char *hex) {
+    u_char digest[SHA256_DIGEST_SIZE];
+
+    if (!crypto_ready()) {
+        return;
+    }
+
+    sha256_digest(data, len, digest);
+    hex_encode(hex, digest, sizeof(digest));
+}
+
+void ngx_aws_auth__hmac_sha256_hex(const ngx_str_t *key, const u_char *data, size_t len, u_char *hex) {
+    ngx_aws_auth__hmac_key_t hmac_key;
+    u_char digest[SHA256_DIGEST_SIZE];
+
+    if (!crypto_ready()) {
+        return;
+    }
+
+    hmac_key_pads(&hmac_key, key->data, key->len);
+    hmac_digest(&hmac_key, data, len, digest);
+    hex_encode(hex, digest, sizeof(digest));
+}
+
+size_t ngx_aws_auth__hmac_key_size(void) {
+    return sizeof(ngx_aws_auth__hmac_key_t);
+}
+
+ngx_int_t ngx_aws_auth__hmac_key_set(ngx_pool_t *pool, ngx_aws_auth__hmac_key_t *hmac_key, const ngx_str_t *key) {
+    if (!crypto_ready()) {
+        return NGX_ERROR;
+    }
+
+    hmac_key_pads(hmac_key, key->data, key->len);
+    return NGX_OK;
+}
+
+ngx_int_t ngx_aws_auth__hmac_key_copy(ngx_pool_t *pool, ngx_aws_auth__hmac_key_t *dst,
+                                      const ngx_aws_auth__hmac_key_t *src) {
+    *dst = *src;
+    return NGX_OK;
+}
+
+void ngx_aws_auth__hmac_key_sha256_hex(const ngx_aws_auth__hmac_key_t *hmac_key,
+                                       const u_char *data, size_t len, u_char *hex) {
+    u_char digest[SHA256_DIGEST_SIZE];
+
+    hmac_digest(hmac_key, data, len, digest);
+    hex_encode(hex, digest, sizeof(digest));
+}
+
+void ngx_aws_auth__hmac_key_sha256_hex_batch(const ngx_aws_auth__hmac_job_t *jobs, ngx_uint_t n) {
+    ngx_uint_t i, lanes;
+
+    for ( /* void */ ; n > 1 && hmac_batch != NULL; jobs += lanes, n -= lanes) {
+        lanes = ngx_min(n, SHA256_LANES);
+        hmac_batch(jobs, lanes);
+    }
+
+    for (i = 0; i < n; i++) {
+        ngx_aws_auth__hmac_key_sha256_hex(jobs[i].hmac_key, jobs[i].data, jobs[i].len, jobs[i].hex);
+    }
+}
+
+
+static void ngx_aws_auth__md_ctx_cleanup(void *data) {
+    EVP_MD_CTX_free(data);
+}
+
+ngx_aws_auth__md5_ctx_t* ngx_aws_auth__md5_init(ngx_pool_t *pool) {
+    ngx_pool_cleanup_t *cln;
+    ngx_aws_auth__md5_ctx_t *ctx = ngx_palloc(pool, sizeof(ngx_aws_auth__md5_ctx_t));
+
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    ctx->md_ctx = EVP_MD_CTX_new();
+    if (ctx->md_ctx == NULL) {
+        return NULL;
+    }
+
+    cln->handler = ngx_aws_auth__md_ctx_cleanup;
+    cln->data = ctx->md_ctx;
+
+    if (!EVP_DigestInit_ex(ctx->md_ctx, EVP_md5(), NULL)) {
+        return NULL;
+    }
+
+    return ctx;
+}
+
+void ngx_aws_auth__md5_update(ngx_aws_auth__md5_ctx_t *ctx, const u_char *data, size_t len) {
+    EVP_DigestUpdate(ctx->md_ctx, data, len);
+}
+
+void ngx_aws_auth__md5_final(ngx_aws_auth__md5_ctx_t *ctx, u_char *digest) {
+    unsigned int len;
+
+    EVP_DigestFinal_ex(ctx->md_ctx, digest, &len);
+}
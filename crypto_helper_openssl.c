@@ -11,12 +11,92 @@
 
 #include <openssl/bio.h>
 #include <openssl/buffer.h>
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
 #include <openssl/sha.h>
 
 
 static const EVP_MD* evp_md = NULL;
+/* key derivation, digests placed by sha256_reset and MACs with a prepared
+   key run on the worker's own thread only */
+static HMAC_CTX *derive_hmac = NULL;
+static EVP_MD_CTX *placed_md_ctx = NULL;
+static EVP_MD_CTX *hmac_md_ctx = NULL;
+
+struct ngx_aws_auth__sha256_ctx_s {
+    EVP_MD_CTX *md_ctx;
+};
+
+struct ngx_aws_auth__hmac_key_s {
+    EVP_MD_CTX *inner;  /* key ^ ipad hashed */
+    EVP_MD_CTX *outer;  /* key ^ opad hashed */
+};
+
+struct ngx_aws_auth__md5_ctx_s {
+    EVP_MD_CTX *md_ctx;
+};
+
+ngx_int_t ngx_aws_auth__crypto_init(void) {
+    if (evp_md == NULL) {
+        evp_md = EVP_sha256();
+    }
+
+    if (derive_hmac == NULL) {
+        derive_hmac = HMAC_CTX_new();
+        if (derive_hmac == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (placed_md_ctx == NULL) {
+        placed_md_ctx = EVP_MD_CTX_new();
+        if (placed_md_ctx == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (hmac_md_ctx == NULL) {
+        hmac_md_ctx = EVP_MD_CTX_new();
+        if (hmac_md_ctx == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+#define crypto_ready() (hmac_md_ctx != NULL || ngx_aws_auth__crypto_init() == NGX_OK)
+
+
+static void ngx_aws_auth__md_ctx_cleanup(void *data) {
+    EVP_MD_CTX_free(data);
+}
+
+/* a digest context released with the pool, started with md unless that is NULL */
+static EVP_MD_CTX *ngx_aws_auth__pool_md_ctx(ngx_pool_t *pool, const EVP_MD *md) {
+    ngx_pool_cleanup_t *cln;
+    EVP_MD_CTX *md_ctx;
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    md_ctx = EVP_MD_CTX_new();
+    if (md_ctx == NULL) {
+        return NULL;
+    }
+
+    cln->handler = ngx_aws_auth__md_ctx_cleanup;
+    cln->data = md_ctx;
+
+    if (md != NULL && !EVP_DigestInit_ex(md_ctx, md, NULL)) {
+        return NULL;
+    }
+
+    return md_ctx;
+}
 
 ngx_str_t* ngx_aws_auth__sign_sha256_hex(ngx_pool_t *pool, const ngx_str_t *blob,
     const ngx_str_t *signing_key) {
@@ -40,10 +120,7 @@ ngx_str_t* ngx_aws_auth__hash_sha256(ngx_pool_t *pool, const ngx_str_t *blob) {
     unsigned char hash[SHA256_DIGEST_LENGTH];
 	ngx_str_t *const retval = ngx_palloc(pool, sizeof(ngx_str_t));
 
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, blob->data, blob->len);
-    SHA256_Final(hash, &sha256);
+    SHA256(blob->data, blob->len, hash);
 
     retval->data = ngx_palloc(pool, SHA256_DIGEST_LENGTH * 2 + 1);
     retval->len = SHA256_DIGEST_LENGTH * 2;
@@ -56,12 +133,181 @@ uint8_t *ngx_aws_auth__sign_hmac(ngx_pool_t *pool, uint8_t *key, int key_length,
 
     uint8_t *hash = ngx_pcalloc(pool, EVP_MAX_MD_SIZE * sizeof(uint8_t));
 
-    HMAC_CTX *hmac = HMAC_CTX_new();
-    HMAC_CTX_reset(hmac);
-    HMAC_Init_ex(hmac, key, key_length, EVP_sha256(), NULL);
-    HMAC_Update(hmac, val, ngx_strlen((char *) val));
-    HMAC_Final(hmac, hash, &len);
-    HMAC_CTX_free(hmac);
+    if (hash == NULL) {
+        return NULL;
+    }
+
+    if (derive_hmac == NULL && ngx_aws_auth__crypto_init() != NGX_OK) {
+        return NULL;
+    }
+
+    /* a new key resets the context */
+    HMAC_Init_ex(derive_hmac, key, key_length, evp_md, NULL);
+    HMAC_Update(derive_hmac, val, ngx_strlen((char *) val));
+    HMAC_Final(derive_hmac, hash, &len);
 
     return hash;
 }
+
+ngx_aws_auth__sha256_ctx_t* ngx_aws_auth__sha256_init(ngx_pool_t *pool) {
+    ngx_aws_auth__sha256_ctx_t *ctx = ngx_palloc(pool, sizeof(ngx_aws_auth__sha256_ctx_t));
+
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    /* its own context: a body digest may be fed from a thread */
+    ctx->md_ctx = ngx_aws_auth__pool_md_ctx(pool, EVP_sha256());
+    if (ctx->md_ctx == NULL) {
+        return NULL;
+    }
+
+    return ctx;
+}
+
+size_t ngx_aws_auth__sha256_ctx_size(void) {
+    return sizeof(ngx_aws_auth__sha256_ctx_t);
+}
+
+void ngx_aws_auth__sha256_reset(ngx_aws_auth__sha256_ctx_t *ctx) {
+    if (!crypto_ready()) {
+        return;
+    }
+
+    ctx->md_ctx = placed_md_ctx;
+    EVP_DigestInit_ex(ctx->md_ctx, evp_md, NULL);
+}
+
+void ngx_aws_auth__sha256_update(ngx_aws_auth__sha256_ctx_t *ctx, const u_char *data, size_t len) {
+    EVP_DigestUpdate(ctx->md_ctx, data, len);
+}
+
+void ngx_aws_auth__sha256_final_hex(ngx_aws_auth__sha256_ctx_t *ctx, u_char *hex) {
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int len;
+
+    EVP_DigestFinal_ex(ctx->md_ctx, hash, &len);
+    ngx_hex_dump(hex, hash, len);
+}
+
+void ngx_aws_auth__sha256_hex(const u_char *data, size_t len, u_char *hex) {
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+
+    SHA256(data, len, hash);
+    ngx_hex_dump(hex, hash, sizeof(hash));
+}
+
+void ngx_aws_auth__hmac_sha256_hex(const ngx_str_t *key, const u_char *data, size_t len, u_char *hex) {
+    unsigned int md_len;
+    unsigned char md[EVP_MAX_MD_SIZE];
+
+    if (evp_md == NULL) {
+        evp_md = EVP_sha256();
+    }
+
+    HMAC(evp_md, key->data, key->len, data, len, md, &md_len);
+    ngx_hex_dump(hex, md, md_len);
+}
+
+size_t ngx_aws_auth__hmac_key_size(void) {
+    return sizeof(ngx_aws_auth__hmac_key_t);
+}
+
+ngx_int_t ngx_aws_auth__hmac_key_set(ngx_pool_t *pool, ngx_aws_auth__hmac_key_t *hmac_key, const ngx_str_t *key) {
+    unsigned char block[SHA256_CBLOCK], pad[SHA256_CBLOCK];
+    size_t i;
+
+    if (!crypto_ready()) {
+        return NGX_ERROR;
+    }
+
+    hmac_key->inner = ngx_aws_auth__pool_md_ctx(pool, evp_md);
+    hmac_key->outer = ngx_aws_auth__pool_md_ctx(pool, evp_md);
+    if (hmac_key->inner == NULL || hmac_key->outer == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(block, sizeof(block));
+    if (key->len > SHA256_CBLOCK) {
+        SHA256(key->data, key->len, block);
+    } else {
+        ngx_memcpy(block, key->data, key->len);
+    }
+
+    for (i = 0; i < SHA256_CBLOCK; i++) {
+        pad[i] = block[i] ^ 0x36;
+    }
+    EVP_DigestUpdate(hmac_key->inner, pad, sizeof(pad));
+
+    for (i = 0; i < SHA256_CBLOCK; i++) {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    EVP_DigestUpdate(hmac_key->outer, pad, sizeof(pad));
+
+    OPENSSL_cleanse(block, sizeof(block));
+    OPENSSL_cleanse(pad, sizeof(pad));
+
+    return NGX_OK;
+}
+
+ngx_int_t ngx_aws_auth__hmac_key_copy(ngx_pool_t *pool, ngx_aws_auth__hmac_key_t *dst,
+                                      const ngx_aws_auth__hmac_key_t *src) {
+    dst->inner = ngx_aws_auth__pool_md_ctx(pool, NULL);
+    dst->outer = ngx_aws_auth__pool_md_ctx(pool, NULL);
+    if (dst->inner == NULL || dst->outer == NULL
+        || !EVP_MD_CTX_copy_ex(dst->inner, src->inner) || !EVP_MD_CTX_copy_ex(dst->outer, src->outer)) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+void ngx_aws_auth__hmac_key_sha256_hex(const ngx_aws_auth__hmac_key_t *hmac_key,
+                                       const u_char *data, size_t len, u_char *hex) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+
+    /* the copies reuse the digest state of hmac_md_ctx, nothing is allocated */
+    EVP_MD_CTX_copy_ex(hmac_md_ctx, hmac_key->inner);
+    EVP_DigestUpdate(hmac_md_ctx, data, len);
+    EVP_DigestFinal_ex(hmac_md_ctx, md, &md_len);
+
+    EVP_MD_CTX_copy_ex(hmac_md_ctx, hmac_key->outer);
+    EVP_DigestUpdate(hmac_md_ctx, md, md_len);
+    EVP_DigestFinal_ex(hmac_md_ctx, md, &md_len);
+
+    ngx_hex_dump(hex, md, md_len);
+}
+
+void ngx_aws_auth__hmac_key_sha256_hex_batch(const ngx_aws_auth__hmac_job_t *jobs, ngx_uint_t n) {
+    ngx_uint_t i;
+
+    for (i = 0; i < n; i++) {
+        ngx_aws_auth__hmac_key_sha256_hex(jobs[i].hmac_key, jobs[i].data, jobs[i].len, jobs[i].hex);
+    }
+}
+
+ngx_aws_auth__md5_ctx_t* ngx_aws_auth__md5_init(ngx_pool_t *pool) {
+    ngx_aws_auth__md5_ctx_t *ctx = ngx_palloc(pool, sizeof(ngx_aws_auth__md5_ctx_t));
+
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    ctx->md_ctx = ngx_aws_auth__pool_md_ctx(pool, EVP_md5());
+    if (ctx->md_ctx == NULL) {
+        return NULL;
+    }
+
+    return ctx;
+}
+
+void ngx_aws_auth__md5_update(ngx_aws_auth__md5_ctx_t *ctx, const u_char *data, size_t len) {
+    EVP_DigestUpdate(ctx->md_ctx, data, len);
+}
+
+void ngx_aws_auth__md5_final(ngx_aws_auth__md5_ctx_t *ctx, u_char *digest) {
+    unsigned int len;
+
+    EVP_DigestFinal_ex(ctx->md_ctx, digest, &len);
+}
@@ -0,0 +1,331 @@
+/* OpenSSL 3 implementation of crypto functions
+ *
+ * Built instead of crypto_helper_openssl.c when the module is configured
+ * with NGX_AWS_AUTH_CRYPTO=openssl3, see the config script. It only uses
+ * the EVP interfaces: the algorithms are fetched once per process rather
+ * than implicitly on every call, and the contexts used for one-shot
+ * digests and MACs are kept per worker and reset between uses.
+ */
+
+#include "crypto_helper.h"
+
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/params.h>
+
+
+static EVP_MD *sha256_md = NULL;
+static EVP_MD *md5_md = NULL;
+static EVP_MAC *hmac_mac = NULL;
+
+/* used on the worker's own thread only, see crypto_helper.h */
+static EVP_MD_CTX *oneshot_md_ctx = NULL;
+static EVP_MD_CTX *placed_md_ctx = NULL;
+static EVP_MAC_CTX *oneshot_mac_ctx = NULL;
+
+static char sha256_name[] = "SHA256";
+static OSSL_PARAM hmac_params[] = {
+    OSSL_PARAM_utf8_string(OSSL_MAC_PARAM_DIGEST, sha256_name, sizeof(sha256_name) - 1),
+    OSSL_PARAM_END
+};
+
+struct ngx_aws_auth__sha256_ctx_s {
+    EVP_MD_CTX *md_ctx;
+};
+
+struct ngx_aws_auth__md5_ctx_s {
+    EVP_MD_CTX *md_ctx;
+};
+
+struct ngx_aws_auth__hmac_key_s {
+    EVP_MAC_CTX *mac_ctx; /* keyed once, restarted with a NULL key */
+};
+
+
+ngx_int_t ngx_aws_auth__crypto_init(void) {
+    if (sha256_md == NULL) {
+        sha256_md = EVP_MD_fetch(NULL, "SHA256", NULL);
+        if (sha256_md == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* may well be missing, e.g. in FIPS mode; only aws_content_md5 needs it */
+    if (md5_md == NULL) {
+        md5_md = EVP_MD_fetch(NULL, "MD5", NULL);
+    }
+
+    if (hmac_mac == NULL) {
+        hmac_mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+        if (hmac_mac == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (oneshot_md_ctx == NULL) {
+        oneshot_md_ctx = EVP_MD_CTX_new();
+        if (oneshot_md_ctx == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (placed_md_ctx == NULL) {
+        placed_md_ctx = EVP_MD_CTX_new();
+        if (placed_md_ctx == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (oneshot_mac_ctx == NULL) {
+        oneshot_mac_ctx = EVP_MAC_CTX_new(hmac_mac);
+        if (oneshot_mac_ctx == NULL || !EVP_MAC_CTX_set_params(oneshot_mac_ctx, hmac_params)) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+#define crypto_ready() (oneshot_mac_ctx != NULL || ngx_aws_auth__crypto_init() == NGX_OK)
+
+
+static void ngx_aws_auth__md_ctx_cleanup(void *data) {
+    EVP_MD_CTX_free(data);
+}
+
+static void ngx_aws_auth__mac_ctx_cleanup(void *data) {
+    EVP_MAC_CTX_free(data);
+}
+
+static EVP_MD_CTX *ngx_aws_auth__pool_md_ctx(ngx_pool_t *pool, const EVP_MD *md) {
+    ngx_pool_cleanup_t *cln;
+    EVP_MD_CTX *md_ctx;
+
+    if (md == NULL) {
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    md_ctx = EVP_MD_CTX_new();
+    if (md_ctx == NULL) {
+        return NULL;
+    }
+
+    cln->handler = ngx_aws_auth__md_ctx_cleanup;
+    cln->data = md_ctx;
+
+    if (!EVP_DigestInit_ex2(md_ctx, md, NULL)) {
+        return NULL;
+    }
+
+    return md_ctx;
+}
+
+static void ngx_aws_auth__oneshot_hmac(const u_char *key, size_t key_len, const u_char *data, size_t len,
+                                       u_char *md) {
+    size_t md_len;
+
+    EVP_MAC_init(oneshot_mac_ctx, key, key_len, NULL);
+    EVP_MAC_update(oneshot_mac_ctx, data, len);
+    EVP_MAC_final(oneshot_mac_ctx, md, &md_len, EVP_MAX_MD_SIZE);
+}
+
+
+ngx_str_t* ngx_aws_auth__sign_sha256_hex(ngx_pool_t *pool, const ngx_str_t *blob,
+    const ngx_str_t *signing_key) {
+    ngx_str_t *const retval = ngx_palloc(pool, sizeof(ngx_str_t) + NGX_AWS_AUTH__SHA256_HEX_LENGTH + 1);
+
+    if (retval == NULL) {
+        return NULL;
+    }
+
+    retval->data = (u_char *) (retval + 1);
+    retval->len = NGX_AWS_AUTH__SHA256_HEX_LENGTH;
+    ngx_aws_auth__hmac_sha256_hex(signing_key, blob->data, blob->len, retval->data);
+    retval->data[retval->len] = '\0';
+    return retval;
+}
+
+ngx_str_t* ngx_aws_auth__hash_sha256(ngx_pool_t *pool, const ngx_str_t *blob) {
+    ngx_str_t *const retval = ngx_palloc(pool, sizeof(ngx_str_t) + NGX_AWS_AUTH__SHA256_HEX_LENGTH + 1);
+
+    if (retval == NULL) {
+        return NULL;
+    }
+
+    retval->data = (u_char *) (retval + 1);
+    retval->len = NGX_AWS_AUTH__SHA256_HEX_LENGTH;
+    ngx_aws_auth__sha256_hex(blob->data, blob->len, retval->data);
+    retval->data[retval->len] = '\0';
+    return retval;
+}
+
+uint8_t *ngx_aws_auth__sign_hmac(ngx_pool_t *pool, uint8_t *key, int key_length, uint8_t *val) {
+    uint8_t *hash = ngx_pcalloc(pool, EVP_MAX_MD_SIZE * sizeof(uint8_t));
+
+    if (hash == NULL || !crypto_ready()) {
+        return NULL;
+    }
+
+    ngx_aws_auth__oneshot_hmac(key, key_length, val, ngx_strlen((char *) val), hash);
+    return hash;
+}
+
+ngx_aws_auth__sha256_ctx_t* ngx_aws_auth__sha256_init(ngx_pool_t *pool) {
+    ngx_aws_auth__sha256_ctx_t *ctx = ngx_palloc(pool, sizeof(ngx_aws_auth__sha256_ctx_t));
+
+    if (ctx == NULL || !crypto_ready()) {
+        return NULL;
+    }
+
+    /* its own context: a body digest may be fed from a thread */
+    ctx->md_ctx = ngx_aws_auth__pool_md_ctx(pool, sha256_md);
+    if (ctx->md_ctx == NULL) {
+        return NULL;
+    }
+
+    return ctx;
+}
+
+size_t ngx_aws_auth__sha256_ctx_size(void) {
+    return sizeof(ngx_aws_auth__sha256_ctx_t);
+}
+
+void ngx_aws_auth__sha256_reset(ngx_aws_auth__sha256_ctx_t *ctx) {
+    if (!crypto_ready()) {
+        return;
+    }
+
+    ctx->md_ctx = placed_md_ctx;
+    EVP_DigestInit_ex2(ctx->md_ctx, sha256_md, NULL);
+}
+
+void ngx_aws_auth__sha256_update(ngx_aws_auth__sha256_ctx_t *ctx, const u_char *data, size_t len) {
+    EVP_DigestUpdate(ctx->md_ctx, data, len);
+}
+
+void ngx_aws_auth__sha256_final_hex(ngx_aws_auth__sha256_ctx_t *ctx, u_char *hex) {
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int len;
+
+    EVP_DigestFinal_ex(ctx->md_ctx, hash, &len);
+    ngx_hex_dump(hex, hash, len);
+}
+
+void ngx_aws_auth__sha256_hex(const u_char *data, size_t len, u_char *hex) {
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+
+    if (!crypto_ready()) {
+        return;
+    }
+
+    EVP_DigestInit_ex2(oneshot_md_ctx, sha256_md, NULL);
+    EVP_DigestUpdate(oneshot_md_ctx, data, len);
+    EVP_DigestFinal_ex(oneshot_md_ctx, hash, &md_len);
+    ngx_hex_dump(hex, hash, md_len);
+}
+
+void ngx_aws_auth__hmac_sha256_hex(const ngx_str_t *key, const u_char *data, size_t len, u_char *hex) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+
+    if (!crypto_ready()) {
+        return;
+    }
+
+    ngx_aws_auth__oneshot_hmac(key->data, key->len, data, len, md);
+    ngx_hex_dump(hex, md, EVP_MD_get_size(sha256_md));
+}
+
+size_t ngx_aws_auth__hmac_key_size(void) {
+    return sizeof(ngx_aws_auth__hmac_key_t);
+}
+
+static ngx_int_t ngx_aws_auth__hmac_key_own(ngx_pool_t *pool, ngx_aws_auth__hmac_key_t *hmac_key,
+                                            EVP_MAC_CTX *mac_ctx) {
+    ngx_pool_cleanup_t *cln;
+
+    if (mac_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        EVP_MAC_CTX_free(mac_ctx);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_aws_auth__mac_ctx_cleanup;
+    cln->data = mac_ctx;
+    hmac_key->mac_ctx = mac_ctx;
+
+    return NGX_OK;
+}
+
+ngx_int_t ngx_aws_auth__hmac_key_set(ngx_pool_t *pool, ngx_aws_auth__hmac_key_t *hmac_key, const ngx_str_t *key) {
+    if (!crypto_ready()) {
+        return NGX_ERROR;
+    }
+
+    /* the pads are hashed by this first init, later ones pass no key */
+    if (ngx_aws_auth__hmac_key_own(pool, hmac_key, EVP_MAC_CTX_dup(oneshot_mac_ctx)) != NGX_OK
+        || !EVP_MAC_init(hmac_key->mac_ctx, key->data, key->len, NULL)) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+ngx_int_t ngx_aws_auth__hmac_key_copy(ngx_pool_t *pool, ngx_aws_auth__hmac_key_t *dst,
+                                      const ngx_aws_auth__hmac_key_t *src) {
+    return ngx_aws_auth__hmac_key_own(pool, dst, EVP_MAC_CTX_dup(src->mac_ctx));
+}
+
+void ngx_aws_auth__hmac_key_sha256_hex(const ngx_aws_auth__hmac_key_t *hmac_key,
+                                       const u_char *data, size_t len, u_char *hex) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    size_t md_len;
+
+    EVP_MAC_init(hmac_key->mac_ctx, NULL, 0, NULL);
+    EVP_MAC_update(hmac_key->mac_ctx, data, len);
+    EVP_MAC_final(hmac_key->mac_ctx, md, &md_len, sizeof(md));
+    ngx_hex_dump(hex, md, md_len);
+}
+
+void ngx_aws_auth__hmac_key_sha256_hex_batch(const ngx_aws_auth__hmac_job_t *jobs, ngx_uint_t n) {
+    ngx_uint_t i;
+
+    for (i = 0; i < n; i++) {
+        ngx_aws_auth__hmac_key_sha256_hex(jobs[i].hmac_key, jobs[i].data, jobs[i].len, jobs[i].hex);
+    }
+}
+
+ngx_aws_auth__md5_ctx_t* ngx_aws_auth__md5_init(ngx_pool_t *pool) {
+    ngx_aws_auth__md5_ctx_t *ctx = ngx_palloc(pool, sizeof(ngx_aws_auth__md5_ctx_t));
+
+    if (ctx == NULL || !crypto_ready()) {
+        return NULL;
+    }
+
+    ctx->md_ctx = ngx_aws_auth__pool_md_ctx(pool, md5_md);
+    if (ctx->md_ctx == NULL) {
+        return NULL;
+    }
+
+    return ctx;
+}
+
+void ngx_aws_auth__md5_update(ngx_aws_auth__md5_ctx_t *ctx, const u_char *data, size_t len) {
+    EVP_DigestUpdate(ctx->md_ctx, data, len);
+}
+
+void ngx_aws_auth__md5_final(ngx_aws_auth__md5_ctx_t *ctx, u_char *digest) {
+    unsigned int len;
+
+    EVP_DigestFinal_ex(ctx->md_ctx, digest, &len);
+}
@@ -14,6 +14,261 @@
 
 #define AWS_S3_VARIABLE "s3_auth_token"
 #define AWS_DATE_VARIABLE "aws_date"
+#define AWS_CONTENT_LENGTH_VARIABLE "aws_content_length"
+#define AWS_PART_RANGE_VARIABLE "aws_part_range"
+#define AWS_SUBREQUEST_TOKEN_VARIABLE "aws_subrequest_auth_token"
+#define AWS_SUBREQUEST_DATE_VARIABLE "aws_subrequest_date"
+#define AWS_CONTENT_SHA256_VARIABLE "aws_content_sha256"
+#define AWS_S3_HOST_VARIABLE "aws_s3_host"
+
+#define AWS_HASH_THREAD_MIN_SIZE_DEFAULT (1024 * 1024)
+#define AWS_HASH_THREAD_BUF_SIZE 65536
+
+#define AWS_KEY_PREROTATE_LEAD 300        /* seconds before midnight UTC */
+#define AWS_KEY_EPOCH_POOL_SIZE 1024
+
+#define AWS_SIGN_BATCH_MAX 64
+
+#define AWS_PRESIGNED_URL_VARIABLE "aws_presigned_url"
+#define AWS_PRESIGN_EXPIRES_DEFAULT 3600
+
+#define AWS_BUCKET_CACHE_DEFAULT 256
+
+#define AWS_FANOUT_PARALLEL_MAX 16
+#define AWS_FANOUT_PART_SIZE_MIN (64 * 1024)
+#define AWS_FANOUT_PART_SIZE_DEFAULT (8 * 1024 * 1024)
+
+#define AWS_MULTIPART_PARALLEL_MAX 16
+#define AWS_MULTIPART_PART_SIZE_DEFAULT (8 * 1024 * 1024)
+#define AWS_MULTIPART_ATTEMPTS 3
+
+/* what a subrequest of aws_multipart asks S3 for */
+#define AWS_UPLOAD_CREATE 1
+#define AWS_UPLOAD_PART 2
+#define AWS_UPLOAD_COMPLETE 3
+#define AWS_UPLOAD_ABORT 4
+
+typedef struct ngx_http_aws_auth_fanout_s ngx_http_aws_auth_fanout_t;
+typedef struct ngx_http_aws_auth_upload_s ngx_http_aws_auth_upload_t;
+
+/* what a subrequest sends S3, signed by its main request; the location it
+   goes to passes it on with the $aws_* variables */
+typedef struct {
+    ngx_str_t date;
+    ngx_str_t token;
+    ngx_str_t payload_hash;
+    ngx_str_t range;                      /* bytes=<first>-<last> for aws_fanout */
+} ngx_http_aws_auth_subrequest_t;
+
+/* a range of a GET split by aws_fanout */
+typedef struct {
+    ngx_http_aws_auth_subrequest_t sub;
+    ngx_http_aws_auth_fanout_t *fanout;
+    ngx_uint_t index;
+    off_t first;
+    unsigned done:1;
+} ngx_http_aws_auth_part_t;
+
+struct ngx_http_aws_auth_fanout_s {
+    ngx_http_request_t *request;          /* the main request */
+    ngx_http_aws_auth_conf_t *conf;
+    ngx_str_t uri;                        /* of the subrequests */
+    off_t size;                           /* of the object, known from the first part */
+    ngx_uint_t nparts;                    /* 0 until then */
+    ngx_uint_t next;                      /* part to request next */
+    ngx_uint_t active;                    /* parts requested and not done */
+    unsigned header_sent:1;
+    unsigned last_sent:1;
+};
+
+/* a part of a PUT split by aws_multipart */
+typedef struct {
+    off_t offset;                         /* in the request body */
+    off_t size;
+    ngx_str_t payload_hash;               /* known once the body got past the part */
+    ngx_str_t etag;                       /* S3's, once uploaded */
+    ngx_uint_t attempts;
+} ngx_http_aws_auth_upload_part_t;
+
+struct ngx_http_aws_auth_upload_s {
+    ngx_http_request_t *request;          /* the main request */
+    ngx_http_aws_auth_conf_t *conf;
+    ngx_str_t uri;                        /* of the subrequests */
+    ngx_str_t upload_args;                /* uploadId=<id>, once S3 gave one */
+    ngx_str_t etag;                       /* of the object, for the client */
+    ngx_http_aws_auth_upload_part_t *parts;
+    ngx_uint_t nparts;
+    ngx_uint_t hashed;                    /* parts the body got past */
+    ngx_uint_t next;                      /* part to upload next */
+    ngx_uint_t active;                    /* parts being uploaded */
+    ngx_uint_t uploaded;
+    off_t received;                       /* of the body, hashed */
+    ngx_aws_auth_payload_digest_t digest; /* of the part being received */
+    ngx_int_t status;                     /* for the client, NGX_DONE until known */
+#if (NGX_THREADS)
+    ngx_thread_task_t *hash_task;
+#endif
+    unsigned offload:1;                   /* parts hashed in a thread once written */
+    unsigned hash_posted:1;               /* hash_task is with the thread pool */
+    unsigned body_read:1;
+    unsigned created:1;                   /* CreateMultipartUpload answered */
+    unsigned completing:1;
+    unsigned aborting:1;
+    unsigned aborted:1;                   /* AbortMultipartUpload answered, or cannot be sent */
+    unsigned failed:1;
+    unsigned responded:1;
+};
+
+/* a request whose signature waits for the worker's signing batch */
+typedef struct {
+    ngx_queue_t queue;
+    ngx_http_request_t *request;
+    const ngx_aws_auth__hmac_key_t *hmac_key;
+    const ngx_array_t *headers_out;
+    ngx_aws_auth_pending_signature_t signature;
+} ngx_http_aws_auth_batch_item_t;
+
+typedef struct {
+    ngx_int_t status;                     /* NGX_DONE while the body is read */
+    ngx_aws_auth_payload_digest_t digest;
+
+    /* aws-chunked framing of the body */
+    ngx_aws_auth_chunk_signer_t chunk_signer;
+    off_t decoded_length;
+    off_t framed_length;
+    ngx_chain_t *chunk;                   /* chunk being filled */
+    ngx_chain_t *free;
+    ngx_chain_t *busy;
+    uint32_t crc32c;                      /* checksum of an unsigned payload */
+    time_t sign_time;                     /* of a request signed once its body is read */
+    ngx_str_t verify_hash;                /* x-amz-content-sha256 aws_verify checks the body against */
+
+#if (NGX_THREADS)
+    ngx_thread_task_t *hash_task;
+    ngx_chain_t *hash_fill;               /* copy of the body being filled */
+    ngx_chain_t *hash_in;                 /* copies waiting for the hash thread */
+    ngx_chain_t **hash_last;
+    ngx_chain_t *hash_free;
+#endif
+
+    ngx_http_aws_auth_batch_item_t batch;
+    ngx_http_aws_auth_subrequest_t *sub;  /* of a subrequest signed by the main request */
+    ngx_http_aws_auth_part_t *part;       /* of a subrequest of aws_fanout */
+    ngx_http_aws_auth_upload_t *upload;   /* of a PUT split by aws_multipart, and its subrequests */
+    ngx_http_aws_auth_upload_part_t *upload_part;
+    ngx_uint_t upload_op;                 /* AWS_UPLOAD_* of a subrequest of aws_multipart */
+
+    /* of a main request, for it and its subrequests */
+    ngx_http_aws_auth_conf_t *tpl_conf;   /* the location tpl was resolved for */
+    const ngx_aws_auth_template_t *tpl;
+    ngx_array_t *epochs;                  /* ngx_aws_auth_key_epoch_t * held */
+
+    unsigned started:1;                   /* the module took the request on, not just its caches */
+    unsigned hashing:1;
+    unsigned offload:1;                   /* hash in a thread as the body is read */
+    unsigned hash_posted:1;               /* hash_task is with the thread pool */
+    unsigned framing:1;
+    unsigned unsigned_payload:1;
+    unsigned chunk_header_sent:1;
+    unsigned batch_queued:1;              /* batch.queue is linked */
+    unsigned batch_signed:1;
+    unsigned memoize:1;                   /* batch signature goes to aws_sign_cache */
+    unsigned sub_done:1;                  /* its post subrequest handler ran */
+} ngx_http_aws_auth_ctx_t;
+
+#if (NGX_THREADS)
+typedef struct {
+    ngx_aws_auth_payload_digest_t *digest;
+    ngx_chain_t *bufs;                    /* copies of the body, or a part of its temp file, hashed in order */
+    u_char *read_buf;                     /* of AWS_HASH_THREAD_BUF_SIZE, for a part */
+    ngx_err_t err;                        /* reading the part back failed */
+    unsigned read_failed:1;
+} ngx_http_aws_auth_hash_task_t;
+#endif
+
+/* signing keys derived by any worker, kept across reloads */
+typedef struct {
+    ngx_rbtree_node_t node;
+    ngx_queue_t queue;
+    u_char id[NGX_AWS_AUTH__SHA256_HEX_LENGTH]; /* see ngx_aws_auth__signing_key_id */
+    u_short key_len;
+    u_short scope_len;
+    u_char data[1];                             /* signing key, then key scope */
+} ngx_http_aws_auth_key_node_t;
+
+/* an access key of aws_verify_key, in the memory of the workers: only the
+   keys derived from its secret go to aws_signing_key_zone */
+typedef struct {
+    ngx_str_node_t sn;                          /* sn.str is the access key */
+    ngx_str_t secret_key;                       /* a C string, as read from the configuration */
+} ngx_http_aws_auth_access_key_node_t;
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t queue;                          /* most recently used first */
+} ngx_http_aws_auth_key_shctx_t;
+
+typedef struct {
+    ngx_http_aws_auth_key_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+    ngx_array_t *confs;                         /* primed when the zone is mapped */
+    ngx_pool_t *pool;                           /* of the cycle, for the primed epochs */
+} ngx_http_aws_auth_key_cache_t;
+
+typedef struct {
+    ngx_shm_zone_t *key_zone;
+    ngx_array_t confs;                          /* every aws_sign location */
+    ngx_rbtree_t access_keys;                   /* aws_verify accepts */
+    ngx_rbtree_node_t access_keys_sentinel;
+} ngx_http_aws_auth_main_conf_t;
+
+/* Headers signed for a request without a body, pushed again for requests
+   with the same bucket, method, URI and query string as long as the signing key and
+   the x-amz-date are the same, see aws_sign_cache. Allocated in one piece:
+   the node, the headers, then their strings */
+typedef struct {
+    ngx_str_node_t sn;                          /* "<method> <host><URI>?<query string>" */
+    ngx_queue_t queue;
+    const ngx_aws_auth__hmac_key_t *hmac_key;   /* of the epoch that signed them */
+    time_t date;
+    ngx_uint_t nheaders;
+    header_pair_t headers[1];
+} ngx_http_aws_auth_memo_node_t;
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t queue;                          /* most recently used first */
+    ngx_uint_t n;
+} ngx_http_aws_auth_memo_t;
+
+/* The template of a bucket an aws_s3_bucket with variables gave, see
+   aws_s3_bucket_cache. Allocated in one piece: the node, the bucket name,
+   then the template's strings */
+typedef struct {
+    ngx_str_node_t sn;                          /* the bucket name */
+    ngx_queue_t queue;
+    ngx_aws_auth_template_t tpl;
+} ngx_http_aws_auth_bucket_node_t;
+
+/* requests of the worker waiting to be signed together, see
+   ngx_http_aws_auth_batch_sign */
+typedef struct {
+    ngx_queue_t queue;
+    ngx_uint_t n;                               /* unsigned requests queued */
+    ngx_uint_t size;                            /* the smallest aws_sign_batch among them */
+    ngx_event_t event;
+} ngx_http_aws_auth_batch_t;
+
+static ngx_event_t ngx_http_aws_auth_rotate_event;
+static ngx_http_aws_auth_batch_t ngx_http_aws_auth_batch;
+
+static ngx_http_request_body_filter_pt ngx_http_next_request_body_filter;
+static ngx_http_output_header_filter_pt ngx_http_next_header_filter;
+
+static void
+*ngx_http_aws_auth_create_main_conf(ngx_conf_t *cf);
 
 static void
 *ngx_http_aws_auth_create_loc_conf(ngx_conf_t *cf);
@@ -24,12 +279,67 @@ static char
 static
 ngx_int_t ngx_aws_auth_req_init(ngx_conf_t *cf);
 
+static
+ngx_int_t ngx_http_aws_auth_add_variables(ngx_conf_t *cf);
+
+static
+ngx_int_t ngx_http_aws_auth_init_process(ngx_cycle_t *cycle);
+
+static void
+ngx_http_aws_auth_batch_handler(ngx_event_t *ev);
+
+static void
+ngx_http_aws_auth_body_handler(ngx_http_request_t *r);
+
+#if (NGX_THREADS)
+static void
+ngx_http_aws_auth_hash_event_handler(ngx_event_t *ev);
+
+static void
+ngx_http_aws_auth_upload_hash_handler(ngx_event_t *ev);
+#endif
+
+static ngx_int_t
+ngx_http_aws_auth_fanout_done(ngx_http_request_t *r, void *data, ngx_int_t rc);
+
+static ngx_int_t
+ngx_http_aws_auth_upload_done(ngx_http_request_t *r, void *data, ngx_int_t rc);
+
 static char
 *ngx_http_aws_endpoint(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
+static char
+*ngx_http_aws_s3_bucket(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
 static char
 *ngx_http_aws_sign(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
+static char
+*ngx_http_aws_hash_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static char
+*ngx_http_aws_sign_batch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static char
+*ngx_http_aws_fanout(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static char
+*ngx_http_aws_multipart(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static char
+*ngx_http_aws_signing_key_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static char
+*ngx_http_aws_verify_key(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static ngx_conf_enum_t ngx_http_aws_payload_signing[] = {
+        {ngx_string("none"), NGX_AWS_AUTH_PAYLOAD_NONE},
+        {ngx_string("sha256"), NGX_AWS_AUTH_PAYLOAD_SHA256},
+        {ngx_string("streaming"), NGX_AWS_AUTH_PAYLOAD_STREAMING},
+        {ngx_string("unsigned"), NGX_AWS_AUTH_PAYLOAD_UNSIGNED},
+        {ngx_null_string, 0}
+};
+
 static ngx_command_t ngx_http_aws_auth_commands[] = {
         {ngx_string("aws_access_key"),
          NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
@@ -68,26 +378,138 @@ static ngx_command_t ngx_http_aws_auth_commands[] = {
 
         {ngx_string("aws_s3_bucket"),
          NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
-         ngx_conf_set_str_slot,
+         ngx_http_aws_s3_bucket,
          NGX_HTTP_LOC_CONF_OFFSET,
-         offsetof(ngx_http_aws_auth_conf_t, bucket_name),
+         0,
+         NULL},
+
+        {ngx_string("aws_s3_bucket_cache"),
+         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+         ngx_conf_set_num_slot,
+         NGX_HTTP_LOC_CONF_OFFSET,
+         offsetof(ngx_http_aws_auth_conf_t, bucket_cache),
          NULL},
 
         {ngx_string("aws_sign"),
-         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS | NGX_CONF_TAKE1,
          ngx_http_aws_sign,
          0,
          0,
          NULL},
 
+        {ngx_string("aws_payload_signing"),
+         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+         ngx_conf_set_enum_slot,
+         NGX_HTTP_LOC_CONF_OFFSET,
+         offsetof(ngx_http_aws_auth_conf_t, payload_signing),
+         &ngx_http_aws_payload_signing},
+
+        {ngx_string("aws_content_md5"),
+         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+         ngx_conf_set_flag_slot,
+         NGX_HTTP_LOC_CONF_OFFSET,
+         offsetof(ngx_http_aws_auth_conf_t, content_md5),
+         NULL},
+
+        {ngx_string("aws_chunk_size"),
+         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+         ngx_conf_set_size_slot,
+         NGX_HTTP_LOC_CONF_OFFSET,
+         offsetof(ngx_http_aws_auth_conf_t, chunk_size),
+         NULL},
+
+        {ngx_string("aws_signing_key_zone"),
+         NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE2,
+         ngx_http_aws_signing_key_zone,
+         NGX_HTTP_MAIN_CONF_OFFSET,
+         0,
+         NULL},
+
+        {ngx_string("aws_sign_time_bucket"),
+         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+         ngx_conf_set_sec_slot,
+         NGX_HTTP_LOC_CONF_OFFSET,
+         offsetof(ngx_http_aws_auth_conf_t, time_bucket),
+         NULL},
+
+        {ngx_string("aws_sign_cache"),
+         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+         ngx_conf_set_num_slot,
+         NGX_HTTP_LOC_CONF_OFFSET,
+         offsetof(ngx_http_aws_auth_conf_t, sign_cache),
+         NULL},
+
+        {ngx_string("aws_verify"),
+         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+         ngx_conf_set_flag_slot,
+         NGX_HTTP_LOC_CONF_OFFSET,
+         offsetof(ngx_http_aws_auth_conf_t, verify),
+         NULL},
+
+        {ngx_string("aws_verify_key"),
+         NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE2,
+         ngx_http_aws_verify_key,
+         NGX_HTTP_MAIN_CONF_OFFSET,
+         0,
+         NULL},
+
+        {ngx_string("aws_sign_batch"),
+         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+         ngx_http_aws_sign_batch,
+         NGX_HTTP_LOC_CONF_OFFSET,
+         0,
+         NULL},
+
+        {ngx_string("aws_fanout"),
+         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+         ngx_http_aws_fanout,
+         NGX_HTTP_LOC_CONF_OFFSET,
+         0,
+         NULL},
+
+        {ngx_string("aws_multipart"),
+         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+         ngx_http_aws_multipart,
+         NGX_HTTP_LOC_CONF_OFFSET,
+         0,
+         NULL},
+
+        {ngx_string("aws_hash_thread_pool"),
+         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+         ngx_http_aws_hash_thread_pool,
+         NGX_HTTP_LOC_CONF_OFFSET,
+         0,
+         NULL},
+
+        {ngx_string("aws_presign_redirect"),
+         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+         ngx_conf_set_flag_slot,
+         NGX_HTTP_LOC_CONF_OFFSET,
+         offsetof(ngx_http_aws_auth_conf_t, presign_redirect),
+         NULL},
+
+        {ngx_string("aws_presign_expires"),
+         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+         ngx_conf_set_sec_slot,
+         NGX_HTTP_LOC_CONF_OFFSET,
+         offsetof(ngx_http_aws_auth_conf_t, presign_expires),
+         NULL},
+
+        {ngx_string("aws_hash_thread_min_size"),
+         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+         ngx_conf_set_size_slot,
+         NGX_HTTP_LOC_CONF_OFFSET,
+         offsetof(ngx_http_aws_auth_conf_t, hash_thread_min_size),
+         NULL},
+
         ngx_null_command
 };
 
 static ngx_http_module_t ngx_http_aws_auth_module_ctx = {
-        NULL,                     /* preconfiguration */
+        ngx_http_aws_auth_add_variables,       /* preconfiguration */
         ngx_aws_auth_req_init,                                  /* postconfiguration */
 
-        NULL,                                  /* create main configuration */
+        ngx_http_aws_auth_create_main_conf,    /* create main configuration */
         NULL,                                  /* init main configuration */
 
         NULL,                                  /* create server configuration */
@@ -105,7 +527,7 @@ ngx_module_t ngx_http_aws_auth_module = {
         NGX_HTTP_MODULE,                       /* module type */
         NULL,                                  /* init master */
         NULL,                                  /* init module */
-        NULL,                                  /* init process */
+        ngx_http_aws_auth_init_process,        /* init process */
         NULL,                                  /* init thread */
         NULL,                                  /* exit thread */
         NULL,                                  /* exit process */
@@ -114,12 +536,50 @@ ngx_module_t ngx_http_aws_auth_module = {
 };
 
 
+static void *
+ngx_http_aws_auth_create_main_conf(ngx_conf_t *cf) {
+    ngx_http_aws_auth_main_conf_t *amcf;
+
+    amcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_aws_auth_main_conf_t));
+    if (amcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&amcf->confs, cf->pool, 4, sizeof(ngx_http_aws_auth_conf_t *)) != NGX_OK) {
+        return NULL;
+    }
+
+    ngx_rbtree_init(&amcf->access_keys, &amcf->access_keys_sentinel, ngx_str_rbtree_insert_value);
+
+    return amcf;
+}
+
 static void *
 ngx_http_aws_auth_create_loc_conf(ngx_conf_t *cf) {
     ngx_http_aws_auth_conf_t *conf;
 
     conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_aws_auth_conf_t));
     conf->enabled = 0;
+    conf->lazy = 0;
+    conf->payload_signing = NGX_CONF_UNSET_UINT;
+    conf->content_md5 = NGX_CONF_UNSET;
+    conf->chunk_size = NGX_CONF_UNSET_SIZE;
+    conf->sign_batch = NGX_CONF_UNSET_UINT;
+    conf->sign_batch_timeout = NGX_CONF_UNSET_MSEC;
+    conf->fanout_parallel = NGX_CONF_UNSET_UINT;
+    conf->fanout_part_size = NGX_CONF_UNSET_SIZE;
+    conf->multipart_parallel = NGX_CONF_UNSET_UINT;
+    conf->multipart_part_size = NGX_CONF_UNSET_SIZE;
+    conf->presign_redirect = NGX_CONF_UNSET;
+    conf->presign_expires = NGX_CONF_UNSET;
+    conf->verify = NGX_CONF_UNSET;
+    conf->time_bucket = NGX_CONF_UNSET;
+    conf->sign_cache = NGX_CONF_UNSET;
+    conf->bucket_cache = NGX_CONF_UNSET;
+#if (NGX_THREADS)
+    conf->hash_thread_pool = NGX_CONF_UNSET_PTR;
+#endif
+    conf->hash_thread_min_size = NGX_CONF_UNSET_SIZE;
     ngx_str_set(&conf->endpoint, "s3.amazonaws.com");
     ngx_str_set(&conf->service, "s3");
 
@@ -136,6 +596,23 @@ ngx_http_aws_auth_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child) {
     ngx_http_aws_auth_conf_t *prev = parent;
     ngx_http_aws_auth_conf_t *conf = child;
 
+    ngx_conf_merge_value(conf->verify, prev->verify, 0);
+    if (conf->verify) {
+        ngx_http_aws_auth_main_conf_t *amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_aws_auth_module);
+
+        /* the region of the client's credential is checked against it if set */
+        ngx_conf_merge_str_value(conf->region, prev->region, "");
+
+        if (amcf->key_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "Error aws_verify needs aws_signing_key_zone");
+            return NGX_CONF_ERROR;
+        }
+
+        if (amcf->access_keys.root == amcf->access_keys.sentinel) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "Error aws_verify without any aws_verify_key");
+            return NGX_CONF_ERROR;
+        }
+    }
 
     if (conf->enabled) {
         ngx_conf_merge_str_value(conf->access_key, prev->access_key, "");
@@ -143,7 +620,35 @@ ngx_http_aws_auth_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child) {
         ngx_conf_merge_str_value(conf->region, prev->region, "");
         ngx_conf_merge_str_value(conf->service, prev->service, "s3");
         ngx_conf_merge_str_value(conf->endpoint, prev->endpoint, "s3.amazonaws.com");
-        ngx_conf_merge_str_value(conf->bucket_name, prev->bucket_name, "");
+        if (conf->bucket_name.data == NULL && conf->bucket_value == NULL) {
+            conf->bucket_name = prev->bucket_name;
+            conf->bucket_value = prev->bucket_value;
+        }
+        if (conf->bucket_name.data == NULL) {
+            ngx_str_set(&conf->bucket_name, "");
+        }
+        ngx_conf_merge_value(conf->bucket_cache, prev->bucket_cache, AWS_BUCKET_CACHE_DEFAULT);
+        ngx_conf_merge_uint_value(conf->payload_signing, prev->payload_signing, NGX_AWS_AUTH_PAYLOAD_NONE);
+        ngx_conf_merge_value(conf->content_md5, prev->content_md5, 0);
+        ngx_conf_merge_size_value(conf->chunk_size, prev->chunk_size, AWS_CHUNK_SIZE_DEFAULT);
+        ngx_conf_merge_uint_value(conf->sign_batch, prev->sign_batch, 0);
+        ngx_conf_merge_msec_value(conf->sign_batch_timeout, prev->sign_batch_timeout, 0);
+        ngx_conf_merge_str_value(conf->fanout_uri, prev->fanout_uri, "");
+        ngx_conf_merge_uint_value(conf->fanout_parallel, prev->fanout_parallel, 0);
+        ngx_conf_merge_size_value(conf->fanout_part_size, prev->fanout_part_size, AWS_FANOUT_PART_SIZE_DEFAULT);
+        ngx_conf_merge_str_value(conf->multipart_uri, prev->multipart_uri, "");
+        ngx_conf_merge_uint_value(conf->multipart_parallel, prev->multipart_parallel, 0);
+        ngx_conf_merge_size_value(conf->multipart_part_size, prev->multipart_part_size,
+                                  AWS_MULTIPART_PART_SIZE_DEFAULT);
+        ngx_conf_merge_value(conf->presign_redirect, prev->presign_redirect, 0);
+        ngx_conf_merge_sec_value(conf->presign_expires, prev->presign_expires, AWS_PRESIGN_EXPIRES_DEFAULT);
+        ngx_conf_merge_sec_value(conf->time_bucket, prev->time_bucket, 1);
+        ngx_conf_merge_value(conf->sign_cache, prev->sign_cache, 0);
+#if (NGX_THREADS)
+        ngx_conf_merge_ptr_value(conf->hash_thread_pool, prev->hash_thread_pool, NULL);
+#endif
+        ngx_conf_merge_size_value(conf->hash_thread_min_size, prev->hash_thread_min_size,
+                                  AWS_HASH_THREAD_MIN_SIZE_DEFAULT);
 
         ngx_uint_t config_invalid = 0;
         if (conf->access_key.len == 0) {
@@ -156,7 +661,7 @@ ngx_http_aws_auth_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child) {
             config_invalid = 1;
         }
 
-        if (conf->bucket_name.len == 0) {
+        if (conf->bucket_name.len == 0 && conf->bucket_value == NULL) {
             ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "Error aws_s3_bucket missing");
             config_invalid = 1;
         }
@@ -166,102 +671,3727 @@ ngx_http_aws_auth_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child) {
             config_invalid = 1;
         }
 
+        if (conf->chunk_size < AWS_CHUNK_SIZE_MIN) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "Error aws_chunk_size must be at least %uz", AWS_CHUNK_SIZE_MIN);
+            config_invalid = 1;
+        }
+
+        if (conf->presign_expires < 1 || conf->presign_expires > AWS_PRESIGN_EXPIRES_MAX) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "Error aws_presign_expires must be 1s to %d seconds",
+                          AWS_PRESIGN_EXPIRES_MAX);
+            config_invalid = 1;
+        }
+
+        if (conf->time_bucket < 1 || conf->time_bucket > AWS_TIME_BUCKET_MAX) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "Error aws_sign_time_bucket must be 1s to %d seconds",
+                          AWS_TIME_BUCKET_MAX);
+            config_invalid = 1;
+        }
+
+        if (conf->sign_cache < 0) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "Error aws_sign_cache must not be negative");
+            config_invalid = 1;
+        }
+
+        if (conf->bucket_cache < 0) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "Error aws_s3_bucket_cache must not be negative");
+            config_invalid = 1;
+        }
+
         if (config_invalid) {
             return NGX_CONF_ERROR;
         }
 
-        time_t rawtime;
-        time(&rawtime);
-        update_key_signature(cf->pool, conf, &rawtime);
+        /* a bucket known only per request gets its template then */
+        if (conf->bucket_value == NULL
+            && ngx_aws_auth__compile_template(cf->pool, &conf->sign_template, &conf->access_key,
+                                              &conf->bucket_name, &conf->endpoint) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+        conf->sign_template.time_bucket = conf->time_bucket;
+
+        ngx_http_aws_auth_main_conf_t *amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_aws_auth_module);
+        conf->key_zone = amcf->key_zone;
+
+        /* registered for the rotation timer */
+        ngx_http_aws_auth_conf_t **confp = ngx_array_push(&amcf->confs);
+        if (confp == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        *confp = conf;
+
+        if (conf->key_zone == NULL) {
+            time_t rawtime;
+            time(&rawtime);
+            conf->epoch = ngx_aws_auth__derive_key_epoch(cf->pool, conf, rawtime);
+            if (conf->epoch == NULL) {
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        /* otherwise the epoch is taken from the zone once it is mapped, on
+           a reload that is usually the key the previous cycle derived */
     }
     return NGX_CONF_OK;
 }
 
 
 static ngx_int_t
-ngx_http_aws_proxy_sign(ngx_http_request_t *r) {
-    ngx_http_aws_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_aws_auth_module);
-    if (!conf->enabled) {
-        /* return directly if module is not enabled */
-        return NGX_DECLINED;
-    }
+ngx_http_aws_auth_push_header(ngx_http_request_t *r, const ngx_str_t *key, const ngx_str_t *value) {
+    ngx_list_part_t *part;
     ngx_table_elt_t *h;
-    header_pair_t *hv;
+    ngx_uint_t i;
 
-    if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
-        /* We do not wish to support anything with a body as signing for a body is unimplemented */
-        return NGX_HTTP_NOT_ALLOWED;
+    if (r->headers_in.authorization != NULL
+        || (key->len == CONTENT_ENCODING_HEADER.len
+            && ngx_strncmp(key->data, CONTENT_ENCODING_HEADER.data, key->len) == 0)) {
+        /* a client that signed the request itself, as aws_verify wants, or
+           a content-encoding merged into aws-chunked: the upstream gets our
+           headers in place of the client's */
+        for (part = &r->headers_in.headers.part; part; part = part->next) {
+            h = part->elts;
+            for (i = 0; i < part->nelts; i++) {
+                if (h[i].key.len == key->len && ngx_strncmp(h[i].lowcase_key, key->data, key->len) == 0) {
+                    h[i].value = *value;
+                    return NGX_OK;
+                }
+            }
+        }
     }
 
-    update_key_signature(r->pool, conf, &r->start_sec);
+    h = ngx_list_push(&r->headers_in.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
 
-    const ngx_array_t *headers_out = ngx_aws_auth__sign(
-            r->pool, r,
-            &conf->access_key, &conf->signing_key_decoded, &conf->key_scope,
-            &conf->bucket_name, &conf->endpoint);
+    h->hash = 1;
+    h->key = *key;
+    h->lowcase_key = key->data; /* We ensure that header names are already lowercased */
+    h->value = *value;
 
-    ngx_uint_t i;
-    for (i = 0; i < headers_out->nelts; i++) {
-        hv = (header_pair_t *) ((u_char *) headers_out->elts + headers_out->size * i);
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "header name %s, value %s", hv->key.data, hv->value.data);
+    return NGX_OK;
+}
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_aws_auth_hash_thread(void *data, ngx_log_t *log) {
+    ngx_http_aws_auth_hash_task_t *t = data;
+    ngx_chain_t *cl;
+    ssize_t n;
+    off_t pos;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "aws payload hash thread");
 
-        if (ngx_strncmp(hv->key.data, HOST_HEADER.data, hv->key.len) == 0) {
-            /* host header is controlled by proxy pass directive and hence
-               cannot be set by our module */
+    for (cl = t->bufs; cl; cl = cl->next) {
+        if (!cl->buf->in_file) {
+            ngx_aws_auth__payload_digest_update(t->digest, cl->buf->pos, cl->buf->last - cl->buf->pos);
             continue;
         }
 
-        h = ngx_list_push(&r->headers_in.headers);
-        if (h == NULL) {
-            return NGX_ERROR;
+        /* a part of an aws_multipart body, read back as
+           ngx_thread_read_handler does */
+        for (pos = cl->buf->file_pos; pos < cl->buf->file_last; pos += n) {
+            n = pread(cl->buf->file->fd, t->read_buf,
+                      (size_t) ngx_min(cl->buf->file_last - pos, AWS_HASH_THREAD_BUF_SIZE), pos);
+            if (n <= 0) {
+                t->err = (n == -1) ? ngx_errno : 0;
+                t->read_failed = 1;
+                return;
+            }
+            ngx_aws_auth__payload_digest_update(t->digest, t->read_buf, (size_t) n);
         }
-
-        h->hash = 1;
-        h->key = hv->key;
-        h->lowcase_key = hv->key.data; /* We ensure that header names are already lowercased */
-        h->value = hv->value;
     }
-    return NGX_OK;
 }
 
-static char *
-ngx_http_aws_endpoint(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
-    char *p = conf;
+/* Copies body data for the hash thread; the buffers the body filter gets
+   are read into again once it returns */
+static ngx_int_t
+ngx_http_aws_auth_hash_copy(ngx_http_request_t *r, ngx_http_aws_auth_ctx_t *ctx, u_char *p, size_t len) {
+    ngx_chain_t *cl;
+    ngx_buf_t *b;
+    size_t n;
 
-    ngx_str_t *field, *value;
+    while (len) {
+        cl = ctx->hash_fill;
 
-    field = (ngx_str_t * )(p + cmd->offset);
+        if (cl == NULL) {
+            if (ctx->hash_free != NULL) {
+                cl = ctx->hash_free;
+                ctx->hash_free = cl->next;
+                cl->buf->pos = cl->buf->start;
+                cl->buf->last = cl->buf->start;
 
-    value = cf->args->elts;
+            } else {
+                b = ngx_create_temp_buf(r->pool, AWS_HASH_THREAD_BUF_SIZE);
+                cl = ngx_alloc_chain_link(r->pool);
+                if (b == NULL || cl == NULL) {
+                    return NGX_ERROR;
+                }
+                cl->buf = b;
+            }
 
-    *field = value[1];
+            cl->next = NULL;
+            ctx->hash_fill = cl;
+        }
 
-    return NGX_CONF_OK;
-}
+        b = cl->buf;
+        n = ngx_min(len, (size_t) (b->end - b->last));
+        b->last = ngx_cpymem(b->last, p, n);
+        p += n;
+        len -= n;
 
-static char *
-ngx_http_aws_sign(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
-    ngx_http_aws_auth_conf_t *mconf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_aws_auth_module);
-    mconf->enabled = 1;
+        if (b->last == b->end) {
+            *ctx->hash_last = cl;
+            ctx->hash_last = &cl->next;
+            ctx->hash_fill = NULL;
+        }
+    }
 
-    return NGX_CONF_OK;
+    return NGX_OK;
 }
 
+/* Hands what was copied so far to the hash thread unless it is still busy;
+   one task at a time, so the digest is fed in order */
 static ngx_int_t
-ngx_aws_auth_req_init(ngx_conf_t *cf) {
-    ngx_http_handler_pt *h;
-    ngx_http_core_main_conf_t *cmcf;
+ngx_http_aws_auth_hash_next(ngx_http_request_t *r, ngx_http_aws_auth_ctx_t *ctx) {
+    ngx_http_aws_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_aws_auth_module);
+    ngx_http_aws_auth_hash_task_t *t;
+    ngx_thread_task_t *task;
 
-    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+    if (ctx->hash_posted) {
+        return NGX_OK;
+    }
 
-    h = ngx_array_push(&cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers);
-    if (h == NULL) {
-        ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "Missing NGX HTTP ACCESS PHASE handlers");
+    if (ctx->hash_fill != NULL && ctx->hash_fill->buf->last > ctx->hash_fill->buf->pos) {
+        *ctx->hash_last = ctx->hash_fill;
+        ctx->hash_last = &ctx->hash_fill->next;
+        ctx->hash_fill = NULL;
+    }
+
+    if (ctx->hash_in == NULL) {
+        return NGX_OK;
+    }
+
+    task = ctx->hash_task;
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_aws_auth_hash_task_t));
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        task->handler = ngx_http_aws_auth_hash_thread;
+        task->event.data = r;
+        task->event.handler = ngx_http_aws_auth_hash_event_handler;
+        ctx->hash_task = task;
+    }
+
+    t = task->ctx;
+    t->digest = &ctx->digest;
+    t->bufs = ctx->hash_in;
+
+    if (ngx_thread_task_post(conf->hash_thread_pool, task) != NGX_OK) {
         return NGX_ERROR;
     }
 
-    *h = ngx_http_aws_proxy_sign;
+    ctx->hash_in = NULL;
+    ctx->hash_last = &ctx->hash_in;
+    ctx->hash_posted = 1;
+    r->main->blocked++;
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_aws_auth_hash_event_handler(ngx_event_t *ev) {
+    ngx_http_aws_auth_hash_task_t *t;
+    ngx_http_aws_auth_ctx_t *ctx;
+    ngx_http_request_t *r;
+    ngx_connection_t *c;
+    ngx_chain_t *cl;
+
+    r = ev->data;
+    c = r->connection;
+
+    r->main->blocked--;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_aws_auth_module);
+    ctx->hash_posted = 0;
+
+    /* the buffers hashed are filled again */
+    t = ctx->hash_task->ctx;
+    for (cl = t->bufs; cl->next; cl = cl->next) { /* void */ }
+    cl->next = ctx->hash_free;
+    ctx->hash_free = t->bufs;
+
+    /* a request terminated meanwhile only waited for the thread to let
+       go of its buffers, its terminate handler frees it below */
+    if (!c->error && ngx_http_aws_auth_hash_next(r, ctx) != NGX_OK) {
+        ctx->offload = 0;
+        ctx->status = NGX_ERROR;
+    }
+
+    /* ngx_http_aws_auth_body_handler if it waits for this task, as
+       ngx_http_upstream_thread_event_handler resumes the upstream */
+    r->write_event_handler(r);
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+static void
+ngx_http_aws_auth_body_handler(ngx_http_request_t *r) {
+    ngx_http_aws_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_aws_auth_module);
+
+#if (NGX_THREADS)
+    if (ctx->offload) {
+        if (ngx_http_aws_auth_hash_next(r, ctx) != NGX_OK) {
+            ctx->offload = 0;
+            ctx->status = NGX_ERROR;
+
+        } else if (ctx->hash_posted) {
+            /* called again by ngx_http_aws_auth_hash_event_handler once
+               the thread caught up with the body */
+            r->write_event_handler = ngx_http_aws_auth_body_handler;
+            return;
+
+        } else {
+            /* all of the body went through the digest, it is finalized below */
+            ctx->offload = 0;
+            ctx->hashing = 1;
+        }
+    }
+#endif
+
+    if (ctx->hashing) {
+        /* the body filter never saw last_buf, e.g. the body was empty */
+        ctx->hashing = 0;
+        if (ngx_aws_auth__payload_digest_final(r->pool, &ctx->digest) != NGX_OK) {
+            ctx->status = NGX_ERROR;
+        }
+    }
+
+    if (ctx->status == NGX_DONE) {
+        ctx->status = NGX_OK;
+    }
+
+    r->write_event_handler = ngx_http_core_run_phases;
+    ngx_http_core_run_phases(r);
+}
+
+/* The context of the request, made on first use. The template and the
+   epochs a request holds are kept there too, so it may exist before the
+   module takes the request on; ctx->started tells */
+static ngx_http_aws_auth_ctx_t *
+ngx_http_aws_auth_get_ctx(ngx_http_request_t *r) {
+    ngx_http_aws_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_aws_auth_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_aws_auth_ctx_t));
+        if (ctx == NULL) {
+            return NULL;
+        }
+        ngx_http_set_ctx(r, ctx, ngx_http_aws_auth_module);
+    }
+
+    return ctx;
+}
+
+static ngx_int_t
+ngx_http_aws_auth_read_body(ngx_http_request_t *r, ngx_http_aws_auth_conf_t *conf) {
+    ngx_int_t rc;
+    ngx_http_aws_auth_ctx_t *ctx;
+
+    ctx = ngx_http_aws_auth_get_ctx(r);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+    ctx->started = 1;
+
+    if (ngx_aws_auth__payload_digest_init(r->pool, &ctx->digest, conf->content_md5) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* the digest is computed by ngx_http_aws_auth_body_filter as the body
+       is read; the access phase resumes in ngx_http_aws_auth_body_handler */
+    ctx->status = NGX_DONE;
+    ctx->hashing = 1;
+
+#if (NGX_THREADS)
+    if (conf->hash_thread_pool != NULL
+        && (r->headers_in.content_length_n < 0
+            || (size_t) r->headers_in.content_length_n >= conf->hash_thread_min_size)) {
+        /* large bodies are hashed in a thread as they are read, so other
+           requests on this worker are not held up meanwhile */
+        ctx->hashing = 0;
+        ctx->offload = 1;
+        ctx->hash_last = &ctx->hash_in;
+    }
+#endif
+
+    rc = ngx_http_read_client_request_body(r, ngx_http_aws_auth_body_handler);
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        return rc;
+    }
+
+    ngx_http_finalize_request(r, NGX_DONE);
+    return NGX_DONE;
+}
+
+static ngx_http_aws_auth_key_node_t *
+ngx_http_aws_auth_key_lookup(ngx_http_aws_auth_key_cache_t *cache, const u_char *id, uint32_t hash) {
+    ngx_int_t rc;
+    ngx_rbtree_node_t *node, *sentinel;
+    ngx_http_aws_auth_key_node_t *kn;
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+        if (hash != node->key) {
+            node = (hash < node->key) ? node->left : node->right;
+            continue;
+        }
+
+        kn = (ngx_http_aws_auth_key_node_t *) node;
+        rc = ngx_memcmp(id, kn->id, NGX_AWS_AUTH__SHA256_HEX_LENGTH);
+        if (rc == 0) {
+            return kn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+static void
+ngx_http_aws_auth_key_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+                                          ngx_rbtree_node_t *sentinel) {
+    ngx_rbtree_node_t **p;
+    ngx_http_aws_auth_key_node_t *kn, *knt;
+
+    for (;;) {
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else {
+            kn = (ngx_http_aws_auth_key_node_t *) node;
+            knt = (ngx_http_aws_auth_key_node_t *) temp;
+            p = (ngx_memcmp(kn->id, knt->id, NGX_AWS_AUTH__SHA256_HEX_LENGTH) < 0) ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+/* called with the zone locked; when the zone is full the least recently
+   used keys make room, they are from past days more often than not */
+static void *
+ngx_http_aws_auth_key_alloc(ngx_http_aws_auth_key_cache_t *cache, size_t size) {
+    void *p;
+    ngx_queue_t *q;
+    ngx_http_aws_auth_key_node_t *kn;
+
+    for (;;) {
+        p = ngx_slab_alloc_locked(cache->shpool, size);
+        if (p != NULL) {
+            return p;
+        }
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            return NULL;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+        ngx_queue_remove(q);
+        kn = ngx_queue_data(q, ngx_http_aws_auth_key_node_t, queue);
+        ngx_rbtree_delete(&cache->sh->rbtree, &kn->node);
+        ngx_slab_free_locked(cache->shpool, kn);
+    }
+}
+
+static void
+ngx_http_aws_auth_key_insert(ngx_http_aws_auth_key_cache_t *cache, const u_char *id, uint32_t hash,
+                             const ngx_aws_auth_key_epoch_t *epoch) {
+    ngx_http_aws_auth_key_node_t *kn;
+
+    kn = ngx_http_aws_auth_key_alloc(cache, offsetof(ngx_http_aws_auth_key_node_t, data)
+                                            + epoch->signing_key.len + epoch->key_scope.len);
+    if (kn == NULL) {
+        return;
+    }
+
+    kn->node.key = hash;
+    ngx_memcpy(kn->id, id, NGX_AWS_AUTH__SHA256_HEX_LENGTH);
+    kn->key_len = (u_short) epoch->signing_key.len;
+    kn->scope_len = (u_short) epoch->key_scope.len;
+    ngx_memcpy(kn->data, epoch->signing_key.data, kn->key_len);
+    ngx_memcpy(kn->data + kn->key_len, epoch->key_scope.data, kn->scope_len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &kn->node);
+    ngx_queue_insert_head(&cache->sh->queue, &kn->queue);
+}
+
+/* the epoch for the UTC day of `when`, from aws_signing_key_zone if
+   another worker or the previous cycle derived it already */
+static ngx_aws_auth_key_epoch_t *
+ngx_http_aws_auth_build_epoch(ngx_pool_t *pool, ngx_http_aws_auth_conf_t *conf, time_t when) {
+    uint32_t hash;
+    u_char id[NGX_AWS_AUTH__SHA256_HEX_LENGTH];
+    const ngx_str_t *dateTimeStamp;
+    ngx_str_t key, scope;
+    ngx_aws_auth_key_epoch_t *epoch;
+    ngx_http_aws_auth_key_node_t *kn;
+    ngx_http_aws_auth_key_cache_t *cache;
+
+    if (conf->key_zone == NULL) {
+        return ngx_aws_auth__derive_key_epoch(pool, conf, when);
+    }
+
+    dateTimeStamp = ngx_aws_auth__compute_request_time(pool, &when);
+    if (ngx_aws_auth__signing_key_id(pool, conf, dateTimeStamp->data, id) != NGX_OK) {
+        return NULL;
+    }
+
+    hash = ngx_crc32_short(id, NGX_AWS_AUTH__SHA256_HEX_LENGTH);
+    cache = conf->key_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    kn = ngx_http_aws_auth_key_lookup(cache, id, hash);
+    if (kn != NULL) {
+        ngx_queue_remove(&kn->queue);
+        ngx_queue_insert_head(&cache->sh->queue, &kn->queue);
+
+        key.data = kn->data;
+        key.len = kn->key_len;
+        scope.data = kn->data + kn->key_len;
+        scope.len = kn->scope_len;
+        epoch = ngx_aws_auth__make_key_epoch(pool, &key, &scope, when);
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return epoch;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    /* derived outside of the lock, a worker racing us for the same key
+       just finds it already there */
+    epoch = ngx_aws_auth__derive_key_epoch(pool, conf, when);
+    if (epoch == NULL) {
+        return NULL;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (ngx_http_aws_auth_key_lookup(cache, id, hash) == NULL) {
+        ngx_http_aws_auth_key_insert(cache, id, hash, epoch);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return epoch;
+}
+
+/* epochs built after fork get a pool of their own so they can be released */
+static ngx_aws_auth_key_epoch_t *
+ngx_http_aws_auth_new_epoch(ngx_http_aws_auth_conf_t *conf, time_t when, ngx_log_t *log) {
+    ngx_pool_t *pool;
+    ngx_aws_auth_key_epoch_t *epoch;
+
+    pool = ngx_create_pool(AWS_KEY_EPOCH_POOL_SIZE, log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    epoch = ngx_http_aws_auth_build_epoch(pool, conf, when);
+    if (epoch == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    epoch->pool = pool;
+    return epoch;
+}
+
+/* retires the epoch, its pool is destroyed once no request holds it */
+static void
+ngx_http_aws_auth_release_epoch(ngx_aws_auth_key_epoch_t *epoch) {
+    if (epoch == NULL || epoch->pool == NULL) {
+        return;
+    }
+
+    epoch->retired = 1;
+    if (epoch->refs == 0) {
+        ngx_destroy_pool(epoch->pool);
+    }
+}
+
+static void
+ngx_http_aws_auth_epochs_cleanup(void *data) {
+    ngx_array_t *epochs = data;
+    ngx_aws_auth_key_epoch_t **held = epochs->elts;
+    ngx_uint_t i;
+
+    for (i = 0; i < epochs->nelts; i++) {
+        if (--held[i]->refs == 0 && held[i]->retired) {
+            ngx_destroy_pool(held[i]->pool);
+        }
+    }
+}
+
+/* Keeps the epoch for as long as the request pool: the batch, the chunk
+   signer and the subrequests of a request use its key long after it was
+   picked, maybe past the rotation that retires it. A request spans few
+   epochs, the main one holds them for its subrequests too */
+static ngx_int_t
+ngx_http_aws_auth_hold_epoch(ngx_http_request_t *r, ngx_aws_auth_key_epoch_t *epoch) {
+    ngx_http_aws_auth_ctx_t *ctx;
+    ngx_aws_auth_key_epoch_t **held;
+    ngx_pool_cleanup_t *cln;
+    ngx_uint_t i;
+
+    if (epoch->pool == NULL) {
+        return NGX_OK;
+    }
+
+    r = r->main;
+
+    ctx = ngx_http_aws_auth_get_ctx(r);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->epochs == NULL) {
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->epochs = ngx_array_create(r->pool, 2, sizeof(ngx_aws_auth_key_epoch_t *));
+        if (ctx->epochs == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_http_aws_auth_epochs_cleanup;
+        cln->data = ctx->epochs;
+    }
+
+    held = ctx->epochs->elts;
+    for (i = 0; i < ctx->epochs->nelts; i++) {
+        if (held[i] == epoch) {
+            return NGX_OK;
+        }
+    }
+
+    held = ngx_array_push(ctx->epochs);
+    if (held == NULL) {
+        return NGX_ERROR;
+    }
+
+    *held = epoch;
+    epoch->refs++;
+
+    return NGX_OK;
+}
+
+/* Makes the epoch covering `now` current. The epoch it replaces is kept as
+   prev_epoch until the next rotation, a day later, for the requests that
+   started before midnight; those holding it keep it until they are done */
+static ngx_aws_auth_key_epoch_t *
+ngx_http_aws_auth_rotate(ngx_http_aws_auth_conf_t *conf, time_t now, ngx_log_t *log) {
+    ngx_aws_auth_key_epoch_t *epoch = conf->next_epoch;
+
+    if (epoch == NULL || now < epoch->valid_from || now >= epoch->valid_until) {
+        epoch = ngx_http_aws_auth_new_epoch(conf, now, log);
+        if (epoch == NULL) {
+            return NULL;
+        }
+
+        /* a next epoch that never became current was never handed out */
+        ngx_http_aws_auth_release_epoch(conf->next_epoch);
+    }
+
+    ngx_http_aws_auth_release_epoch(conf->prev_epoch);
+    conf->prev_epoch = conf->epoch;
+    conf->epoch = epoch;
+    conf->next_epoch = NULL;
+
+    return epoch;
+}
+
+/* The epoch to sign as of `when` with, held by the request */
+static ngx_aws_auth_key_epoch_t *
+ngx_http_aws_auth_epoch(ngx_http_request_t *r, ngx_http_aws_auth_conf_t *conf, time_t when) {
+    ngx_aws_auth_key_epoch_t *epoch;
+
+    epoch = ngx_aws_auth__find_epoch(conf, when);
+
+    if (epoch == NULL && when >= conf->epoch->valid_until) {
+        /* only when the rotation timer has not caught up with midnight yet */
+        epoch = ngx_http_aws_auth_rotate(conf, when, r->connection->log);
+
+    } else if (epoch == NULL) {
+        /* never rotated back to: that would retire the epoch the timer made
+           current while the requests of today still sign with it */
+        return ngx_http_aws_auth_build_epoch(r->pool, conf, when);
+    }
+
+    if (epoch == NULL || ngx_http_aws_auth_hold_epoch(r, epoch) != NGX_OK) {
+        return NULL;
+    }
+
+    return epoch;
+}
+
+static void
+ngx_http_aws_auth_rotate_handler(ngx_event_t *ev) {
+    ngx_http_aws_auth_main_conf_t *amcf = ev->data;
+    ngx_http_aws_auth_conf_t **confp, *conf;
+    time_t now, midnight;
+    ngx_uint_t i;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    now = ngx_time();
+    midnight = now - now % AWS_KEY_EPOCH_SECONDS + AWS_KEY_EPOCH_SECONDS;
+
+    confp = amcf->confs.elts;
+    for (i = 0; i < amcf->confs.nelts; i++) {
+        conf = confp[i];
+
+        if (now >= conf->epoch->valid_until) {
+            (void) ngx_http_aws_auth_rotate(conf, now, ev->log);
+        }
+
+        if (conf->next_epoch == NULL && now >= midnight - AWS_KEY_PREROTATE_LEAD
+            && conf->epoch->valid_until <= midnight) {
+            /* on failure the request path derives it after midnight */
+            conf->next_epoch = ngx_http_aws_auth_new_epoch(conf, midnight, ev->log);
+        }
+    }
+
+    if (now < midnight - AWS_KEY_PREROTATE_LEAD) {
+        ngx_add_timer(ev, (midnight - AWS_KEY_PREROTATE_LEAD - now) * 1000);
+
+    } else {
+        ngx_add_timer(ev, (midnight - now) * 1000);
+    }
+}
+
+static ngx_int_t
+ngx_http_aws_auth_init_process(ngx_cycle_t *cycle) {
+    ngx_http_aws_auth_main_conf_t *amcf;
+    ngx_event_t *ev = &ngx_http_aws_auth_rotate_event;
+
+    amcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_aws_auth_module);
+    if (amcf == NULL || (amcf->confs.nelts == 0 && amcf->access_keys.root == amcf->access_keys.sentinel)) {
+        return NGX_OK;
+    }
+
+    if (ngx_aws_auth__crypto_init() != NGX_OK) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "aws auth crypto initialization failed");
+        return NGX_ERROR;
+    }
+
+    ev->handler = ngx_http_aws_auth_rotate_handler;
+    ev->data = amcf;
+    ev->log = cycle->log;
+    ev->cancelable = 1;
+
+    ngx_queue_init(&ngx_http_aws_auth_batch.queue);
+    ngx_http_aws_auth_batch.event.handler = ngx_http_aws_auth_batch_handler;
+    ngx_http_aws_auth_batch.event.data = &ngx_http_aws_auth_batch;
+    ngx_http_aws_auth_batch.event.log = cycle->log;
+
+    /* the configuration may be older than today, e.g. a respawned worker */
+    ngx_http_aws_auth_rotate_handler(ev);
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_aws_auth_init_key_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_http_aws_auth_key_cache_t *ocache = data;
+    ngx_http_aws_auth_key_cache_t *cache = shm_zone->data;
+    ngx_http_aws_auth_conf_t **confp;
+    ngx_uint_t i;
+    time_t now;
+    size_t len;
+
+    if (ocache) {
+        /* reload, the keys of the previous cycle are still good */
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+
+    } else {
+        cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+        if (shm_zone->shm.exists) {
+            cache->sh = cache->shpool->data;
+            return NGX_OK;
+        }
+
+        cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_aws_auth_key_shctx_t));
+        if (cache->sh == NULL) {
+            return NGX_ERROR;
+        }
+
+        cache->shpool->data = cache->sh;
+
+        ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                        ngx_http_aws_auth_key_rbtree_insert_value);
+        ngx_queue_init(&cache->sh->queue);
+
+        len = sizeof(" in aws signing key zone \"\"") + shm_zone->shm.name.len;
+
+        cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+        if (cache->shpool->log_ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_sprintf(cache->shpool->log_ctx, " in aws signing key zone \"%V\"%Z", &shm_zone->shm.name);
+    }
+
+    /* fill in the locations configured with this zone */
+    time(&now);
+    confp = cache->confs->elts;
+    for (i = 0; i < cache->confs->nelts; i++) {
+        confp[i]->epoch = ngx_http_aws_auth_build_epoch(cache->pool, confp[i], now);
+        if (confp[i]->epoch == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_aws_auth_push_headers(ngx_http_request_t *r, const ngx_array_t *headers_out) {
+    header_pair_t *hv;
+    ngx_uint_t i;
+
+    for (i = 0; i < headers_out->nelts; i++) {
+        hv = (header_pair_t *) ((u_char *) headers_out->elts + headers_out->size * i);
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "header name %V, value %V", &hv->key, &hv->value);
+
+        if (ngx_http_aws_auth_push_header(r, &hv->key, &hv->value) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/* keeps a bucket's template in aws_s3_bucket_cache, the least recently
+   used one makes room when it is full. Only a cache: if memory runs out the
+   template is compiled again next time */
+static void
+ngx_http_aws_auth_bucket_store(ngx_http_request_t *r, ngx_http_aws_auth_conf_t *conf, const ngx_str_t *bucket,
+                               uint32_t hash, const ngx_aws_auth_template_t *tpl) {
+    ngx_http_aws_auth_memo_t *cache = conf->bucket_memo;
+    ngx_http_aws_auth_bucket_node_t *bn;
+    u_char *p;
+
+    if (cache == NULL) {
+        cache = ngx_alloc(sizeof(ngx_http_aws_auth_memo_t), r->connection->log);
+        if (cache == NULL) {
+            return;
+        }
+
+        ngx_rbtree_init(&cache->rbtree, &cache->sentinel, ngx_str_rbtree_insert_value);
+        ngx_queue_init(&cache->queue);
+        cache->n = 0;
+        conf->bucket_memo = cache;
+    }
+
+    if (cache->n >= (ngx_uint_t) conf->bucket_cache) {
+        bn = ngx_queue_data(ngx_queue_last(&cache->queue), ngx_http_aws_auth_bucket_node_t, queue);
+        ngx_rbtree_delete(&cache->rbtree, &bn->sn.node);
+        ngx_queue_remove(&bn->queue);
+        ngx_free(bn);
+        cache->n--;
+    }
+
+    bn = ngx_alloc(sizeof(ngx_http_aws_auth_bucket_node_t) + bucket->len + ngx_aws_auth__template_size(tpl),
+                   r->connection->log);
+    if (bn == NULL) {
+        return;
+    }
+
+    p = (u_char *) (bn + 1);
+    bn->sn.node.key = hash;
+    bn->sn.str.data = p;
+    bn->sn.str.len = bucket->len;
+    p = ngx_cpymem(p, bucket->data, bucket->len);
+    ngx_aws_auth__copy_template(&bn->tpl, tpl, p);
+
+    ngx_rbtree_insert(&cache->rbtree, &bn->sn.node);
+    ngx_queue_insert_head(&cache->queue, &bn->queue);
+    cache->n++;
+}
+
+/* The template of the request's bucket, for an aws_s3_bucket with variables.
+   It is taken from aws_s3_bucket_cache, or compiled and kept there; it is
+   copied into the request, as the entry may be evicted while the request
+   still needs its strings */
+static const ngx_aws_auth_template_t *
+ngx_http_aws_auth_resolve_template(ngx_http_request_t *r, ngx_http_aws_auth_conf_t *conf) {
+    ngx_http_aws_auth_memo_t *cache = conf->bucket_memo;
+    ngx_http_aws_auth_bucket_node_t *bn;
+    ngx_aws_auth_template_t *tpl;
+    ngx_str_t bucket;
+    uint32_t hash;
+    u_char *p;
+
+    if (ngx_http_complex_value(r, conf->bucket_value, &bucket) != NGX_OK) {
+        return NULL;
+    }
+
+    if (bucket.len == 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "aws_s3_bucket is empty for \"%V\"", &r->uri);
+        return NULL;
+    }
+
+    tpl = ngx_palloc(r->pool, sizeof(ngx_aws_auth_template_t));
+    if (tpl == NULL) {
+        return NULL;
+    }
+
+    hash = ngx_crc32_long(bucket.data, bucket.len);
+
+    bn = (cache != NULL) ? (ngx_http_aws_auth_bucket_node_t *) ngx_str_rbtree_lookup(&cache->rbtree, &bucket, hash)
+                         : NULL;
+    if (bn != NULL) {
+        ngx_queue_remove(&bn->queue);
+        ngx_queue_insert_head(&cache->queue, &bn->queue);
+
+        p = ngx_pnalloc(r->pool, ngx_aws_auth__template_size(&bn->tpl));
+        if (p == NULL) {
+            return NULL;
+        }
+        ngx_aws_auth__copy_template(tpl, &bn->tpl, p);
+
+        return tpl;
+    }
+
+    if (ngx_aws_auth__compile_template(r->pool, tpl, &conf->access_key, &bucket, &conf->endpoint) != NGX_OK) {
+        return NULL;
+    }
+    tpl->time_bucket = conf->time_bucket;
+
+    if (conf->bucket_cache) {
+        ngx_http_aws_auth_bucket_store(r, conf, &bucket, hash, tpl);
+    }
+
+    return tpl;
+}
+
+/* The template of the request's bucket. One with variables is resolved for
+   the main request once, whichever of signing, aws_sign_cache and the
+   variables needs it first */
+static const ngx_aws_auth_template_t *
+ngx_http_aws_auth_template(ngx_http_request_t *r, ngx_http_aws_auth_conf_t *conf) {
+    ngx_http_aws_auth_ctx_t *ctx;
+
+    if (conf->bucket_value == NULL) {
+        return &conf->sign_template;
+    }
+
+    r = r->main;
+
+    ctx = ngx_http_aws_auth_get_ctx(r);
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    if (ctx->tpl == NULL || ctx->tpl_conf != conf) {
+        ctx->tpl = ngx_http_aws_auth_resolve_template(r, conf);
+        ctx->tpl_conf = conf;
+    }
+
+    return ctx->tpl;
+}
+
+/* what aws_sign_cache knows a request by, the host and URI being those
+   signed */
+static ngx_int_t
+ngx_http_aws_auth_memo_key(ngx_http_request_t *r, ngx_http_aws_auth_conf_t *conf, ngx_str_t *key) {
+    const ngx_aws_auth_template_t *tpl;
+    ngx_str_t uri;
+    u_char *p;
+
+    tpl = ngx_http_aws_auth_template(r, conf);
+    if (tpl == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_aws_auth__raw_url(r, &uri);
+
+    key->len = r->method_name.len + 1 + tpl->host.len + uri.len + 1 + r->args.len;
+    key->data = ngx_pnalloc(r->pool, key->len);
+    if (key->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(key->data, r->method_name.data, r->method_name.len);
+    *p++ = ' ';
+    p = ngx_cpymem(p, tpl->host.data, tpl->host.len);
+    p = ngx_cpymem(p, uri.data, uri.len);
+    *p++ = '?';
+    ngx_memcpy(p, r->args.data, r->args.len);
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_aws_auth_memo_remove(ngx_http_aws_auth_memo_t *memo, ngx_http_aws_auth_memo_node_t *mn) {
+    ngx_rbtree_delete(&memo->rbtree, &mn->sn.node);
+    ngx_queue_remove(&mn->queue);
+    ngx_free(mn);
+    memo->n--;
+}
+
+/* pushes the headers aws_sign_cache has for the request, NGX_DECLINED if
+   there are none or the date or signing key moved on since */
+static ngx_int_t
+ngx_http_aws_auth_memo_lookup(ngx_http_request_t *r, ngx_http_aws_auth_conf_t *conf) {
+    ngx_http_aws_auth_memo_t *memo = conf->sign_memo;
+    ngx_http_aws_auth_memo_node_t *mn;
+    ngx_aws_auth_key_epoch_t *epoch;
+    ngx_str_t key, name, value;
+    ngx_uint_t i;
+    size_t size;
+    u_char *p;
+
+    if (memo == NULL || memo->n == 0) {
+        return NGX_DECLINED;
+    }
+
+    epoch = ngx_http_aws_auth_epoch(r, conf, r->start_sec);
+    if (epoch == NULL || ngx_http_aws_auth_memo_key(r, conf, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    mn = (ngx_http_aws_auth_memo_node_t *) ngx_str_rbtree_lookup(&memo->rbtree, &key,
+                                                                  ngx_crc32_long(key.data, key.len));
+    if (mn == NULL || mn->hmac_key != epoch->hmac_key
+        || mn->date != ngx_aws_auth__signing_time(&conf->sign_template, r->start_sec)) {
+        return NGX_DECLINED;
+    }
+
+    ngx_queue_remove(&mn->queue);
+    ngx_queue_insert_head(&memo->queue, &mn->queue);
+
+    /* copied, the entry may be evicted while the request still needs them */
+    for (i = 0, size = 0; i < mn->nheaders; i++) {
+        size += mn->headers[i].key.len + mn->headers[i].value.len;
+    }
+
+    p = ngx_pnalloc(r->pool, size);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < mn->nheaders; i++) {
+        name.data = p;
+        name.len = mn->headers[i].key.len;
+        p = ngx_cpymem(p, mn->headers[i].key.data, name.len);
+        value.data = p;
+        value.len = mn->headers[i].value.len;
+        p = ngx_cpymem(p, mn->headers[i].value.data, value.len);
+
+        if (ngx_http_aws_auth_push_header(r, &name, &value) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/* keeps the headers just signed for the request in aws_sign_cache, the
+   least recently used entry makes room when it is full. Only a cache: if
+   memory runs out the headers are just not kept */
+static void
+ngx_http_aws_auth_memo_store(ngx_http_request_t *r, ngx_http_aws_auth_conf_t *conf,
+                             const ngx_aws_auth__hmac_key_t *hmac_key, const ngx_array_t *headers_out) {
+    ngx_http_aws_auth_memo_t *memo = conf->sign_memo;
+    ngx_http_aws_auth_memo_node_t *mn;
+    header_pair_t *hv;
+    ngx_str_t key;
+    ngx_uint_t i;
+    uint32_t hash;
+    size_t size;
+    u_char *p;
+
+    if (memo == NULL) {
+        memo = ngx_alloc(sizeof(ngx_http_aws_auth_memo_t), r->connection->log);
+        if (memo == NULL) {
+            return;
+        }
+
+        ngx_rbtree_init(&memo->rbtree, &memo->sentinel, ngx_str_rbtree_insert_value);
+        ngx_queue_init(&memo->queue);
+        memo->n = 0;
+        conf->sign_memo = memo;
+    }
+
+    if (ngx_http_aws_auth_memo_key(r, conf, &key) != NGX_OK) {
+        return;
+    }
+    hash = ngx_crc32_long(key.data, key.len);
+
+    mn = (ngx_http_aws_auth_memo_node_t *) ngx_str_rbtree_lookup(&memo->rbtree, &key, hash);
+    if (mn != NULL) {
+        ngx_http_aws_auth_memo_remove(memo, mn);
+
+    } else if (memo->n >= (ngx_uint_t) conf->sign_cache) {
+        ngx_http_aws_auth_memo_remove(memo, ngx_queue_data(ngx_queue_last(&memo->queue),
+                                                           ngx_http_aws_auth_memo_node_t, queue));
+    }
+
+    hv = headers_out->elts;
+    size = offsetof(ngx_http_aws_auth_memo_node_t, headers) + headers_out->nelts * sizeof(header_pair_t) + key.len;
+    for (i = 0; i < headers_out->nelts; i++) {
+        size += hv[i].key.len + hv[i].value.len;
+    }
+
+    mn = ngx_alloc(size, r->connection->log);
+    if (mn == NULL) {
+        return;
+    }
+
+    p = (u_char *) &mn->headers[headers_out->nelts];
+    mn->sn.node.key = hash;
+    mn->sn.str.data = p;
+    mn->sn.str.len = key.len;
+    p = ngx_cpymem(p, key.data, key.len);
+
+    for (i = 0; i < headers_out->nelts; i++) {
+        mn->headers[i].key.data = p;
+        mn->headers[i].key.len = hv[i].key.len;
+        p = ngx_cpymem(p, hv[i].key.data, hv[i].key.len);
+        mn->headers[i].value.data = p;
+        mn->headers[i].value.len = hv[i].value.len;
+        p = ngx_cpymem(p, hv[i].value.data, hv[i].value.len);
+    }
+    mn->nheaders = headers_out->nelts;
+    mn->hmac_key = hmac_key;
+    mn->date = ngx_aws_auth__signing_time(&conf->sign_template, r->start_sec);
+
+    ngx_rbtree_insert(&memo->rbtree, &mn->sn.node);
+    ngx_queue_insert_head(&memo->queue, &mn->queue);
+    memo->n++;
+}
+
+/* The time a request is signed as of: when it came in, or when its body
+   was read for one signed only then */
+static time_t
+ngx_http_aws_auth_sign_time(ngx_http_request_t *r) {
+    ngx_http_aws_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_aws_auth_module);
+
+    return (ctx != NULL && ctx->sign_time) ? ctx->sign_time : r->start_sec;
+}
+
+/* The request to sign as of `when`, the signer dating requests from their
+   start_sec; a copy of it in `dated` unless that is when it came in */
+static ngx_http_request_t *
+ngx_http_aws_auth_dated_request(ngx_http_request_t *r, time_t when, ngx_http_request_t *dated) {
+    if (when == r->start_sec) {
+        return r;
+    }
+
+    *dated = *r;
+    dated->start_sec = when;
+
+    return dated;
+}
+
+static const ngx_array_t *
+ngx_http_aws_auth_sign_headers(ngx_http_request_t *r, ngx_http_aws_auth_conf_t *conf,
+                               const ngx_str_t *payload_hash, const ngx_array_t *extra_headers) {
+    const ngx_aws_auth_template_t *tpl;
+    ngx_aws_auth_key_epoch_t *epoch;
+    ngx_http_request_t dated;
+    time_t when;
+
+    when = ngx_http_aws_auth_sign_time(r);
+    epoch = ngx_http_aws_auth_epoch(r, conf, when);
+    tpl = ngx_http_aws_auth_template(r, conf);
+    if (epoch == NULL || tpl == NULL) {
+        return NULL;
+    }
+
+    /* the host header is controlled by the proxy pass directive, it is
+       signed but never part of headers_out */
+    const ngx_array_t *headers_out = ngx_aws_auth__sign_with_template(
+            r->pool, ngx_http_aws_auth_dated_request(r, when, &dated), tpl,
+            epoch->hmac_key, &epoch->key_scope, payload_hash, extra_headers);
+    if (headers_out == NULL || ngx_http_aws_auth_push_headers(r, headers_out) != NGX_OK) {
+        return NULL;
+    }
+
+    /* an epoch of the request's own is gone with it, never cached */
+    if (conf->sign_cache && payload_hash == NULL && extra_headers == NULL
+        && ngx_aws_auth__find_epoch(conf, when) == epoch) {
+        ngx_http_aws_auth_memo_store(r, conf, epoch->hmac_key, headers_out);
+    }
+
+    return headers_out;
+}
+
+/* The value of a header the client signed, those sent more than once joined
+   by commas; NGX_DECLINED if it was not sent at all */
+static ngx_int_t
+ngx_http_aws_auth_signed_header(ngx_http_request_t *r, const ngx_str_t *name, ngx_str_t *value) {
+    ngx_list_part_t *part;
+    ngx_table_elt_t *h;
+    ngx_uint_t i;
+    u_char *p;
+
+    value->len = 0;
+    value->data = NULL;
+
+    for (part = &r->headers_in.headers.part; part; part = part->next) {
+        h = part->elts;
+        for (i = 0; i < part->nelts; i++) {
+            if (h[i].key.len != name->len || ngx_strncmp(h[i].lowcase_key, name->data, name->len) != 0) {
+                continue;
+            }
+
+            if (value->data == NULL) {
+                *value = h[i].value;
+                continue;
+            }
+
+            p = ngx_pnalloc(r->pool, value->len + 1 + h[i].value.len);
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
+            ngx_memcpy(p, value->data, value->len);
+            p[value->len] = ',';
+            ngx_memcpy(p + value->len + 1, h[i].value.data, h[i].value.len);
+            value->data = p;
+            value->len += 1 + h[i].value.len;
+        }
+    }
+
+    return value->data != NULL ? NGX_OK : NGX_DECLINED;
+}
+
+/* whether the payload of the request is to be signed, GET and HEAD never
+   have one */
+static ngx_uint_t
+ngx_http_aws_auth_has_body(ngx_http_request_t *r) {
+    return !(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))
+           && (r->headers_in.content_length_n > 0 || r->headers_in.chunked);
+}
+
+static ngx_int_t
+ngx_http_aws_auth_check_payload_hash(ngx_http_request_t *r, const ngx_str_t *declared, const ngx_str_t *payload_hash) {
+    if (declared->len != payload_hash->len
+        || ngx_strncasecmp(declared->data, payload_hash->data, payload_hash->len) != 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "aws verify: x-amz-content-sha256 \"%V\" does not match the body", declared);
+        return NGX_HTTP_FORBIDDEN;
+    }
+
+    return NGX_OK;
+}
+
+/* Checks the signature the client computed for the request with the secret
+   of its aws_verify_key, as S3 would. The key derived for the credential's
+   scope is kept in aws_signing_key_zone like those we sign with, so each
+   access key costs one derivation a day whichever worker gets it */
+static ngx_int_t
+ngx_http_aws_auth_verify(ngx_http_request_t *r, ngx_http_aws_auth_conf_t *conf) {
+    ngx_http_aws_auth_main_conf_t *amcf = ngx_http_get_module_main_conf(r, ngx_http_aws_auth_module);
+    ngx_http_aws_auth_access_key_node_t *ak;
+    ngx_http_aws_auth_ctx_t *ctx;
+    ngx_aws_auth_credential_t cred;
+    ngx_http_aws_auth_conf_t scope;
+    ngx_aws_auth_key_epoch_t *epoch;
+    ngx_str_t name, value, amz_date, payload_hash;
+    ngx_array_t *extra_headers;
+    header_pair_t *hv;
+    u_char *p, *last;
+    time_t date;
+    ngx_int_t rc;
+
+    if (r->headers_in.authorization == NULL || r->headers_in.host == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "aws verify: request is not signed");
+        return NGX_HTTP_FORBIDDEN;
+    }
+
+    if (ngx_aws_auth__parse_authorization(&r->headers_in.authorization->value, &cred) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "aws verify: invalid authorization \"%V\"",
+                      &r->headers_in.authorization->value);
+        return NGX_HTTP_FORBIDDEN;
+    }
+
+    if ((conf->region.len && (cred.region.len != conf->region.len
+                              || ngx_strncmp(cred.region.data, conf->region.data, conf->region.len) != 0))
+        || cred.service.len != conf->service.len
+        || ngx_strncmp(cred.service.data, conf->service.data, conf->service.len) != 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "aws verify: credential scope \"%V\" not accepted",
+                      &cred.key_scope);
+        return NGX_HTTP_FORBIDDEN;
+    }
+
+    /* host, x-amz-content-sha256 and x-amz-date are passed on their own,
+       whether the client signed them is checked with the signature */
+    extra_headers = ngx_array_create(r->pool, 4, sizeof(header_pair_t));
+    if (extra_headers == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ngx_str_null(&amz_date);
+    ngx_str_null(&payload_hash);
+
+    last = cred.signed_header_names.data + cred.signed_header_names.len;
+    for (p = cred.signed_header_names.data; p < last; p = name.data + name.len + 1) {
+        name.data = p;
+        name.len = 0;
+        while (p + name.len < last && p[name.len] != ';') {
+            name.len++;
+        }
+
+        if (name.len == HOST_HEADER.len && ngx_strncmp(name.data, HOST_HEADER.data, name.len) == 0) {
+            continue;
+        }
+
+        rc = ngx_http_aws_auth_signed_header(r, &name, &value);
+        if (rc == NGX_ERROR) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        if (rc == NGX_DECLINED) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "aws verify: signed header \"%V\" missing", &name);
+            return NGX_HTTP_FORBIDDEN;
+        }
+
+        if (name.len == AMZ_DATE_HEADER.len && ngx_strncmp(name.data, AMZ_DATE_HEADER.data, name.len) == 0) {
+            amz_date = value;
+
+        } else if (name.len == AMZ_HASH_HEADER.len && ngx_strncmp(name.data, AMZ_HASH_HEADER.data, name.len) == 0) {
+            payload_hash = value;
+
+        } else {
+            hv = ngx_array_push(extra_headers);
+            if (hv == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+            hv->key = name;
+            hv->value = value;
+        }
+    }
+
+    date = ngx_aws_auth__parse_amz_date(&amz_date);
+    if (date == NGX_ERROR || payload_hash.len == 0
+        || ngx_strncmp(amz_date.data, cred.date.data, AMZ_DATE_WIDTH) != 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "aws verify: x-amz-date and x-amz-content-sha256 must be signed and match the credential");
+        return NGX_HTTP_FORBIDDEN;
+    }
+
+    if (date < r->start_sec - AWS_VERIFY_MAX_SKEW || date > r->start_sec + AWS_VERIFY_MAX_SKEW) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "aws verify: request time \"%V\" too skewed", &amz_date);
+        return NGX_HTTP_FORBIDDEN;
+    }
+
+    ak = (ngx_http_aws_auth_access_key_node_t *) ngx_str_rbtree_lookup(&amcf->access_keys, &cred.access_key,
+                                                                        ngx_crc32_long(cred.access_key.data,
+                                                                                       cred.access_key.len));
+    if (ak == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "aws verify: unknown access key \"%V\"",
+                      &cred.access_key);
+        return NGX_HTTP_FORBIDDEN;
+    }
+
+    /* the key derivation wants C strings */
+    ngx_memzero(&scope, sizeof(ngx_http_aws_auth_conf_t));
+    scope.secret_key = ak->secret_key;
+    scope.region.data = ngx_pnalloc(r->pool, cred.region.len + cred.service.len + 2);
+    if (scope.region.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    scope.region.len = cred.region.len;
+    scope.service.data = ngx_cpymem(scope.region.data, cred.region.data, cred.region.len);
+    *scope.service.data++ = '\0';
+    scope.service.len = cred.service.len;
+    *ngx_cpymem(scope.service.data, cred.service.data, cred.service.len) = '\0';
+    scope.key_zone = amcf->key_zone;
+
+    epoch = ngx_http_aws_auth_build_epoch(r->pool, &scope, date);
+    if (epoch == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rc = ngx_aws_auth__verify_signature(r->pool, r, &cred, &r->headers_in.host->value, &amz_date, &payload_hash,
+                                        extra_headers, &epoch->signing_key);
+    if (rc == NGX_ERROR) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    if (rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "aws verify: signature of access key \"%V\" does not match",
+                      &cred.access_key);
+        return NGX_HTTP_FORBIDDEN;
+    }
+
+    /* the signature covers the payload hash the client declared, not the
+       payload: unless it is UNSIGNED-PAYLOAD, the body is hashed to check
+       it, ngx_http_aws_auth_verify_payload compares them once it is read */
+    if (payload_hash.len == UNSIGNED_PAYLOAD_HASH.len
+        && ngx_strncmp(payload_hash.data, UNSIGNED_PAYLOAD_HASH.data, payload_hash.len) == 0) {
+        return NGX_OK;
+    }
+
+    if (!ngx_http_aws_auth_has_body(r)) {
+        return ngx_http_aws_auth_check_payload_hash(r, &payload_hash, &EMPTY_STRING_SHA256);
+    }
+
+    ctx = ngx_http_aws_auth_get_ctx(r);
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ctx->verify_hash = payload_hash;
+
+    return ngx_http_aws_auth_read_body(r, conf);
+}
+
+/* the body read for aws_verify against the x-amz-content-sha256 the client
+   signed */
+static ngx_int_t
+ngx_http_aws_auth_verify_payload(ngx_http_request_t *r, ngx_http_aws_auth_ctx_t *ctx) {
+    ngx_str_t verify_hash = ctx->verify_hash;
+
+    if (ctx->status != NGX_OK) {
+        return ctx->status;
+    }
+
+    /* the batch may bring the request back */
+    ngx_str_null(&ctx->verify_hash);
+
+    return ngx_http_aws_auth_check_payload_hash(r, &verify_hash, &ctx->digest.payload_hash);
+}
+
+/* the URL the request can be sent to without signing it here, S3 checks
+   the signature in its query string instead */
+static const ngx_str_t *
+ngx_http_aws_auth_presign(ngx_http_request_t *r, ngx_http_aws_auth_conf_t *conf) {
+    static const ngx_str_t scheme = ngx_string("https");
+    const ngx_aws_auth_template_t *tpl;
+    ngx_aws_auth_key_epoch_t *epoch;
+
+    epoch = ngx_http_aws_auth_epoch(r, conf, r->start_sec);
+    tpl = ngx_http_aws_auth_template(r, conf);
+    if (epoch == NULL || tpl == NULL) {
+        return NULL;
+    }
+
+    return ngx_aws_auth__presign_with_template(r->pool, r, tpl, epoch->hmac_key,
+                                               &epoch->key_scope, &scheme, conf->presign_expires);
+}
+
+static ngx_int_t
+ngx_http_aws_auth_presigned_url_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_aws_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_aws_auth_module);
+    const ngx_str_t *url;
+
+    if (!conf->enabled) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    url = ngx_http_aws_auth_presign(r, conf);
+    if (url == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->data = url->data;
+    v->len = url->len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+/* $aws_date, the x-amz-date the request is signed with */
+static ngx_int_t
+ngx_http_aws_auth_date_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_aws_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_aws_auth_module);
+    const ngx_str_t *date;
+    time_t when;
+
+    if (!conf->enabled) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    when = ngx_aws_auth__signing_time(&conf->sign_template, ngx_http_aws_auth_sign_time(r));
+    date = ngx_aws_auth__compute_request_time(r->pool, &when);
+    if (date == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->data = date->data;
+    v->len = date->len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+/* $s3_auth_token, the authorization header of the request. With
+   aws_sign lazy a request without a body is only signed here, once the
+   upstream request is built; otherwise it is the header the access phase
+   added */
+static ngx_int_t
+ngx_http_aws_auth_token_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_aws_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_aws_auth_module);
+    ngx_http_aws_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_aws_auth_module);
+    const ngx_aws_auth_template_t *tpl;
+    ngx_aws_auth_key_epoch_t *epoch;
+    const ngx_array_t *headers_out;
+    const header_pair_t *hv;
+    const ngx_str_t *token = NULL;
+    ngx_list_part_t *part;
+    ngx_table_elt_t *h;
+    ngx_uint_t i;
+
+    if (!conf->enabled) {
+        v->not_found = 1;
+        return NGX_OK;
+
+    } else if (conf->lazy && (ctx == NULL || !ctx->started) && !ngx_http_aws_auth_has_body(r)) {
+        epoch = ngx_http_aws_auth_epoch(r, conf, r->start_sec);
+        tpl = ngx_http_aws_auth_template(r, conf);
+        if (epoch == NULL || tpl == NULL) {
+            return NGX_ERROR;
+        }
+
+        headers_out = ngx_aws_auth__sign_with_template(r->pool, r, tpl, epoch->hmac_key,
+                                                       &epoch->key_scope, NULL, NULL);
+        if (headers_out == NULL) {
+            return NGX_ERROR;
+        }
+
+        hv = headers_out->elts;
+        for (i = 0; i < headers_out->nelts; i++) {
+            if (hv[i].key.len == AUTHZ_HEADER.len
+                && ngx_strncmp(hv[i].key.data, AUTHZ_HEADER.data, AUTHZ_HEADER.len) == 0) {
+                token = &hv[i].value;
+            }
+        }
+
+    } else {
+        /* pushed over the client's own, if it sent one */
+        for (part = &r->headers_in.headers.part; part && token == NULL; part = part->next) {
+            h = part->elts;
+            for (i = 0; i < part->nelts; i++) {
+                if (h[i].key.len == AUTHZ_HEADER.len
+                    && ngx_strncmp(h[i].lowcase_key, AUTHZ_HEADER.data, AUTHZ_HEADER.len) == 0) {
+                    token = &h[i].value;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (token == NULL) {
+        /* not signed, as subrequests are not unless lazily */
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->data = token->data;
+    v->len = token->len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+/* $aws_s3_host, the host signed for the request's bucket. Subrequests of
+   aws_fanout and aws_multipart take the bucket of their main request */
+static ngx_int_t
+ngx_http_aws_auth_host_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_aws_auth_conf_t *conf = ngx_http_get_module_loc_conf(r->main, ngx_http_aws_auth_module);
+    const ngx_aws_auth_template_t *tpl;
+
+    if (!conf->enabled) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    tpl = ngx_http_aws_auth_template(r->main, conf);
+    if (tpl == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->data = tpl->host.data;
+    v->len = tpl->host.len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+/* $aws_subrequest_auth_token, $aws_subrequest_date, $aws_part_range and
+   $aws_content_sha256, headers of a subrequest signed by its main request;
+   data is their offset in ngx_http_aws_auth_subrequest_t */
+static ngx_int_t
+ngx_http_aws_auth_subrequest_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_aws_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_aws_auth_module);
+    ngx_str_t *value;
+
+    if (ctx == NULL || ctx->sub == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    value = (ngx_str_t *) ((u_char *) ctx->sub + data);
+    if (value->len == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->data = value->data;
+    v->len = value->len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+/* answers GET and HEAD with a redirect to their presigned URL, the body
+   then comes straight from S3 rather than through this server */
+static ngx_int_t
+ngx_http_aws_auth_redirect(ngx_http_request_t *r, ngx_http_aws_auth_conf_t *conf) {
+    static const ngx_str_t location = ngx_string("Location");
+    const ngx_str_t *url;
+    ngx_table_elt_t *h;
+
+    url = ngx_http_aws_auth_presign(r, conf);
+    if (url == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    h->hash = 1;
+    h->key = location;
+    h->value = *url;
+
+    ngx_http_clear_location(r);
+    r->headers_out.location = h;
+
+    return NGX_HTTP_MOVED_TEMPORARILY;
+}
+
+/* Signs what a subrequest of r sends S3: r's URI with a method, query
+   string and payload of its own, dated now rather than when r came in as
+   the subrequest may be made long after */
+static ngx_int_t
+ngx_http_aws_auth_sign_subrequest(ngx_http_request_t *r, ngx_http_aws_auth_conf_t *conf, const ngx_str_t *method,
+                                  const ngx_str_t *args, const ngx_str_t *payload_hash,
+                                  const ngx_array_t *extra_headers, ngx_http_aws_auth_subrequest_t *sub) {
+    ngx_http_request_t req;
+    const ngx_aws_auth_template_t *tpl;
+    ngx_aws_auth_key_epoch_t *epoch;
+    const ngx_array_t *headers_out;
+    const header_pair_t *hv;
+    ngx_uint_t i;
+    u_char *p;
+
+    ngx_memzero(&req, sizeof(ngx_http_request_t));
+    req.connection = r->connection;
+    req.pool = r->pool;
+    req.method_name = *method;
+    req.uri = r->uri;
+    req.start_sec = ngx_time();
+
+    if (args->len) {
+        /* a path followed by a query string is taken from the request line */
+        p = ngx_pnalloc(r->pool, r->uri.len + 1 + args->len);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        req.uri_start = p;
+        p = ngx_cpymem(p, r->uri.data, r->uri.len);
+        *p++ = '?';
+        req.args_start = p;
+        req.args.data = p;
+        req.args.len = args->len;
+        ngx_memcpy(p, args->data, args->len);
+    }
+
+    epoch = ngx_http_aws_auth_epoch(r, conf, req.start_sec);
+    tpl = ngx_http_aws_auth_template(r, conf);
+    if (epoch == NULL || tpl == NULL) {
+        return NGX_ERROR;
+    }
+
+    headers_out = ngx_aws_auth__sign_with_template(r->pool, &req, tpl, epoch->hmac_key,
+                                                   &epoch->key_scope, payload_hash, extra_headers);
+    if (headers_out == NULL) {
+        return NGX_ERROR;
+    }
+
+    hv = headers_out->elts;
+    for (i = 0; i < headers_out->nelts; i++) {
+        if (hv[i].key.len == AMZ_DATE_HEADER.len
+            && ngx_strncmp(hv[i].key.data, AMZ_DATE_HEADER.data, AMZ_DATE_HEADER.len) == 0) {
+            sub->date = hv[i].value;
+        } else if (hv[i].key.len == AMZ_HASH_HEADER.len
+                   && ngx_strncmp(hv[i].key.data, AMZ_HASH_HEADER.data, AMZ_HASH_HEADER.len) == 0) {
+            sub->payload_hash = hv[i].value;
+        } else if (hv[i].key.len == AUTHZ_HEADER.len
+                   && ngx_strncmp(hv[i].key.data, AUTHZ_HEADER.data, AUTHZ_HEADER.len) == 0) {
+            sub->token = hv[i].value;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/* the URI of the subrequests of r: the prefix of their location, then r's */
+static ngx_int_t
+ngx_http_aws_auth_subrequest_uri(ngx_http_request_t *r, const ngx_str_t *prefix, ngx_str_t *uri) {
+    uri->len = prefix->len + r->uri.len;
+    uri->data = ngx_pnalloc(r->pool, uri->len);
+    if (uri->data == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_memcpy(ngx_cpymem(uri->data, prefix->data, prefix->len), r->uri.data, r->uri.len);
+
+    return NGX_OK;
+}
+
+/* requests the next range of a fanned out GET */
+static ngx_int_t
+ngx_http_aws_auth_fanout_part(ngx_http_aws_auth_fanout_t *f) {
+    static ngx_str_t range_header = ngx_string("range");
+    ngx_http_request_t *r = f->request, *sr;
+    ngx_http_post_subrequest_t *ps;
+    ngx_http_aws_auth_part_t *part;
+    ngx_http_aws_auth_ctx_t *ctx;
+    ngx_array_t *extra_headers;
+    header_pair_t *hv;
+    off_t last;
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_aws_auth_ctx_t));
+    part = ngx_pcalloc(r->pool, sizeof(ngx_http_aws_auth_part_t));
+    ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+    extra_headers = ngx_array_create(r->pool, 1, sizeof(header_pair_t));
+    if (ctx == NULL || part == NULL || ps == NULL || extra_headers == NULL) {
+        return NGX_ERROR;
+    }
+    ctx->started = 1;
+
+    part->fanout = f;
+    part->index = f->next;
+    part->first = (off_t) part->index * f->conf->fanout_part_size;
+    last = part->first + f->conf->fanout_part_size - 1;
+    if (f->nparts != 0 && last >= f->size) {
+        last = f->size - 1;
+    }
+
+    part->sub.range.data = ngx_pnalloc(r->pool, sizeof("bytes=-") - 1 + 2 * NGX_OFF_T_LEN);
+    if (part->sub.range.data == NULL) {
+        return NGX_ERROR;
+    }
+    part->sub.range.len = ngx_sprintf(part->sub.range.data, "bytes=%O-%O", part->first, last)
+                          - part->sub.range.data;
+
+    hv = ngx_array_push(extra_headers);
+    if (hv == NULL) {
+        return NGX_ERROR;
+    }
+    hv->key = range_header;
+    hv->value = part->sub.range;
+
+    if (ngx_http_aws_auth_sign_subrequest(r, f->conf, &r->method_name, &r->args, NULL, extra_headers,
+                                          &part->sub) != NGX_OK) {
+        return NGX_ERROR;
+    }
+    ctx->sub = &part->sub;
+    ctx->part = part;
+
+    ps->handler = ngx_http_aws_auth_fanout_done;
+    ps->data = part;
+
+    if (ngx_http_subrequest(r, &f->uri, &r->args, &sr, ps, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+    ngx_http_set_ctx(sr, ctx, ngx_http_aws_auth_module);
+
+    f->next++;
+    f->active++;
+
+    return NGX_OK;
+}
+
+/* keeps fanout_parallel ranges in flight; their output is passed on in the
+   order they were requested whichever arrives first, so at most that many
+   are held back. The main request ends after the last one */
+static ngx_int_t
+ngx_http_aws_auth_fanout_next(ngx_http_aws_auth_fanout_t *f) {
+    while (f->next < f->nparts && f->active < f->conf->fanout_parallel) {
+        if (ngx_http_aws_auth_fanout_part(f) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (f->next == f->nparts && !f->last_sent) {
+        f->last_sent = 1;
+        if (ngx_http_send_special(f->request, NGX_HTTP_LAST) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_aws_auth_fanout_done(ngx_http_request_t *r, void *data, ngx_int_t rc) {
+    ngx_http_aws_auth_part_t *part = data;
+    ngx_http_aws_auth_fanout_t *f = part->fanout;
+
+    if (part->done) {
+        /* finalized again once its output could be sent */
+        return rc;
+    }
+    part->done = 1;
+    f->active--;
+
+    if (!f->header_sent) {
+        /* the first range failed before S3 answered, the error page it
+           gets instead becomes the response */
+        return rc;
+    }
+
+    if (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE || r->connection->error) {
+        /* part of the body was sent already, all there is left to do is
+           cut the response short */
+        return NGX_ERROR;
+    }
+
+    return (ngx_http_aws_auth_fanout_next(f) == NGX_OK) ? rc : NGX_ERROR;
+}
+
+/* the headers of the response to the first range but for its length */
+static ngx_int_t
+ngx_http_aws_auth_fanout_copy_headers(ngx_http_request_t *r, ngx_http_request_t *sr) {
+    ngx_list_part_t *part;
+    ngx_table_elt_t *h, *ho;
+    ngx_uint_t i;
+
+    r->headers_out.content_type = sr->headers_out.content_type;
+    r->headers_out.content_type_len = sr->headers_out.content_type_len;
+    r->headers_out.last_modified_time = sr->headers_out.last_modified_time;
+
+    for (part = &sr->headers_out.headers.part; part; part = part->next) {
+        h = part->elts;
+        for (i = 0; i < part->nelts; i++) {
+            if (h[i].hash == 0 || &h[i] == sr->headers_out.content_range
+                || &h[i] == sr->headers_out.content_length) {
+                continue;
+            }
+
+            ho = ngx_list_push(&r->headers_out.headers);
+            if (ho == NULL) {
+                return NGX_ERROR;
+            }
+            *ho = h[i];
+
+            if (&h[i] == sr->headers_out.etag) {
+                r->headers_out.etag = ho;
+            } else if (&h[i] == sr->headers_out.last_modified) {
+                r->headers_out.last_modified = ho;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+/* The headers of the first range become those of the response: a 206 gives
+   the size of the object, a 416 for an empty one makes an empty 200,
+   anything else is passed on as is */
+static ngx_int_t
+ngx_http_aws_auth_fanout_header(ngx_http_request_t *sr, ngx_http_aws_auth_fanout_t *f) {
+    ngx_http_request_t *r = f->request;
+    ngx_uint_t empty = 0;
+    off_t first, last;
+    ngx_int_t rc;
+
+    if (sr->headers_out.status == NGX_HTTP_PARTIAL_CONTENT) {
+        if (sr->headers_out.content_range == NULL
+            || ngx_aws_auth__parse_content_range(&sr->headers_out.content_range->value, &first, &last, &f->size)
+               != NGX_OK
+            || first != 0) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "aws_fanout got an invalid Content-Range for \"%V\"",
+                          &r->uri);
+            return NGX_ERROR;
+        }
+
+        f->nparts = (f->size + f->conf->fanout_part_size - 1) / f->conf->fanout_part_size;
+        r->headers_out.status = NGX_HTTP_OK;
+        r->headers_out.content_length_n = f->size;
+
+    } else if (sr->headers_out.status == NGX_HTTP_RANGE_NOT_SATISFIABLE
+               && sr->headers_out.content_range != NULL
+               && ngx_aws_auth__parse_unsatisfied_range(&sr->headers_out.content_range->value) == 0) {
+        /* an empty object has no first byte to give; the error S3 sends
+           with the 416 is left unread, as the body of a HEAD would be */
+        empty = 1;
+        f->nparts = 1;
+        sr->header_only = 1;
+        r->headers_out.status = NGX_HTTP_OK;
+        r->headers_out.content_length_n = 0;
+
+    } else {
+        f->nparts = 1;
+        r->headers_out.status = sr->headers_out.status;
+        r->headers_out.content_length_n = sr->headers_out.content_length_n;
+    }
+
+    if (!empty && ngx_http_aws_auth_fanout_copy_headers(r, sr) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+    f->header_sent = 1;
+
+    return ngx_http_aws_auth_fanout_next(f);
+}
+
+static ngx_int_t
+ngx_http_aws_auth_header_filter(ngx_http_request_t *r) {
+    ngx_http_aws_auth_ctx_t *ctx;
+    ngx_http_aws_auth_fanout_t *f;
+    off_t first, last, size;
+
+    ctx = (r == r->main) ? NULL : ngx_http_get_module_ctx(r, ngx_http_aws_auth_module);
+    if (ctx == NULL || ctx->part == NULL) {
+        return ngx_http_next_header_filter(r);
+    }
+
+    f = ctx->part->fanout;
+
+    if (ctx->part->index == 0) {
+        if (ngx_http_aws_auth_fanout_header(r, f) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else if (r->headers_out.status != NGX_HTTP_PARTIAL_CONTENT || r->headers_out.content_range == NULL
+               || ngx_aws_auth__parse_content_range(&r->headers_out.content_range->value, &first, &last, &size)
+                  != NGX_OK
+               || first != ctx->part->first || size != f->size) {
+        /* the object changed or went away in between */
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "aws_fanout got status %ui for part %ui of \"%V\"",
+                      r->headers_out.status, ctx->part->index, &f->request->uri);
+        return NGX_ERROR;
+    }
+
+    return ngx_http_next_header_filter(r);
+}
+
+/* Content handler of a GET split by aws_fanout, set in the access phase.
+   Only the first range is requested here; the others follow once its
+   headers tell the size of the object */
+static ngx_int_t
+ngx_http_aws_auth_fanout_handler(ngx_http_request_t *r) {
+    ngx_http_aws_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_aws_auth_module);
+    ngx_http_aws_auth_fanout_t *f;
+    ngx_int_t rc;
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    f = ngx_pcalloc(r->pool, sizeof(ngx_http_aws_auth_fanout_t));
+    if (f == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    f->request = r;
+    f->conf = conf;
+
+    if (ngx_http_aws_auth_subrequest_uri(r, &conf->fanout_uri, &f->uri) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* the subrequests get the headers of the main request, the rest of
+       what they sign comes from the $aws_* variables */
+    if (ngx_http_aws_auth_push_header(r, &AMZ_HASH_HEADER, &EMPTY_STRING_SHA256) != NGX_OK
+        || ngx_http_aws_auth_fanout_part(f) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/* Asks S3 for one step of a PUT split by aws_multipart, in a background
+   subrequest whose response is kept in memory. A part is sent from the temp
+   file of the request body, as the proxy sends a buffered body. Should
+   proxy_next_upstream send it again, the upstream rewinds the file buffer
+   to the start of the file rather than of the part: S3 refuses what it then
+   gets, as it does not match the payload hash signed, and the part is sent
+   again by a new subrequest. The main request waits for each subrequest,
+   even once terminated */
+static ngx_int_t
+ngx_http_aws_auth_upload_call(ngx_http_aws_auth_upload_t *u, ngx_uint_t op, ngx_http_aws_auth_upload_part_t *part) {
+    static ngx_str_t post = ngx_string("POST"), put = ngx_string("PUT"), delete = ngx_string("DELETE");
+    static ngx_str_t uploads = ngx_string("uploads");
+    ngx_http_request_t *r = u->request, *sr;
+    ngx_http_post_subrequest_t *ps;
+    ngx_http_request_body_t *rb;
+    ngx_http_aws_auth_subrequest_t *sub;
+    ngx_http_aws_auth_ctx_t *ctx;
+    const ngx_str_t *method, *payload_hash, *body;
+    ngx_str_t args, *etags;
+    ngx_chain_t *cl;
+    ngx_buf_t *b;
+    ngx_uint_t method_id, i;
+    off_t length;
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_aws_auth_ctx_t));
+    sub = ngx_pcalloc(r->pool, sizeof(ngx_http_aws_auth_subrequest_t));
+    ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+    rb = ngx_pcalloc(r->pool, sizeof(ngx_http_request_body_t));
+    if (ctx == NULL || sub == NULL || ps == NULL || rb == NULL) {
+        return NGX_ERROR;
+    }
+    ctx->started = 1;
+
+    method = &post;
+    method_id = NGX_HTTP_POST;
+    args = u->upload_args;
+    payload_hash = NULL;
+    b = NULL;
+    length = 0;
+
+    switch (op) {
+
+    case AWS_UPLOAD_CREATE:
+        args = uploads;
+        break;
+
+    case AWS_UPLOAD_PART:
+        method = &put;
+        method_id = NGX_HTTP_PUT;
+
+        args.data = ngx_pnalloc(r->pool, sizeof("partNumber=&") - 1 + NGX_INT_T_LEN + u->upload_args.len);
+        b = ngx_calloc_buf(r->pool);
+        if (args.data == NULL || b == NULL) {
+            return NGX_ERROR;
+        }
+        args.len = ngx_sprintf(args.data, "partNumber=%ui&%V", (ngx_uint_t) (part - u->parts) + 1, &u->upload_args)
+                   - args.data;
+
+        b->in_file = 1;
+        b->file = &r->request_body->temp_file->file;
+        b->file_pos = part->offset;
+        b->file_last = part->offset + part->size;
+        b->last_buf = 1;
+
+        length = part->size;
+        payload_hash = &part->payload_hash;
+        break;
+
+    case AWS_UPLOAD_COMPLETE:
+        etags = ngx_palloc(r->pool, u->nparts * sizeof(ngx_str_t));
+        if (etags == NULL) {
+            return NGX_ERROR;
+        }
+        for (i = 0; i < u->nparts; i++) {
+            etags[i] = u->parts[i].etag;
+        }
+
+        body = ngx_aws_auth__complete_multipart_body(r->pool, etags, u->nparts);
+        b = ngx_calloc_buf(r->pool);
+        if (body == NULL || b == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->memory = 1;
+        b->start = body->data;
+        b->pos = body->data;
+        b->end = body->data + body->len;
+        b->last = b->end;
+        b->last_buf = 1;
+
+        length = body->len;
+        payload_hash = ngx_aws_auth__hash_sha256(r->pool, body);
+        if (payload_hash == NULL) {
+            return NGX_ERROR;
+        }
+        break;
+
+    default: /* AWS_UPLOAD_ABORT */
+        method = &delete;
+        method_id = NGX_HTTP_DELETE;
+    }
+
+    if (b != NULL) {
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+        cl->buf = b;
+        cl->next = NULL;
+        rb->bufs = cl;
+    }
+
+    if (ngx_http_aws_auth_sign_subrequest(r, u->conf, method, &args, payload_hash, NULL, sub) != NGX_OK) {
+        return NGX_ERROR;
+    }
+    ctx->sub = sub;
+    ctx->upload = u;
+    ctx->upload_part = part;
+    ctx->upload_op = op;
+
+    ps->handler = ngx_http_aws_auth_upload_done;
+    ps->data = ctx;
+
+    if (ngx_http_subrequest(r, &u->uri, &args, &sr, ps,
+                            NGX_HTTP_SUBREQUEST_IN_MEMORY | NGX_HTTP_SUBREQUEST_BACKGROUND) != NGX_OK) {
+        return NGX_ERROR;
+    }
+    ngx_http_set_ctx(sr, ctx, ngx_http_aws_auth_module);
+
+    /* the subrequest gets the method, body and length of what it uploads
+       rather than those of the PUT */
+    sr->method = method_id;
+    sr->method_name = *method;
+    sr->request_body = rb;
+    sr->headers_in.content_length_n = length;
+
+    /* until ngx_http_aws_auth_upload_done */
+    r->main->blocked++;
+
+    return NGX_OK;
+}
+
+/* The upload cannot be completed. The client gets the status of S3's
+   refusal if it was a 4xx, 502 otherwise */
+static void
+ngx_http_aws_auth_upload_fail(ngx_http_aws_auth_upload_t *u, ngx_http_request_t *sr, const char *step) {
+    ngx_uint_t status = (sr != NULL) ? sr->headers_out.status : 0;
+
+    ngx_log_error(NGX_LOG_ERR, u->request->connection->log, 0, "aws_multipart %s of \"%V\" failed with status %ui",
+                  step, &u->request->uri, status);
+
+    if (!u->failed) {
+        u->failed = 1;
+        u->status = (status >= NGX_HTTP_BAD_REQUEST && status < NGX_HTTP_INTERNAL_SERVER_ERROR)
+                    ? (ngx_int_t) status : NGX_HTTP_BAD_GATEWAY;
+    }
+}
+
+#if (NGX_THREADS)
+
+/* Hands the next part of the body to the hash thread once it is written to
+   the temp file, which the thread reads it back from; one part at a time */
+static ngx_int_t
+ngx_http_aws_auth_upload_hash(ngx_http_aws_auth_upload_t *u, off_t written) {
+    ngx_http_request_t *r = u->request;
+    ngx_http_aws_auth_upload_part_t *part;
+    ngx_http_aws_auth_hash_task_t *t;
+    ngx_thread_task_t *task;
+    ngx_chain_t *cl;
+
+    if (u->hash_posted || u->hashed == u->nparts) {
+        return NGX_OK;
+    }
+
+    part = &u->parts[u->hashed];
+    if (part->offset + part->size > written) {
+        return NGX_OK;
+    }
+
+    task = u->hash_task;
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_aws_auth_hash_task_t));
+        cl = ngx_alloc_chain_link(r->pool);
+        if (task == NULL || cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        t = task->ctx;
+        t->digest = &u->digest;
+        t->read_buf = ngx_palloc(r->pool, AWS_HASH_THREAD_BUF_SIZE);
+        cl->buf = ngx_calloc_buf(r->pool);
+        if (t->read_buf == NULL || cl->buf == NULL) {
+            return NGX_ERROR;
+        }
+        cl->buf->in_file = 1;
+        cl->buf->file = &r->request_body->temp_file->file;
+        cl->next = NULL;
+        t->bufs = cl;
+
+        task->handler = ngx_http_aws_auth_hash_thread;
+        task->event.data = u;
+        task->event.handler = ngx_http_aws_auth_upload_hash_handler;
+        u->hash_task = task;
+    }
+
+    t = task->ctx;
+    t->bufs->buf->file_pos = part->offset;
+    t->bufs->buf->file_last = part->offset + part->size;
+    t->read_failed = 0;
+
+    if (ngx_thread_task_post(u->conf->hash_thread_pool, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    u->hash_posted = 1;
+    r->main->blocked++;
+
+    return NGX_OK;
+}
+
+#endif
+
+/* Uploads multipart_parallel parts at a time, each once the body is hashed
+   and written past it, then completes the upload. A failed one is aborted
+   once no part is in flight any more, so S3 drops what it was given */
+static ngx_int_t
+ngx_http_aws_auth_upload_next(ngx_http_aws_auth_upload_t *u) {
+    ngx_http_request_body_t *rb = u->request->request_body;
+    ngx_http_aws_auth_upload_part_t *part;
+    off_t written;
+
+    if (u->failed) {
+        if (u->active == 0 && u->upload_args.len && !u->aborting) {
+            u->aborting = 1;
+            if (ngx_http_aws_auth_upload_call(u, AWS_UPLOAD_ABORT, NULL) != NGX_OK) {
+                /* left to the bucket's lifecycle rule */
+                u->aborted = 1;
+                return NGX_ERROR;
+            }
+        }
+        return NGX_OK;
+    }
+
+    written = (rb != NULL && rb->temp_file != NULL) ? rb->temp_file->offset : 0;
+
+#if (NGX_THREADS)
+    if (u->offload && ngx_http_aws_auth_upload_hash(u, written) != NGX_OK) {
+        return NGX_ERROR;
+    }
+#endif
+
+    if (u->upload_args.len == 0) {
+        /* CreateMultipartUpload has not answered yet */
+        return NGX_OK;
+    }
+
+    while (u->next < u->hashed && u->active < u->conf->multipart_parallel) {
+        part = &u->parts[u->next];
+        if (part->offset + part->size > written) {
+            break;
+        }
+
+        if (ngx_http_aws_auth_upload_call(u, AWS_UPLOAD_PART, part) != NGX_OK) {
+            return NGX_ERROR;
+        }
+        u->next++;
+        u->active++;
+    }
+
+    if (u->uploaded == u->nparts && !u->completing) {
+        u->completing = 1;
+        return ngx_http_aws_auth_upload_call(u, AWS_UPLOAD_COMPLETE, NULL);
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_aws_auth_upload_done(ngx_http_request_t *sr, void *data, ngx_int_t rc) {
+    static const ngx_str_t upload_id = ngx_string("UploadId"), etag = ngx_string("ETag"), code = ngx_string("Code");
+    ngx_http_aws_auth_ctx_t *ctx = data;
+    ngx_http_aws_auth_upload_t *u = ctx->upload;
+    ngx_http_aws_auth_upload_part_t *part = ctx->upload_part;
+    const ngx_str_t *value;
+    ngx_str_t body;
+    ngx_uint_t ok, i;
+    u_char *p;
+
+    if (ctx->sub_done) {
+        return rc;
+    }
+    ctx->sub_done = 1;
+    u->request->main->blocked--;
+
+    ngx_str_null(&body);
+    if (sr->out != NULL && sr->out->buf != NULL) {
+        body.data = sr->out->buf->pos;
+        body.len = sr->out->buf->last - sr->out->buf->pos;
+    }
+
+    /* S3 may also report a failure in a 200, once it started answering */
+    ok = (rc == NGX_OK && sr->headers_out.status == NGX_HTTP_OK
+          && ngx_aws_auth__xml_element(sr->pool, &body, &code) == NULL);
+
+    switch (ctx->upload_op) {
+
+    case AWS_UPLOAD_CREATE:
+        u->created = 1;
+        value = ok ? ngx_aws_auth__xml_element(sr->pool, &body, &upload_id) : NULL;
+
+        /* the ID goes into query strings as is */
+        for (i = 0; value != NULL && i < value->len; i++) {
+            if (!ngx_aws_auth__uri_plain[value->data[i]] || value->data[i] == '/') {
+                value = NULL;
+            }
+        }
+
+        if (value == NULL || value->len == 0) {
+            ngx_http_aws_auth_upload_fail(u, sr, "CreateMultipartUpload");
+            break;
+        }
+
+        p = ngx_pnalloc(sr->pool, sizeof("uploadId=") - 1 + value->len);
+        if (p == NULL) {
+            ngx_http_aws_auth_upload_fail(u, NULL, "CreateMultipartUpload");
+            break;
+        }
+        u->upload_args.data = p;
+        u->upload_args.len = ngx_sprintf(p, "uploadId=%V", value) - p;
+        break;
+
+    case AWS_UPLOAD_PART:
+        if (ok && sr->headers_out.etag != NULL) {
+            part->etag = sr->headers_out.etag->value;
+            u->active--;
+            u->uploaded++;
+            break;
+        }
+
+        if (++part->attempts < AWS_MULTIPART_ATTEMPTS && !u->failed) {
+            ngx_log_error(NGX_LOG_WARN, sr->connection->log, 0,
+                          "aws_multipart retries part %ui of \"%V\" after status %ui",
+                          (ngx_uint_t) (part - u->parts) + 1, &u->request->uri, sr->headers_out.status);
+            if (ngx_http_aws_auth_upload_call(u, AWS_UPLOAD_PART, part) == NGX_OK) {
+                break;
+            }
+        }
+
+        u->active--;
+        ngx_http_aws_auth_upload_fail(u, sr, "UploadPart");
+        break;
+
+    case AWS_UPLOAD_COMPLETE:
+        if (!ok) {
+            ngx_http_aws_auth_upload_fail(u, sr, "CompleteMultipartUpload");
+            break;
+        }
+
+        value = ngx_aws_auth__xml_element(sr->pool, &body, &etag);
+        if (value != NULL) {
+            u->etag = *value;
+        }
+        u->status = NGX_HTTP_OK;
+        break;
+
+    default: /* AWS_UPLOAD_ABORT */
+        if (rc != NGX_OK || sr->headers_out.status != NGX_HTTP_NO_CONTENT) {
+            ngx_log_error(NGX_LOG_WARN, sr->connection->log, 0,
+                          "aws_multipart could not abort the upload of \"%V\", status %ui",
+                          &u->request->uri, sr->headers_out.status);
+        }
+        u->aborted = 1;
+    }
+
+    if (ngx_http_aws_auth_upload_next(u) != NGX_OK) {
+        ngx_http_aws_auth_upload_fail(u, NULL, "UploadPart");
+    }
+
+    /* background subrequests do not wake their main request: it answers
+       in ngx_http_aws_auth_upload_wake, or finishes terminating */
+    if (!u->responded) {
+        ngx_http_post_request(u->request, NULL);
+    }
+
+    return rc;
+}
+
+/* answers the client of an uploaded PUT like S3 answers one */
+static ngx_int_t
+ngx_http_aws_auth_upload_respond(ngx_http_request_t *r, ngx_http_aws_auth_upload_t *u) {
+    static ngx_str_t etag = ngx_string("ETag");
+    ngx_table_elt_t *h;
+    ngx_int_t rc;
+
+    if (u->status != NGX_HTTP_OK) {
+        return u->status;
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = 0;
+
+    if (u->etag.len) {
+        h = ngx_list_push(&r->headers_out.headers);
+        if (h == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        h->hash = 1;
+        h->key = etag;
+        h->value = u->etag;
+        r->headers_out.etag = h;
+    }
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_send_special(r, NGX_HTTP_LAST);
+}
+
+/* whether the client can be answered: a failed upload only once no part is
+   in flight any more and S3 has been told to drop it */
+static ngx_uint_t
+ngx_http_aws_auth_upload_settled(ngx_http_aws_auth_upload_t *u) {
+    if (u->status == NGX_DONE || u->hash_posted) {
+        return 0;
+    }
+
+    if (!u->failed) {
+        return 1;
+    }
+
+    return u->created && u->active == 0 && (u->upload_args.len == 0 || u->aborted);
+}
+
+/* Write event handler of the main request while its upload goes on. Once
+   the body is read and the outcome settled, it answers; that finalization
+   takes back the reference ngx_http_aws_auth_upload_handler took */
+static void
+ngx_http_aws_auth_upload_wake(ngx_http_request_t *r) {
+    ngx_http_aws_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_aws_auth_module);
+    ngx_http_aws_auth_upload_t *u = ctx->upload;
+
+    if (!u->body_read || !ngx_http_aws_auth_upload_settled(u) || u->responded) {
+        return;
+    }
+    u->responded = 1;
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+    ngx_http_finalize_request(r, ngx_http_aws_auth_upload_respond(r, u));
+}
+
+/* the body is in the temp file: the reference reading it took goes, the
+   upload still holds the request */
+static void
+ngx_http_aws_auth_upload_body_handler(ngx_http_request_t *r) {
+    ngx_http_aws_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_aws_auth_module);
+    ngx_http_aws_auth_upload_t *u = ctx->upload;
+
+    u->body_read = 1;
+
+    if (ngx_http_aws_auth_upload_next(u) != NGX_OK) {
+        ngx_http_aws_auth_upload_fail(u, NULL, "UploadPart");
+    }
+
+    ngx_http_finalize_request(r, NGX_DONE);
+    ngx_http_aws_auth_upload_wake(r);
+}
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_aws_auth_upload_hash_handler(ngx_event_t *ev) {
+    ngx_http_aws_auth_upload_t *u = ev->data;
+    ngx_http_aws_auth_hash_task_t *t = u->hash_task->ctx;
+    ngx_http_aws_auth_upload_part_t *part = &u->parts[u->hashed];
+    ngx_http_request_t *r = u->request;
+    ngx_connection_t *c = r->connection;
+
+    r->main->blocked--;
+    u->hash_posted = 0;
+
+    if (t->read_failed) {
+        ngx_log_error(NGX_LOG_CRIT, c->log, t->err, "aws_multipart could not read part %ui of \"%V\" back from \"%s\"",
+                      u->hashed + 1, &r->uri, t->bufs->buf->file->name.data);
+        ngx_http_aws_auth_upload_fail(u, NULL, "UploadPart");
+
+    } else if (ngx_aws_auth__payload_digest_final(r->pool, &u->digest) != NGX_OK
+               || (u->hashed + 1 < u->nparts && ngx_aws_auth__payload_digest_init(r->pool, &u->digest, 0) != NGX_OK)) {
+        ngx_http_aws_auth_upload_fail(u, NULL, "UploadPart");
+
+    } else {
+        part->payload_hash = u->digest.payload_hash;
+        u->hashed++;
+    }
+
+    if (ngx_http_aws_auth_upload_next(u) != NGX_OK) {
+        ngx_http_aws_auth_upload_fail(u, NULL, "UploadPart");
+    }
+
+    /* ngx_http_aws_auth_upload_wake, or the finalizer of a main request
+       terminated meanwhile */
+    r->write_event_handler(r);
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+/* Hashes the body of a PUT split by aws_multipart part by part on its way
+   to the temp file, unless the hash thread reads the parts back from there;
+   a part is uploaded once it has been written there */
+static ngx_int_t
+ngx_http_aws_auth_upload_body_filter(ngx_http_request_t *r, ngx_http_aws_auth_upload_t *u, ngx_chain_t *in) {
+    ngx_http_aws_auth_upload_part_t *part;
+    ngx_chain_t *cl;
+    u_char *p, *last;
+    off_t end;
+    size_t n;
+    ngx_int_t rc;
+
+    for (cl = in; cl && !u->offload; cl = cl->next) {
+        if (!ngx_buf_in_memory(cl->buf)) {
+            if (ngx_buf_size(cl->buf) > 0) {
+                ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                              "aws_multipart got a request body buffer that is not in memory");
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+            continue;
+        }
+
+        for (p = cl->buf->pos, last = cl->buf->last; p < last && u->hashed < u->nparts; p += n) {
+            part = &u->parts[u->hashed];
+            end = part->offset + part->size;
+            n = (size_t) ngx_min((off_t) (last - p), end - u->received);
+
+            ngx_aws_auth__payload_digest_update(&u->digest, p, n);
+            u->received += n;
+
+            if (u->received == end) {
+                if (ngx_aws_auth__payload_digest_final(r->pool, &u->digest) != NGX_OK) {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+                part->payload_hash = u->digest.payload_hash;
+                u->hashed++;
+
+                if (u->hashed < u->nparts && ngx_aws_auth__payload_digest_init(r->pool, &u->digest, 0) != NGX_OK) {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+            }
+        }
+    }
+
+    rc = ngx_http_next_request_body_filter(r, in);
+    if (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        return rc;
+    }
+
+    if (ngx_http_aws_auth_upload_next(u) != NGX_OK) {
+        ngx_http_aws_auth_upload_fail(u, NULL, "UploadPart");
+    }
+
+    return rc;
+}
+
+/* Cleanup of the main request of a PUT split by aws_multipart, run when it is
+   terminated, as when its client goes away, and when it is freed. An upload
+   that is not completing is given up, and aborted once no part is in flight
+   any more; the terminated request finishes once no subrequest is left */
+static void
+ngx_http_aws_auth_upload_cleanup(void *data) {
+    ngx_http_aws_auth_upload_t *u = data;
+    ngx_http_request_t *r = u->request;
+
+    /* a request being freed has nothing left in flight */
+    if (r->count == 0 || u->completing || u->failed) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "aws_multipart aborts the upload of \"%V\"", &r->uri);
+
+    u->failed = 1;
+
+    if (ngx_http_aws_auth_upload_next(u) != NGX_OK) {
+        ngx_http_aws_auth_upload_fail(u, NULL, "AbortMultipartUpload");
+    }
+}
+
+/* Content handler of a PUT split by aws_multipart, set in the access phase.
+   The upload is created while the body is read into a temp file */
+static ngx_int_t
+ngx_http_aws_auth_upload_handler(ngx_http_request_t *r) {
+    ngx_http_aws_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_aws_auth_module);
+    ngx_http_aws_auth_upload_t *u;
+    ngx_http_aws_auth_ctx_t *ctx;
+    ngx_http_cleanup_t *cln;
+    off_t part_size, length;
+    ngx_uint_t i;
+    ngx_int_t rc;
+
+    length = r->headers_in.content_length_n;
+    part_size = ngx_aws_auth__multipart_part_size(length, conf->multipart_part_size);
+    if (part_size == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "aws_multipart cannot upload %O bytes of \"%V\"",
+                      length, &r->uri);
+        return NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+    }
+
+    ctx = ngx_http_aws_auth_get_ctx(r);
+    u = ngx_pcalloc(r->pool, sizeof(ngx_http_aws_auth_upload_t));
+    if (ctx == NULL || u == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ctx->started = 1;
+    u->request = r;
+    u->conf = conf;
+    u->status = NGX_DONE;
+    u->nparts = (length + part_size - 1) / part_size;
+
+#if (NGX_THREADS)
+    /* the parts are hashed in a thread once written, so other requests on
+       this worker are not held up meanwhile */
+    u->offload = (conf->hash_thread_pool != NULL && (size_t) length >= conf->hash_thread_min_size);
+#endif
+
+    u->parts = ngx_pcalloc(r->pool, u->nparts * sizeof(ngx_http_aws_auth_upload_part_t));
+    if (u->parts == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    for (i = 0; i < u->nparts; i++) {
+        u->parts[i].offset = (off_t) i * part_size;
+        u->parts[i].size = ngx_min(part_size, length - u->parts[i].offset);
+    }
+
+    if (ngx_http_aws_auth_subrequest_uri(r, &conf->multipart_uri, &u->uri) != NGX_OK
+        || ngx_aws_auth__payload_digest_init(r->pool, &u->digest, 0) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln = ngx_http_cleanup_add(r, 0);
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    cln->handler = ngx_http_aws_auth_upload_cleanup;
+    cln->data = u;
+
+    ctx->upload = u;
+
+    if (ngx_http_aws_auth_upload_call(u, AWS_UPLOAD_CREATE, NULL) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* the parts are sent from the file by the subrequests */
+    r->request_body_in_file_only = 1;
+    r->request_body_in_clean_file = 1;
+    r->write_event_handler = ngx_http_aws_auth_upload_wake;
+
+    /* the upload holds the request until ngx_http_aws_auth_upload_wake
+       answers, whatever becomes of the body */
+    r->main->count++;
+
+    rc = ngx_http_read_client_request_body(r, ngx_http_aws_auth_upload_body_handler);
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        /* answered once the upload CreateMultipartUpload starts is aborted,
+           like any other failure */
+        if (!u->failed) {
+            u->failed = 1;
+            u->status = rc;
+        }
+        u->body_read = 1;
+        r->read_event_handler = ngx_http_block_reading;
+    }
+
+    return NGX_DONE;
+}
+
+/* Signs the queued requests, up to AWS_SIGN_BATCH_MAX of them with one call
+   to the multi-buffer MAC, and resumes their access phase */
+static void
+ngx_http_aws_auth_batch_handler(ngx_event_t *ev) {
+    ngx_http_aws_auth_batch_t *batch = ev->data;
+    ngx_aws_auth__hmac_job_t jobs[AWS_SIGN_BATCH_MAX];
+    ngx_http_aws_auth_batch_item_t *item;
+    ngx_http_aws_auth_ctx_t *ctx;
+    ngx_http_request_t *r;
+    ngx_connection_t *c;
+    ngx_queue_t ready, *q;
+    ngx_uint_t n;
+
+    ngx_queue_init(&ready);
+
+    for (n = 0; n < AWS_SIGN_BATCH_MAX && !ngx_queue_empty(&batch->queue); n++) {
+        q = ngx_queue_head(&batch->queue);
+        ngx_queue_remove(q);
+        ngx_queue_insert_tail(&ready, q);
+
+        item = ngx_queue_data(q, ngx_http_aws_auth_batch_item_t, queue);
+        jobs[n].hmac_key = item->hmac_key;
+        jobs[n].data = item->signature.string_to_sign.data;
+        jobs[n].len = item->signature.string_to_sign.len;
+        jobs[n].hex = item->signature.signature;
+
+        ctx = ngx_http_get_module_ctx(item->request, ngx_http_aws_auth_module);
+        ctx->batch_signed = 1;
+    }
+
+    batch->n -= n;
+
+    if (!ngx_queue_empty(&batch->queue)) {
+        ngx_post_event(ev, &ngx_posted_events);
+
+    } else if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "aws sign batch of %ui", n);
+
+    ngx_aws_auth__hmac_key_sha256_hex_batch(jobs, n);
+
+    /* resuming a request may free others sharing its connection, their
+       pool cleanup takes them off the ready queue */
+    while (!ngx_queue_empty(&ready)) {
+        q = ngx_queue_head(&ready);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_http_aws_auth_batch_item_t, queue);
+        r = item->request;
+        c = r->connection;
+
+        ctx = ngx_http_get_module_ctx(r, ngx_http_aws_auth_module);
+        ctx->batch_queued = 0;
+        ctx->status = NGX_OK;
+
+        if (ngx_http_aws_auth_push_headers(r, item->headers_out) != NGX_OK
+            || (ctx->digest.content_md5.len
+                && ngx_http_aws_auth_push_header(r, &CONTENT_MD5_HEADER, &ctx->digest.content_md5) != NGX_OK)) {
+            ctx->status = NGX_ERROR;
+
+        } else if (ctx->memoize) {
+            ngx_http_aws_auth_memo_store(r, ngx_http_get_module_loc_conf(r, ngx_http_aws_auth_module),
+                                         item->hmac_key, item->headers_out);
+        }
+
+        r->write_event_handler = ngx_http_core_run_phases;
+        ngx_http_core_run_phases(r);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+static void
+ngx_http_aws_auth_batch_cleanup(void *data) {
+    ngx_http_aws_auth_ctx_t *ctx = data;
+
+    if (ctx->batch_queued) {
+        ngx_queue_remove(&ctx->batch.queue);
+
+        if (!ctx->batch_signed) {
+            ngx_http_aws_auth_batch.n--;
+        }
+    }
+}
+
+/* Prepares the signature of the request and leaves its MAC to
+   ngx_http_aws_auth_batch_handler, which runs once aws_sign_batch requests
+   are queued, after the timeout, or with no timeout after the other events
+   of this event loop iteration */
+static ngx_int_t
+ngx_http_aws_auth_batch_sign(ngx_http_request_t *r, ngx_http_aws_auth_conf_t *conf,
+                             ngx_http_aws_auth_ctx_t *ctx, const ngx_str_t *payload_hash) {
+    ngx_http_aws_auth_batch_t *batch = &ngx_http_aws_auth_batch;
+    ngx_event_t *ev = &batch->event;
+    const ngx_aws_auth_template_t *tpl;
+    ngx_aws_auth_key_epoch_t *epoch;
+    ngx_pool_cleanup_t *cln;
+    ngx_http_request_t dated;
+    time_t when;
+
+    when = ngx_http_aws_auth_sign_time(r);
+    epoch = ngx_http_aws_auth_epoch(r, conf, when);
+    tpl = ngx_http_aws_auth_template(r, conf);
+    if (epoch == NULL || tpl == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ctx == NULL) {
+        ctx = ngx_http_aws_auth_get_ctx(r);
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+        ctx->started = 1;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the request holds the epoch until the batch has signed it */
+    ctx->batch.headers_out = ngx_aws_auth__prepare_with_template(r->pool,
+                                                                 ngx_http_aws_auth_dated_request(r, when, &dated), tpl,
+                                                                 &epoch->key_scope, payload_hash, NULL,
+                                                                 &ctx->batch.signature);
+    if (ctx->batch.headers_out == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->batch.request = r;
+    ctx->batch.hmac_key = epoch->hmac_key;
+    ctx->memoize = (conf->sign_cache && payload_hash == NULL
+                    && ngx_aws_auth__find_epoch(conf, when) == epoch);
+
+    cln->handler = ngx_http_aws_auth_batch_cleanup;
+    cln->data = ctx;
+
+    ngx_queue_insert_tail(&batch->queue, &ctx->batch.queue);
+    ctx->batch_queued = 1;
+    ctx->status = NGX_DONE;
+
+    batch->size = (batch->n == 0) ? conf->sign_batch : ngx_min(batch->size, conf->sign_batch);
+    batch->n++;
+
+    if (batch->n >= batch->size || conf->sign_batch_timeout == 0) {
+        if (ev->timer_set) {
+            ngx_del_timer(ev);
+        }
+
+        if (!ev->posted) {
+            ngx_post_event(ev, &ngx_posted_events);
+        }
+
+    } else if (!ev->posted
+               && (!ev->timer_set
+                   || (ngx_msec_int_t) (ev->timer.key - ngx_current_msec - conf->sign_batch_timeout) > 0)) {
+        ngx_add_timer(ev, conf->sign_batch_timeout);
+    }
+
+    /* the access phase resumes in ngx_http_aws_auth_batch_handler */
+    r->write_event_handler = ngx_http_request_empty_handler;
+    return NGX_DONE;
+}
+
+static ngx_int_t
+ngx_http_aws_auth_stream_body(ngx_http_request_t *r, ngx_http_aws_auth_conf_t *conf) {
+    ngx_array_t *extra_headers;
+    header_pair_t *hv;
+    const ngx_array_t *headers_out;
+    const ngx_str_t *payload_hash;
+    ngx_aws_auth_key_epoch_t *epoch;
+    ngx_http_aws_auth_ctx_t *ctx;
+    ngx_str_t encoding;
+    time_t date;
+    u_char *p;
+
+    if (r->headers_in.chunked || r->headers_in.content_length_n < 0) {
+        /* the aws-chunked body length has to be known up front */
+        return NGX_HTTP_LENGTH_REQUIRED;
+    }
+
+    ctx = ngx_http_aws_auth_get_ctx(r);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->started = 1;
+    ctx->framing = 1;
+    ctx->decoded_length = r->headers_in.content_length_n;
+
+    if (conf->payload_signing == NGX_AWS_AUTH_PAYLOAD_UNSIGNED) {
+        ctx->unsigned_payload = 1;
+        ctx->framed_length = ngx_aws_auth__trailer_body_length(r->headers_in.content_length_n);
+        payload_hash = &UNSIGNED_TRAILER_PAYLOAD_HASH;
+
+    } else {
+        ctx->framed_length = ngx_aws_auth__streaming_body_length(r->headers_in.content_length_n, conf->chunk_size);
+        payload_hash = &STREAMING_PAYLOAD_HASH;
+    }
+
+    extra_headers = ngx_array_create(r->pool, 3, sizeof(header_pair_t));
+    if (extra_headers == NULL) {
+        return NGX_ERROR;
+    }
+
+    hv = ngx_array_push(extra_headers);
+    hv->key = CONTENT_ENCODING_HEADER;
+    hv->value = AWS_CHUNKED_ENCODING;
+
+    if (ngx_http_aws_auth_signed_header(r, &CONTENT_ENCODING_HEADER, &encoding) == NGX_OK && encoding.len) {
+        /* S3 keeps what follows aws-chunked as the object's encoding */
+        p = ngx_pnalloc(r->pool, AWS_CHUNKED_ENCODING.len + 1 + encoding.len);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+        hv->value.data = p;
+        p = ngx_cpymem(p, AWS_CHUNKED_ENCODING.data, AWS_CHUNKED_ENCODING.len);
+        *p++ = ',';
+        p = ngx_cpymem(p, encoding.data, encoding.len);
+        hv->value.len = p - hv->value.data;
+    }
+
+    hv = ngx_array_push(extra_headers);
+    hv->key = AMZ_DECODED_LENGTH_HEADER;
+    hv->value.data = ngx_pnalloc(r->pool, NGX_OFF_T_LEN);
+    if (hv->value.data == NULL) {
+        return NGX_ERROR;
+    }
+    hv->value.len = ngx_sprintf(hv->value.data, "%O", r->headers_in.content_length_n) - hv->value.data;
+
+    if (ctx->unsigned_payload) {
+        hv = ngx_array_push(extra_headers);
+        hv->key = AMZ_TRAILER_HEADER;
+        hv->value = AMZ_CHECKSUM_CRC32C_HEADER;
+    }
+
+    headers_out = ngx_http_aws_auth_sign_headers(r, conf, payload_hash, extra_headers);
+    if (headers_out == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* chunks are signed with the date and key of the headers, the request
+       holds the epoch they came from */
+    date = ngx_aws_auth__signing_time(&conf->sign_template, r->start_sec);
+    epoch = ngx_http_aws_auth_epoch(r, conf, r->start_sec);
+    if (epoch == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (!ctx->unsigned_payload
+        && ngx_aws_auth__chunk_signer_init(r->pool, &ctx->chunk_signer,
+                                        epoch->hmac_key, &epoch->key_scope,
+                                        ngx_aws_auth__compute_request_time(r->pool, &date),
+                                        ngx_aws_auth__seed_signature(r->pool, headers_out)) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* the body is framed by the request body filter whenever the proxy
+       reads it, with or without proxy_request_buffering */
+    ctx->status = NGX_OK;
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_aws_proxy_sign(ngx_http_request_t *r) {
+    ngx_http_aws_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_aws_auth_module);
+    ngx_http_aws_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_aws_auth_module);
+    const ngx_str_t *payload_hash = NULL;
+    ngx_int_t rc;
+
+    if (ctx != NULL && !ctx->started) {
+        /* made for the caches of the request, this is its first pass */
+        ctx = NULL;
+    }
+
+    /* a request coming back for its body or batch has been verified, but
+       for the body itself */
+    if (conf->verify && ctx == NULL) {
+        rc = ngx_http_aws_auth_verify(r, conf);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+    } else if (ctx != NULL && ctx->verify_hash.len) {
+        rc = ngx_http_aws_auth_verify_payload(r, ctx);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    if (!conf->enabled) {
+        /* return directly if module is not enabled */
+        return conf->verify ? NGX_OK : NGX_DECLINED;
+    }
+
+    if (conf->presign_redirect && (r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+        return ngx_http_aws_auth_redirect(r, conf);
+    }
+
+    if (conf->fanout_parallel && r->method == NGX_HTTP_GET && r->headers_in.range == NULL
+        && ctx == NULL) {
+        /* fetched in ranges by subrequests, each signing its own */
+        r->content_handler = ngx_http_aws_auth_fanout_handler;
+        return NGX_OK;
+    }
+
+    if (conf->multipart_parallel && r->method == NGX_HTTP_PUT && !r->headers_in.chunked
+        && r->headers_in.content_length_n > (off_t) conf->multipart_part_size
+        && ctx == NULL) {
+        /* uploaded in parts by subrequests, each signing its own */
+        r->content_handler = ngx_http_aws_auth_upload_handler;
+        return NGX_OK;
+    }
+
+    if (ctx != NULL) {
+        if (ctx->status != NGX_OK) {
+            /* body is still being read */
+            return ctx->status;
+        }
+
+        if (ctx->framing || ctx->batch_signed) {
+            /* headers were signed before the body was read, or in a batch */
+            return NGX_OK;
+        }
+        payload_hash = &ctx->digest.payload_hash;
+
+        /* reading the body may have taken longer than S3 allows a date
+           to be off, the request is dated now that it is signed */
+        ctx->sign_time = ngx_time();
+
+    } else if (conf->lazy && !ngx_http_aws_auth_has_body(r)) {
+        /* signed by $s3_auth_token if the request goes upstream at all,
+           the payload hash is all it needs here */
+        if (ngx_http_aws_auth_push_header(r, &AMZ_HASH_HEADER, &EMPTY_STRING_SHA256) != NGX_OK) {
+            return NGX_ERROR;
+        }
+        return NGX_OK;
+
+    } else if (ngx_http_aws_auth_has_body(r)) {
+        switch (conf->payload_signing) {
+            case NGX_AWS_AUTH_PAYLOAD_SHA256:
+                return ngx_http_aws_auth_read_body(r, conf);
+
+            case NGX_AWS_AUTH_PAYLOAD_STREAMING:
+            case NGX_AWS_AUTH_PAYLOAD_UNSIGNED:
+                return ngx_http_aws_auth_stream_body(r, conf);
+
+            default:
+                /* signing a body needs aws_payload_signing */
+                return NGX_HTTP_NOT_ALLOWED;
+        }
+    }
+
+    if (conf->sign_cache && payload_hash == NULL) {
+        rc = ngx_http_aws_auth_memo_lookup(r, conf);
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
+    if (conf->sign_batch > 1) {
+        return ngx_http_aws_auth_batch_sign(r, conf, ctx, payload_hash);
+    }
+
+    if (ngx_http_aws_auth_sign_headers(r, conf, payload_hash, NULL) == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ctx != NULL && ctx->digest.content_md5.len) {
+        if (ngx_http_aws_auth_push_header(r, &CONTENT_MD5_HEADER, &ctx->digest.content_md5) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+    return NGX_OK;
+}
+
+static ngx_chain_t *
+ngx_http_aws_auth_get_chunk(ngx_http_request_t *r, ngx_http_aws_auth_ctx_t *ctx, size_t chunk_size) {
+    ngx_buf_t *b;
+    ngx_chain_t *cl;
+    size_t reserve = ngx_aws_auth__chunk_header_length(chunk_size);
+
+    cl = ngx_chain_get_free_buf(r->pool, &ctx->free);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    /* the chunk header is written in front of the data once the chunk is
+       complete and signed, the trailing CRLF goes after it */
+    b = cl->buf;
+    if (b->start == NULL) {
+        b->start = ngx_palloc(r->pool, reserve + chunk_size + 2);
+        if (b->start == NULL) {
+            return NULL;
+        }
+
+        b->end = b->start + reserve + chunk_size + 2;
+        b->tag = (ngx_buf_tag_t) &ngx_http_aws_auth_module;
+        b->temporary = 1;
+    }
+
+    b->pos = b->start + reserve;
+    b->last = b->pos;
+
+    return cl;
+}
+
+static void
+ngx_http_aws_auth_frame_chunk(ngx_http_aws_auth_ctx_t *ctx, ngx_buf_t *b, size_t chunk_size) {
+    u_char *data = b->start + ngx_aws_auth__chunk_header_length(chunk_size);
+    size_t len = b->last - data;
+
+    ngx_aws_auth__sign_chunk(&ctx->chunk_signer, data, len);
+
+    b->pos = data - ngx_aws_auth__chunk_header_length(len);
+    ngx_aws_auth__write_chunk_header(b->pos, len, ctx->chunk_signer.signature);
+    *b->last++ = CR;
+    *b->last++ = LF;
+}
+
+/* Re-frames the client body as aws-chunked: the data is copied into
+   chunk_size buffers, each signed and prefixed with its header as soon as it
+   is full. Buffers are reused once the proxy has sent them, so memory does
+   not grow with the size of the body */
+static ngx_int_t
+ngx_http_aws_auth_chunked_body_filter(ngx_http_request_t *r, ngx_http_aws_auth_ctx_t *ctx, ngx_chain_t *in) {
+    size_t n;
+    ngx_int_t rc;
+    ngx_buf_t *b, *chunk;
+    ngx_chain_t *cl, *out, **ll;
+    ngx_http_aws_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_aws_auth_module);
+
+    out = NULL;
+    ll = &out;
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (!ngx_buf_in_memory(b) && ngx_buf_size(b) > 0) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "aws-chunked framing got a request body buffer that is not in memory");
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        while (ngx_buf_in_memory(b) && b->pos < b->last) {
+            if (ctx->chunk == NULL) {
+                ctx->chunk = ngx_http_aws_auth_get_chunk(r, ctx, conf->chunk_size);
+                if (ctx->chunk == NULL) {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+            }
+
+            chunk = ctx->chunk->buf;
+            n = ngx_min((size_t) (b->last - b->pos), (size_t) (chunk->end - 2 - chunk->last));
+            chunk->last = ngx_cpymem(chunk->last, b->pos, n);
+            b->pos += n;
+
+            if (chunk->last == chunk->end - 2) {
+                ngx_http_aws_auth_frame_chunk(ctx, chunk, conf->chunk_size);
+                *ll = ctx->chunk;
+                ll = &ctx->chunk->next;
+                ctx->chunk = NULL;
+            }
+        }
+
+        if (b->last_buf) {
+            if (ctx->chunk != NULL) {
+                ngx_http_aws_auth_frame_chunk(ctx, ctx->chunk->buf, conf->chunk_size);
+                *ll = ctx->chunk;
+                ll = &ctx->chunk->next;
+                ctx->chunk = NULL;
+            }
+
+            /* the final zero length chunk */
+            *ll = ngx_alloc_chain_link(r->pool);
+            if (*ll == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            chunk = ngx_create_temp_buf(r->pool, ngx_aws_auth__chunk_header_length(0) + 2);
+            if (chunk == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            ngx_aws_auth__sign_chunk(&ctx->chunk_signer, chunk->pos, 0);
+            chunk->last = ngx_aws_auth__write_chunk_header(chunk->pos, 0, ctx->chunk_signer.signature);
+            *chunk->last++ = CR;
+            *chunk->last++ = LF;
+            chunk->last_buf = 1;
+
+            (*ll)->buf = chunk;
+            ll = &(*ll)->next;
+        }
+    }
+
+    *ll = NULL;
+
+    rc = ngx_http_next_request_body_filter(r, out);
+
+    ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &out,
+                            (ngx_buf_tag_t) &ngx_http_aws_auth_module);
+
+    return rc;
+}
+
+/* Frames an unsigned payload as a single aws-chunked chunk. The client
+   buffers are passed on untouched, only the chunk header in front and the
+   CRC32C trailer behind them are added; the last one goes on as a copy
+   without last_buf */
+static ngx_int_t
+ngx_http_aws_auth_trailer_body_filter(ngx_http_request_t *r, ngx_http_aws_auth_ctx_t *ctx, ngx_chain_t *in) {
+    ngx_buf_t *b;
+    ngx_chain_t *cl, *tl, *out, **ll;
+
+    out = NULL;
+    ll = &out;
+
+    if (!ctx->chunk_header_sent) {
+        tl = ngx_alloc_chain_link(r->pool);
+        if (tl == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        tl->buf = ngx_create_temp_buf(r->pool, NGX_OFF_T_LEN + 2);
+        if (tl->buf == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        tl->buf->last = ngx_aws_auth__write_unsigned_chunk_header(tl->buf->pos, ctx->decoded_length);
+        *ll = tl;
+        ll = &tl->next;
+        ctx->chunk_header_sent = 1;
+    }
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (ngx_buf_in_memory(b)) {
+            ctx->crc32c = ngx_aws_auth__crc32c(ctx->crc32c, b->pos, b->last - b->pos);
+
+        } else if (ngx_buf_size(b) > 0) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "unsigned payload got a request body buffer that is not in memory");
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (b->last_buf) {
+            if (ngx_buf_size(b) > 0) {
+                /* the data goes on in a buffer of our own, the trailer
+                   ends the body in its place; b stays as it is */
+                tl = ngx_alloc_chain_link(r->pool);
+                if (tl == NULL) {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+
+                tl->buf = ngx_calloc_buf(r->pool);
+                if (tl->buf == NULL) {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+
+                *tl->buf = *b;
+                tl->buf->last_buf = 0;
+                *ll = tl;
+                ll = &tl->next;
+            }
+
+            tl = ngx_alloc_chain_link(r->pool);
+            if (tl == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            tl->buf = ngx_create_temp_buf(r->pool, ngx_aws_auth__checksum_trailer_length());
+            if (tl->buf == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            tl->buf->last = ngx_aws_auth__write_checksum_trailer(tl->buf->pos, ctx->crc32c);
+            tl->buf->last_buf = 1;
+
+            *ll = tl;
+            ll = &tl->next;
+            continue;
+        }
+
+        tl = ngx_alloc_chain_link(r->pool);
+        if (tl == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        tl->buf = b;
+        *ll = tl;
+        ll = &tl->next;
+    }
+
+    *ll = NULL;
+
+    return ngx_http_next_request_body_filter(r, out);
+}
+
+static ngx_int_t
+ngx_http_aws_auth_body_filter(ngx_http_request_t *r, ngx_chain_t *in) {
+    ngx_chain_t *cl;
+    ngx_http_aws_auth_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_aws_auth_module);
+    if (ctx == NULL) {
+        return ngx_http_next_request_body_filter(r, in);
+    }
+
+    if (ctx->upload != NULL) {
+        return ngx_http_aws_auth_upload_body_filter(r, ctx->upload, in);
+    }
+
+    if (ctx->framing) {
+        if (ctx->unsigned_payload) {
+            return ngx_http_aws_auth_trailer_body_filter(r, ctx, in);
+        }
+        return ngx_http_aws_auth_chunked_body_filter(r, ctx, in);
+    }
+
+#if (NGX_THREADS)
+    if (ctx->offload) {
+        for (cl = in; cl; cl = cl->next) {
+            if (!ngx_buf_in_memory(cl->buf)) {
+                if (ngx_buf_size(cl->buf) > 0) {
+                    ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                                  "aws payload hashing got a request body buffer that is not in memory");
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+                continue;
+            }
+
+            if (ngx_http_aws_auth_hash_copy(r, ctx, cl->buf->pos, cl->buf->last - cl->buf->pos) != NGX_OK) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+        }
+
+        if (ngx_http_aws_auth_hash_next(r, ctx) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        return ngx_http_next_request_body_filter(r, in);
+    }
+#endif
+
+    if (!ctx->hashing) {
+        return ngx_http_next_request_body_filter(r, in);
+    }
+
+    for (cl = in; cl; cl = cl->next) {
+        if (ngx_buf_in_memory(cl->buf)) {
+            ngx_aws_auth__payload_digest_update(&ctx->digest, cl->buf->pos, cl->buf->last - cl->buf->pos);
+
+        } else if (ngx_buf_size(cl->buf) > 0) {
+            /* buffers reach this filter straight off the socket, before
+               the save filter writes them out; anything else is a bug */
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "aws payload hashing got a request body buffer that is not in memory");
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (cl->buf->last_buf) {
+            ctx->hashing = 0;
+            if (ngx_aws_auth__payload_digest_final(r->pool, &ctx->digest) != NGX_OK) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+        }
+    }
+
+    return ngx_http_next_request_body_filter(r, in);
+}
+
+/* $aws_content_length, the length of the body the upstream gets: that of
+   the aws-chunked framing, or the client's */
+static ngx_int_t
+ngx_http_aws_auth_content_length_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_aws_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_aws_auth_module);
+    off_t length;
+
+    length = (ctx != NULL && ctx->framing) ? ctx->framed_length : r->headers_in.content_length_n;
+    if (length < 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->data = ngx_pnalloc(r->pool, NGX_OFF_T_LEN);
+    if (v->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(v->data, "%O", length) - v->data;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+static char *
+ngx_http_aws_endpoint(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    char *p = conf;
+
+    ngx_str_t *field, *value;
+
+    field = (ngx_str_t * )(p + cmd->offset);
+
+    value = cf->args->elts;
+
+    *field = value[1];
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_aws_s3_bucket(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_aws_auth_conf_t *mconf = conf;
+    ngx_http_compile_complex_value_t ccv;
+    ngx_http_complex_value_t *cv;
+    ngx_str_t *value;
+
+    if (mconf->bucket_name.data != NULL || mconf->bucket_value != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    cv = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+    if (cv == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = cv;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cv->lengths == NULL) {
+        /* a single bucket, its template is compiled with the configuration */
+        mconf->bucket_name = value[1];
+    } else {
+        mconf->bucket_value = cv;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_aws_sign(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_aws_auth_conf_t *mconf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_aws_auth_module);
+    ngx_str_t *value = cf->args->elts;
+
+    if (cf->args->nelts == 2) {
+        if (ngx_strcmp(value[1].data, "lazy") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid value \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+        mconf->lazy = 1;
+    }
+    mconf->enabled = 1;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_aws_hash_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+#if (NGX_THREADS)
+    ngx_http_aws_auth_conf_t *mconf = conf;
+    ngx_str_t *value;
+
+    if (mconf->hash_thread_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    mconf->hash_thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (mconf->hash_thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+#else
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"aws_hash_thread_pool\" requires nginx built --with-threads");
+    return NGX_CONF_ERROR;
+#endif
+}
+
+static char *
+ngx_http_aws_sign_batch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_aws_auth_conf_t *mconf = conf;
+    ngx_str_t *value;
+    ngx_int_t n;
+
+    if (mconf->sign_batch != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts > 2) {
+            return "takes no timeout when off";
+        }
+        mconf->sign_batch = 0;
+        return NGX_CONF_OK;
+    }
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n < 2 || n > AWS_SIGN_BATCH_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid aws sign batch size \"%V\", it must be 2 to %d",
+                           &value[1], AWS_SIGN_BATCH_MAX);
+        return NGX_CONF_ERROR;
+    }
+    mconf->sign_batch = n;
+
+    if (cf->args->nelts > 2) {
+        mconf->sign_batch_timeout = ngx_parse_time(&value[2], 0);
+        if (mconf->sign_batch_timeout == (ngx_msec_t) NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid aws sign batch timeout \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_aws_fanout(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_aws_auth_conf_t *mconf = conf;
+    ngx_str_t *value;
+    ngx_int_t n;
+
+    if (mconf->fanout_parallel != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts > 2) {
+            return "takes no parameters when off";
+        }
+        mconf->fanout_parallel = 0;
+        return NGX_CONF_OK;
+    }
+
+    if (value[1].data[0] != '/' || cf->args->nelts < 3) {
+        return "takes the URI prefix of the range subrequests and how many to make at once";
+    }
+    mconf->fanout_uri = value[1];
+
+    n = ngx_atoi(value[2].data, value[2].len);
+    if (n < 2 || n > AWS_FANOUT_PARALLEL_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid aws fanout parallelism \"%V\", it must be 2 to %d",
+                           &value[2], AWS_FANOUT_PARALLEL_MAX);
+        return NGX_CONF_ERROR;
+    }
+    mconf->fanout_parallel = n;
+
+    if (cf->args->nelts > 3) {
+        mconf->fanout_part_size = ngx_parse_size(&value[3]);
+        if (mconf->fanout_part_size == (size_t) NGX_ERROR || mconf->fanout_part_size < AWS_FANOUT_PART_SIZE_MIN) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid aws fanout part size \"%V\", it must be at least %dk",
+                               &value[3], AWS_FANOUT_PART_SIZE_MIN / 1024);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_aws_multipart(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_aws_auth_conf_t *mconf = conf;
+    ngx_str_t *value;
+    ngx_int_t n;
+
+    if (mconf->multipart_parallel != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts > 2) {
+            return "takes no parameters when off";
+        }
+        mconf->multipart_parallel = 0;
+        return NGX_CONF_OK;
+    }
+
+    if (value[1].data[0] != '/' || cf->args->nelts < 3) {
+        return "takes the URI prefix of the upload subrequests and how many parts to upload at once";
+    }
+    mconf->multipart_uri = value[1];
+
+    n = ngx_atoi(value[2].data, value[2].len);
+    if (n < 1 || n > AWS_MULTIPART_PARALLEL_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid aws multipart parallelism \"%V\", it must be 1 to %d",
+                           &value[2], AWS_MULTIPART_PARALLEL_MAX);
+        return NGX_CONF_ERROR;
+    }
+    mconf->multipart_parallel = n;
+
+    if (cf->args->nelts > 3) {
+        mconf->multipart_part_size = ngx_parse_size(&value[3]);
+        if (mconf->multipart_part_size == (size_t) NGX_ERROR
+            || mconf->multipart_part_size < AWS_MULTIPART_PART_SIZE_MIN) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid aws multipart part size \"%V\", it must be at least %dm",
+                               &value[3], AWS_MULTIPART_PART_SIZE_MIN / (1024 * 1024));
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_aws_signing_key_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_aws_auth_main_conf_t *amcf = conf;
+    ngx_http_aws_auth_key_cache_t *cache;
+    ngx_str_t *value;
+    ssize_t size;
+
+    if (amcf->key_zone != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[2]);
+    if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid aws signing key zone size \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_aws_auth_key_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    cache->confs = &amcf->confs;
+    cache->pool = cf->pool;
+
+    amcf->key_zone = ngx_shared_memory_add(cf, &value[1], size, &ngx_http_aws_auth_module);
+    if (amcf->key_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (amcf->key_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "aws signing key zone \"%V\" is already defined", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    amcf->key_zone->init = ngx_http_aws_auth_init_key_zone;
+    amcf->key_zone->data = cache;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_aws_verify_key(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_aws_auth_main_conf_t *amcf = conf;
+    ngx_http_aws_auth_access_key_node_t *ak;
+    ngx_str_t *value;
+    uint32_t hash;
+
+    value = cf->args->elts;
+
+    hash = ngx_crc32_long(value[1].data, value[1].len);
+
+    if (ngx_str_rbtree_lookup(&amcf->access_keys, &value[1], hash) != NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate aws verify key \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (value[1].len == 0 || value[2].len == 0 || ngx_strlchr(value[1].data, value[1].data + value[1].len, '/')) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid aws verify key \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    ak = ngx_pcalloc(cf->pool, sizeof(ngx_http_aws_auth_access_key_node_t));
+    if (ak == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    ak->sn.str = value[1];
+    ak->sn.node.key = hash;
+    ak->secret_key = value[2];
+
+    ngx_rbtree_insert(&amcf->access_keys, &ak->sn.node);
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_aws_auth_add_variables(ngx_conf_t *cf) {
+    static ngx_http_variable_t vars[] = {
+            {ngx_string(AWS_PRESIGNED_URL_VARIABLE), NULL, ngx_http_aws_auth_presigned_url_variable, 0, 0, 0},
+            /* cached per request: the token and the date it was signed with
+               are computed once, whichever is asked for first */
+            {ngx_string(AWS_S3_VARIABLE), NULL, ngx_http_aws_auth_token_variable, 0, 0, 0},
+            {ngx_string(AWS_DATE_VARIABLE), NULL, ngx_http_aws_auth_date_variable, 0, 0, 0},
+            /* subrequests share the cached variables of the main request,
+               each of those of aws_fanout and aws_multipart has its own */
+            {ngx_string(AWS_SUBREQUEST_TOKEN_VARIABLE), NULL, ngx_http_aws_auth_subrequest_variable,
+             offsetof(ngx_http_aws_auth_subrequest_t, token), NGX_HTTP_VAR_NOCACHEABLE, 0},
+            {ngx_string(AWS_SUBREQUEST_DATE_VARIABLE), NULL, ngx_http_aws_auth_subrequest_variable,
+             offsetof(ngx_http_aws_auth_subrequest_t, date), NGX_HTTP_VAR_NOCACHEABLE, 0},
+            {ngx_string(AWS_PART_RANGE_VARIABLE), NULL, ngx_http_aws_auth_subrequest_variable,
+             offsetof(ngx_http_aws_auth_subrequest_t, range), NGX_HTTP_VAR_NOCACHEABLE, 0},
+            {ngx_string(AWS_CONTENT_SHA256_VARIABLE), NULL, ngx_http_aws_auth_subrequest_variable,
+             offsetof(ngx_http_aws_auth_subrequest_t, payload_hash), NGX_HTTP_VAR_NOCACHEABLE, 0},
+            {ngx_string(AWS_S3_HOST_VARIABLE), NULL, ngx_http_aws_auth_host_variable, 0, 0, 0},
+            {ngx_string(AWS_CONTENT_LENGTH_VARIABLE), NULL, ngx_http_aws_auth_content_length_variable, 0,
+             NGX_HTTP_VAR_NOCACHEABLE, 0},
+    };
+    ngx_http_variable_t *var;
+    ngx_uint_t i;
+
+    for (i = 0; i < sizeof(vars) / sizeof(vars[0]); i++) {
+        var = ngx_http_add_variable(cf, &vars[i].name, vars[i].flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = vars[i].get_handler;
+        var->data = vars[i].data;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_aws_auth_req_init(ngx_conf_t *cf) {
+    ngx_http_handler_pt *h;
+    ngx_http_core_main_conf_t *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers);
+    if (h == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "Missing NGX HTTP ACCESS PHASE handlers");
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_aws_proxy_sign;
+
+    ngx_http_next_request_body_filter = ngx_http_top_request_body_filter;
+    ngx_http_top_request_body_filter = ngx_http_aws_auth_body_filter;
+
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_aws_auth_header_filter;
 
     return NGX_OK;
 }
\ No newline at end of file
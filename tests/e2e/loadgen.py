@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+"""Closed-loop load generator for the end-to-end harness.
+
+Each of `--concurrency` threads keeps one connection open and sends a mix of
+GET and HEAD requests over a fixed set of object keys and query strings until
+`--requests` have been sent in total. The result is printed as one JSON line:
+
+  {"requests": 20000, "errors": 0, "rps": 4211.3, "status": {"200": 20000},
+   "latency_ms": {"GET": {"p50": 1.52, "p90": 2.31, "p99": 4.02, "max": 9.8}, ...}}
+
+The exit status is 1 if any request failed or did not get a 2xx.
+"""
+import argparse
+import http.client
+import json
+import random
+import sys
+import threading
+import time
+
+# URI and query shapes the signer handles differently: plain and deep keys,
+# keys needing URI escaping, argument lists to sort, repeated keys sorted by
+# value, empty values, escaped arguments to decode and escape again
+PATHS = [
+    '/index.html',
+    '/photos/2015/08/30/IMG_0001.jpg',
+    '/' + '/'.join('segment-%03d' % i for i in range(64)) + '.bin',
+    '/docs/annual%20report%20(final).pdf',
+    '/%E5%86%99%E7%9C%9F/%C3%A9t%C3%A9.png',
+    '/a-_.~b/c%2Bd',
+]
+QUERIES = [
+    '',
+    'versionId=3HL4kqtJlcpXroDTDmJ',
+    'x-id=GetObject&partNumber=1',
+    'tag=b&tag=a&tag=&expression=ab',
+    'list-type=2&prefix=a%2Fb&delimiter=%2f&start-after=%7Ea%20b',
+    '&'.join('arg-%02d=value-%d' % (50 - i, i) for i in range(50)),
+]
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0.0
+    return sorted_values[min(len(sorted_values) - 1, int(len(sorted_values) * p / 100.0))]
+
+
+def targets():
+    # the module signs the path of a request with a query string as
+    # received rather than decoded: escapes only appear in paths sent
+    # without one, query strings are decoded either way
+    for path in PATHS:
+        for query in QUERIES:
+            if query and '%' in path:
+                continue
+            yield path + ('?' + query if query else '')
+
+
+class Worker(threading.Thread):
+    def __init__(self, conf, index, counter, urls):
+        threading.Thread.__init__(self)
+        self.conf = conf
+        self.counter = counter
+        self.urls = urls
+        self.random = random.Random(index)
+        self.latencies = {'GET': [], 'HEAD': []}
+        self.status = {}
+        self.errors = 0
+
+    def run(self):
+        conn = None
+        while self.counter.take():
+            method = 'HEAD' if self.random.random() < self.conf.head_ratio else 'GET'
+            url = self.random.choice(self.urls)
+            start = time.perf_counter()
+            try:
+                if conn is None:
+                    conn = http.client.HTTPConnection(self.conf.host, self.conf.port, timeout=self.conf.timeout)
+                conn.request(method, url)
+                response = conn.getresponse()
+                response.read()
+            except (OSError, http.client.HTTPException) as e:
+                self.errors += 1
+                sys.stderr.write('%s %s: %s\n' % (method, url, e))
+                if conn is not None:
+                    conn.close()
+                conn = None
+                continue
+
+            self.latencies[method].append((time.perf_counter() - start) * 1000.0)
+            self.status[response.status] = self.status.get(response.status, 0) + 1
+            if response.status // 100 != 2:
+                sys.stderr.write('%s %s: %d\n' % (method, url, response.status))
+            if response.will_close:
+                conn.close()
+                conn = None
+
+        if conn is not None:
+            conn.close()
+
+
+class Counter(object):
+    def __init__(self, n):
+        self.lock = threading.Lock()
+        self.left = n
+
+    def take(self):
+        with self.lock:
+            if self.left == 0:
+                return False
+            self.left -= 1
+            return True
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=18080)
+    parser.add_argument('--requests', type=int, default=20000)
+    parser.add_argument('--concurrency', type=int, default=16)
+    parser.add_argument('--head-ratio', type=float, default=0.2)
+    parser.add_argument('--timeout', type=float, default=10.0)
+    conf = parser.parse_args()
+
+    urls = list(targets())
+    counter = Counter(conf.requests)
+    workers = [Worker(conf, i, counter, urls) for i in range(conf.concurrency)]
+
+    start = time.perf_counter()
+    for worker in workers:
+        worker.start()
+    for worker in workers:
+        worker.join()
+    elapsed = time.perf_counter() - start
+
+    status = {}
+    latencies = {'GET': [], 'HEAD': []}
+    errors = 0
+    for worker in workers:
+        errors += worker.errors
+        for code, n in worker.status.items():
+            status[code] = status.get(code, 0) + n
+        for method, values in worker.latencies.items():
+            latencies[method].extend(values)
+
+    failed = errors + sum(n for code, n in status.items() if code // 100 != 2)
+    result = {
+        'requests': conf.requests,
+        'errors': failed,
+        'rps': round(conf.requests / elapsed, 1),
+        'status': dict((str(code), n) for code, n in sorted(status.items())),
+        'latency_ms': {},
+    }
+    for method, values in latencies.items():
+        values.sort()
+        result['latency_ms'][method] = dict(
+            [('p%d' % p, round(percentile(values, p), 2)) for p in (50, 90, 99)]
+            + [('max', round(values[-1], 2) if values else 0.0)])
+
+    print(json.dumps(result))
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
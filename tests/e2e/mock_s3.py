@@ -0,0 +1,223 @@
+#!/usr/bin/env python3
+"""A local stand-in for S3 that checks the AWS SigV4 signature of every request.
+
+Objects are not stored: GET returns `--object-size` bytes derived from the
+key and HEAD their headers. A request whose signature does not verify gets a
+403 SignatureDoesNotMatch carrying the canonical request and string to sign
+the mock computed, as S3 does, and is logged to stderr. On SIGTERM/SIGINT the
+counts are printed to stdout as one JSON line.
+
+The signature is computed per the SigV4 documentation, independently of the
+module (see reference-impl-py/reference_v4.py for the key derivation).
+"""
+import argparse
+import hashlib
+import hmac
+import json
+import signal
+import sys
+import threading
+from datetime import datetime, timezone
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import quote, unquote_to_bytes
+from xml.sax.saxutils import escape
+
+ALGORITHM = 'AWS4-HMAC-SHA256'
+MAX_CLOCK_SKEW = 15 * 60
+
+
+def sign(key, msg):
+    return hmac.new(key, msg.encode('utf-8'), hashlib.sha256).digest()
+
+
+def signing_key(secret_key, date, region, service):
+    k_date = sign(('AWS4' + secret_key).encode('utf-8'), date)
+    k_region = sign(k_date, region)
+    k_service = sign(k_region, service)
+    return sign(k_service, 'aws4_request')
+
+
+def uri_encode(raw, safe):
+    return quote(unquote_to_bytes(raw), safe=safe)
+
+
+def canonical_uri(path):
+    return uri_encode(path, '/-_.~') or '/'
+
+
+def canonical_query_string(query):
+    args = []
+    for arg in query.split('&') if query else []:
+        key, _, value = arg.partition('=')
+        args.append((uri_encode(key, '-_.~'), uri_encode(value, '-_.~')))
+    return '&'.join('%s=%s' % kv for kv in sorted(args))
+
+
+def parse_authorization(value):
+    algorithm, _, rest = value.partition(' ')
+    if algorithm != ALGORITHM:
+        raise ValueError('unsupported algorithm %r' % algorithm)
+    fields = {}
+    for part in rest.split(','):
+        name, _, field = part.strip().partition('=')
+        fields[name] = field
+    access_key, date, region, service, terminator = fields['Credential'].split('/')
+    if terminator != 'aws4_request':
+        raise ValueError('malformed credential scope')
+    return {
+        'access_key': access_key,
+        'scope': '/'.join((date, region, service, terminator)),
+        'date': date,
+        'region': region,
+        'service': service,
+        'signed_headers': fields['SignedHeaders'].split(';'),
+        'signature': fields['Signature'],
+    }
+
+
+class Stats(object):
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.counts = {'verified': 0, 'rejected': 0}
+
+    def add(self, name):
+        with self.lock:
+            self.counts[name] += 1
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+    server_version = 'MockS3'
+    # headers and body are written separately
+    disable_nagle_algorithm = True
+
+    def log_message(self, fmt, *args):
+        if self.server.verbose:
+            BaseHTTPRequestHandler.log_message(self, fmt, *args)
+
+    def verify(self, body):
+        """None when the request is signed correctly, the 403 body otherwise"""
+        conf = self.server.conf
+        try:
+            auth = parse_authorization(self.headers['Authorization'] or '')
+        except (KeyError, ValueError) as e:
+            return 'AccessDenied', 'bad Authorization header: %s' % e, None
+
+        if auth['access_key'] != conf.access_key:
+            return 'InvalidAccessKeyId', auth['access_key'], None
+        if (auth['region'], auth['service']) != (conf.region, conf.service):
+            return 'AuthorizationHeaderMalformed', auth['scope'], None
+
+        amz_date = self.headers['x-amz-date'] or ''
+        try:
+            when = datetime.strptime(amz_date, '%Y%m%dT%H%M%SZ').replace(tzinfo=timezone.utc)
+        except ValueError:
+            return 'AccessDenied', 'bad x-amz-date %r' % amz_date, None
+        if abs((datetime.now(timezone.utc) - when).total_seconds()) > MAX_CLOCK_SKEW:
+            return 'RequestTimeTooSkewed', amz_date, None
+        if auth['date'] != amz_date[:8]:
+            return 'AuthorizationHeaderMalformed', auth['scope'], None
+
+        payload_hash = self.headers['x-amz-content-sha256'] or ''
+        if len(payload_hash) == 64 and payload_hash != hashlib.sha256(body).hexdigest():
+            return 'XAmzContentSHA256Mismatch', payload_hash, None
+
+        headers = []
+        for name in auth['signed_headers']:
+            values = self.headers.get_all(name)
+            if values is None:
+                return 'AccessDenied', 'signed header %s missing' % name, None
+            headers.append('%s:%s\n' % (name, ','.join(' '.join(v.split()) for v in values)))
+
+        path, _, query = self.path.partition('?')
+        canonical_request = '\n'.join((
+            self.command,
+            canonical_uri(path),
+            canonical_query_string(query),
+            ''.join(headers),
+            ';'.join(auth['signed_headers']),
+            payload_hash,
+        ))
+        string_to_sign = '\n'.join((
+            ALGORITHM,
+            amz_date,
+            auth['scope'],
+            hashlib.sha256(canonical_request.encode('utf-8')).hexdigest(),
+        ))
+        key = signing_key(conf.secret_key, auth['date'], conf.region, conf.service)
+        expected = hmac.new(key, string_to_sign.encode('utf-8'), hashlib.sha256).hexdigest()
+
+        if not hmac.compare_digest(expected, auth['signature']):
+            return 'SignatureDoesNotMatch', canonical_request, string_to_sign
+        return None
+
+    def reply_error(self, code, detail, string_to_sign):
+        self.server.stats.add('rejected')
+        sys.stderr.write('%s %s: %s\n%s\n%s\n\n' % (self.command, self.path, code, detail, string_to_sign or ''))
+        body = ('<?xml version="1.0" encoding="UTF-8"?>\n<Error><Code>%s</Code>'
+                '<CanonicalRequest>%s</CanonicalRequest><StringToSign>%s</StringToSign></Error>'
+                % (code, escape(detail), escape(string_to_sign or ''))).encode('utf-8')
+        self.send_response(403)
+        self.send_header('Content-Type', 'application/xml')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        if self.command != 'HEAD':
+            self.wfile.write(body)
+
+    def handle_object(self):
+        length = int(self.headers['Content-Length'] or 0)
+        body = self.rfile.read(length) if length else b''
+
+        error = self.verify(body)
+        if error is not None:
+            self.reply_error(*error)
+            return
+
+        self.server.stats.add('verified')
+        seed = hashlib.sha256(self.path.partition('?')[0].encode('utf-8')).digest()
+        payload = (seed * (self.server.conf.object_size // len(seed) + 1))[:self.server.conf.object_size]
+        self.send_response(200)
+        self.send_header('Content-Type', 'application/octet-stream')
+        self.send_header('Content-Length', str(len(payload)))
+        self.send_header('ETag', '"%s"' % hashlib.md5(payload).hexdigest())
+        self.end_headers()
+        if self.command != 'HEAD':
+            self.wfile.write(payload)
+
+    do_GET = handle_object
+    do_HEAD = handle_object
+    do_PUT = handle_object
+    do_DELETE = handle_object
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--listen', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=18081)
+    parser.add_argument('--access-key', required=True)
+    parser.add_argument('--secret-key', required=True)
+    parser.add_argument('--region', default='us-east-1')
+    parser.add_argument('--service', default='s3')
+    parser.add_argument('--object-size', type=int, default=1024)
+    parser.add_argument('-v', '--verbose', action='store_true')
+    conf = parser.parse_args()
+
+    server = ThreadingHTTPServer((conf.listen, conf.port), Handler)
+    server.daemon_threads = True
+    server.conf = conf
+    server.verbose = conf.verbose
+    server.stats = Stats()
+
+    def stop(signum, frame):
+        threading.Thread(target=server.shutdown).start()
+
+    signal.signal(signal.SIGTERM, stop)
+    signal.signal(signal.SIGINT, stop)
+
+    server.serve_forever()
+    print(json.dumps(server.stats.counts))
+    sys.stdout.flush()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,126 @@
+#!/bin/sh
+# End-to-end harness: nginx with this module in front of mock_s3.py, which
+# verifies the signature of every request it gets, driven by loadgen.py.
+# Everything listens on 127.0.0.1, nothing leaves the machine.
+#
+# usage: tests/e2e/run.sh [path/to/nginx]   (default $NGX_PATH/objs/nginx)
+#
+# NGX_AWS_AUTH_MODULE  path of the module's .so when nginx was built with
+#                      --add-dynamic-module
+# NGINX_PORT, MOCK_PORT, E2E_REQUESTS, E2E_CONCURRENCY, E2E_HEAD_RATIO
+#                      override the defaults below; further arguments of the
+#                      load generator can be given in E2E_LOADGEN_ARGS
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+NGINX=${1:-${NGX_PATH}/objs/nginx}
+NGINX_PORT=${NGINX_PORT:-18080}
+MOCK_PORT=${MOCK_PORT:-18081}
+
+ACCESS_KEY=AKIDEXAMPLE
+SECRET_KEY=wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY
+REGION=us-east-1
+BUCKET=examplebucket
+
+if [ ! -x "$NGINX" ]; then
+    echo "no nginx binary at '$NGINX', build it first (make nginx)" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/ngx_aws_auth_e2e.XXXXXX")
+mkdir -p "$WORK/logs"
+
+MOCK_PID=
+cleanup() {
+    if [ -f "$WORK/logs/nginx.pid" ]; then
+        "$NGINX" -p "$WORK" -c nginx.conf -s stop 2>/dev/null || true
+    fi
+    if [ -n "$MOCK_PID" ]; then
+        kill "$MOCK_PID" 2>/dev/null || true
+        wait "$MOCK_PID" 2>/dev/null || true
+    fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+wait_port() {
+    python3 - "$1" <<'EOF'
+import socket, sys, time
+for _ in range(100):
+    try:
+        socket.create_connection(('127.0.0.1', int(sys.argv[1])), 0.1).close()
+        sys.exit(0)
+    except OSError:
+        time.sleep(0.1)
+sys.exit('nothing listening on port %s' % sys.argv[1])
+EOF
+}
+
+{
+    if [ -n "$NGX_AWS_AUTH_MODULE" ]; then
+        echo "load_module $NGX_AWS_AUTH_MODULE;"
+    fi
+    cat <<EOF
+worker_processes 2;
+error_log logs/error.log warn;
+pid logs/nginx.pid;
+
+events {
+    worker_connections 1024;
+}
+
+http {
+    access_log off;
+
+    upstream mock_s3 {
+        server 127.0.0.1:$MOCK_PORT;
+        keepalive 32;
+    }
+
+    server {
+        listen 127.0.0.1:$NGINX_PORT;
+
+        aws_access_key $ACCESS_KEY;
+        aws_secret_key $SECRET_KEY;
+        aws_region $REGION;
+        aws_service s3;
+        aws_s3_bucket $BUCKET;
+
+        location / {
+            aws_sign;
+            proxy_pass http://mock_s3;
+            proxy_http_version 1.1;
+            proxy_set_header Connection "";
+            proxy_set_header Host $BUCKET.s3.amazonaws.com;
+        }
+    }
+}
+EOF
+} > "$WORK/nginx.conf"
+
+python3 "$HERE/mock_s3.py" --port "$MOCK_PORT" --access-key "$ACCESS_KEY" --secret-key "$SECRET_KEY" \
+    --region "$REGION" > "$WORK/logs/mock_stats.json" 2> "$WORK/logs/mock.log" &
+MOCK_PID=$!
+wait_port "$MOCK_PORT"
+
+"$NGINX" -p "$WORK" -c nginx.conf
+wait_port "$NGINX_PORT"
+
+STATUS=0
+# shellcheck disable=SC2086
+python3 "$HERE/loadgen.py" --port "$NGINX_PORT" --requests "${E2E_REQUESTS:-20000}" \
+    --concurrency "${E2E_CONCURRENCY:-16}" --head-ratio "${E2E_HEAD_RATIO:-0.2}" $E2E_LOADGEN_ARGS || STATUS=$?
+
+kill "$MOCK_PID"
+wait "$MOCK_PID" || true
+MOCK_PID=
+echo "mock: $(cat "$WORK/logs/mock_stats.json")"
+
+if [ "$STATUS" -ne 0 ]; then
+    echo "--- rejected by the mock" >&2
+    head -n 40 "$WORK/logs/mock.log" >&2
+    echo "--- nginx error.log" >&2
+    tail -n 20 "$WORK/logs/error.log" >&2
+fi
+
+exit "$STATUS"